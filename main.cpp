@@ -18,453 +18,9337 @@ PLEASE FILL OUT THIS SECTION PRIOR TO SUBMISSION
 */
 
 #include <iostream>
+#include <iomanip>
 #include <vector>
 #include <fstream>
 #include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include <array>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <dirent.h>
+#include <atomic>
+#include <new>
+#include <sstream>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <deque>
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
 using namespace std;
 
+// Heap allocation counters, reported by --bench and --trace
+// The buffer pool always counts the pixel buffers it allocates. Counting every
+// other allocation replaces the global operator new and delete, so it is only
+// compiled in with -DENABLE_ALLOC_COUNT (ENABLE_TRACE turns it on as well);
+// counting is then two relaxed atomic adds per operator new.
+#if defined(ENABLE_ALLOC_COUNT) || defined(ENABLE_TRACE)
+#define COUNT_HEAP_ALLOCATIONS
+#endif
+atomic<long long> allocation_count(0);
+atomic<long long> allocated_bytes(0);
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+void* operator new(size_t size)
+{
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    allocated_bytes.fetch_add((long long)size, memory_order_relaxed);
+    void* block = malloc(size ? size : 1);
+    if (!block)
+    {
+        throw bad_alloc();
+    }
+    return block;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+// Not inlined, so the compiler doesn't mistake the free() for a mismatched delete
+__attribute__((noinline)) void operator delete(void* block) noexcept
+{
+    free(block);
+}
+
+__attribute__((noinline)) void operator delete[](void* block) noexcept
+{
+    free(block);
+}
+
+#ifdef __cpp_sized_deallocation
+__attribute__((noinline)) void operator delete(void* block, size_t) noexcept
+{
+    free(block);
+}
+
+__attribute__((noinline)) void operator delete[](void* block, size_t) noexcept
+{
+    free(block);
+}
+#endif
+
+#ifdef __cpp_aligned_new
+void* operator new(size_t size, align_val_t alignment)
+{
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    allocated_bytes.fetch_add((long long)size, memory_order_relaxed);
+    void* block = nullptr;
+    size_t align = max((size_t)alignment, sizeof(void*));
+    if (posix_memalign(&block, align, size ? size : 1) != 0)
+    {
+        throw bad_alloc();
+    }
+    return block;
+}
+
+void* operator new[](size_t size, align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+__attribute__((noinline)) void operator delete(void* block, align_val_t) noexcept
+{
+    free(block);
+}
+
+__attribute__((noinline)) void operator delete[](void* block, align_val_t) noexcept
+{
+    free(block);
+}
+
+__attribute__((noinline)) void operator delete(void* block, size_t, align_val_t) noexcept
+{
+    free(block);
+}
+
+__attribute__((noinline)) void operator delete[](void* block, size_t, align_val_t) noexcept
+{
+    free(block);
+}
+#endif
+#endif
+
+// Tracing, compiled in with -DENABLE_TRACE and turned on with --trace FILE
+// TRACE_SCOPE("name") times the rest of the enclosing block as one event and
+// TRACE_BYTES(count) adds to the bytes the innermost open event moved. Events
+// go to FILE as Chrome trace JSON (chrome://tracing, Perfetto) and a summary
+// table goes to stderr at exit. Without ENABLE_TRACE both macros expand to
+// nothing, arguments included.
+#ifdef ENABLE_TRACE
+struct TraceEvent
+{
+    const char* name;
+    int thread;
+    double start;           // Microseconds since the trace started
+    double duration;        // Microseconds
+    long long bytes;
+    long long allocations;  // Made by any thread while the event was open
+};
+
+struct TraceLog
+{
+    bool enabled = false;
+    string path;
+    chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+    mutex lock;
+    vector<TraceEvent> events;
+};
+
+TraceLog& trace_log()
+{
+    static TraceLog log;
+    return log;
+}
+
+/**
+ * Gets a small number for the calling thread, for the trace's thread lanes
+ * @return the thread number, 0 for the first thread that asks
+ */
+int trace_thread()
+{
+    static atomic<int> next_thread(0);
+    thread_local int thread = next_thread++;
+    return thread;
+}
+
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name) : name(name), active(trace_log().enabled)
+    {
+        if (active)
+        {
+            parent = current;
+            current = this;
+            allocations = allocation_count;
+            start = chrono::steady_clock::now();
+        }
+    }
+
+    ~TraceScope()
+    {
+        if (!active)
+        {
+            return;
+        }
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        current = parent;
+        TraceLog& log = trace_log();
+        TraceEvent event = {name, trace_thread(),
+                            chrono::duration<double, micro>(start - log.origin).count(),
+                            chrono::duration<double, micro>(end - start).count(),
+                            bytes, allocation_count - allocations};
+        lock_guard<mutex> guard(log.lock);
+        log.events.push_back(event);
+    }
+
+    static void add_bytes(long long count)
+    {
+        if (current)
+        {
+            current->bytes += count;
+        }
+    }
+
+private:
+    const char* name;
+    bool active;
+    TraceScope* parent = nullptr;
+    chrono::steady_clock::time_point start;
+    long long bytes = 0;
+    long long allocations = 0;
+    static thread_local TraceScope* current;
+};
+thread_local TraceScope* TraceScope::current = nullptr;
+
+/**
+ * Writes the trace file and prints the summary table
+ * Registered with atexit() by --trace
+ */
+void write_trace()
+{
+    TraceLog& log = trace_log();
+    lock_guard<mutex> guard(log.lock);
+
+    ofstream file(log.path);
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (size_t i = 0; i < log.events.size(); i++)
+    {
+        const TraceEvent& event = log.events[i];
+        file << (i ? ",\n" : "\n") << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+             << event.thread << ", \"ts\": " << fixed << setprecision(3) << event.start << ", \"dur\": " << event.duration
+             << ", \"args\": {\"bytes\": " << event.bytes << ", \"allocations\": " << event.allocations << "}}";
+    }
+    file << "\n]}\n";
+    if (!file.good())
+    {
+        cerr << "Could not write trace to " << log.path << endl;
+    }
+
+    // Totals per name, most time first (an event's time includes the events inside it)
+    struct Total
+    {
+        string name;
+        long long calls;
+        double microseconds;
+        long long bytes;
+        long long allocations;
+    };
+    vector<Total> totals;
+    for (const TraceEvent& event : log.events)
+    {
+        size_t i = 0;
+        while (i < totals.size() && totals[i].name != event.name)
+        {
+            i++;
+        }
+        if (i == totals.size())
+        {
+            totals.push_back({event.name, 0, 0, 0, 0});
+        }
+        totals[i].calls++;
+        totals[i].microseconds += event.duration;
+        totals[i].bytes += event.bytes;
+        totals[i].allocations += event.allocations;
+    }
+    sort(totals.begin(), totals.end(), [](const Total& a, const Total& b) { return a.microseconds > b.microseconds; });
+
+    cerr << left << setw(24) << "event" << right << setw(8) << "calls" << setw(12) << "total ms" << setw(12) << "mean ms"
+         << setw(12) << "MB" << setw(10) << "MB/s" << setw(12) << "allocs" << endl;
+    cerr << fixed << setprecision(2);
+    for (const Total& total : totals)
+    {
+        double megabytes = total.bytes / 1e6;
+        cerr << left << setw(24) << total.name << right << setw(8) << total.calls << setw(12) << total.microseconds / 1e3
+             << setw(12) << total.microseconds / 1e3 / total.calls << setw(12) << megabytes << setw(10)
+             << (total.bytes ? megabytes / (total.microseconds / 1e6) : 0.0) << setw(12) << total.allocations << endl;
+    }
+}
+
+/**
+ * Starts tracing, for --trace
+ * @param path The trace file to write at exit
+ */
+void start_trace(const string& path)
+{
+    TraceLog& log = trace_log();
+    log.path = path;
+    log.events.reserve(1 << 16);
+    log.origin = chrono::steady_clock::now();
+    log.enabled = true;
+    atexit(write_trace);
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_BYTES(count) TraceScope::add_bytes(count)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_BYTES(count)
+#endif
+
+// Pixel buffer pool class
+// Keeps the pixel buffers of images that went away, by size class, and hands
+// them out again, so a steady stream of same-sized images (a batch, repeated
+// menu operations, the rotations of a chain) stops allocating after the first
+// few. Size classes go up in eighths of a power of two, so a buffer is at most
+// 12.5% bigger than asked for. Buffers are 64-byte aligned. Misses count
+// towards the heap allocation counters.
+class BufferPool
+{
+public:
+    /**
+     * Gets a buffer of at least the given size, reusing a free one if possible
+     * @param size     The size in bytes
+     * @param capacity Set to the actual size of the buffer
+     * @return the buffer
+     */
+    uint8_t* acquire(size_t size, size_t& capacity)
+    {
+        int size_class = class_of(size, capacity);
+        {
+            lock_guard<mutex> guard(lock);
+            vector<uint8_t*>& buffers = free_buffers[size_class];
+            if (!buffers.empty())
+            {
+                uint8_t* buffer = buffers.back();
+                buffers.pop_back();
+                held_bytes -= capacity;
+                hits++;
+                return buffer;
+            }
+            misses++;
+        }
+        void* buffer = nullptr;
+        if (posix_memalign(&buffer, 64, capacity) != 0)
+        {
+            throw bad_alloc();
+        }
+        allocation_count.fetch_add(1, memory_order_relaxed);
+        allocated_bytes.fetch_add((long long)capacity, memory_order_relaxed);
+        return (uint8_t*)buffer;
+    }
+
+    /**
+     * Takes a buffer back for reuse, or frees it if the pool is full
+     * @param buffer   The buffer, from acquire()
+     * @param capacity Its capacity, from acquire()
+     */
+    void release(uint8_t* buffer, size_t capacity)
+    {
+        size_t unused;
+        int size_class = class_of(capacity, unused);
+        {
+            lock_guard<mutex> guard(lock);
+            if (held_bytes + capacity <= POOL_LIMIT)
+            {
+                free_buffers[size_class].push_back(buffer);
+                held_bytes += capacity;
+                return;
+            }
+        }
+        free(buffer);
+    }
+
+    long long hit_count() const
+    {
+        return hits;
+    }
+
+    long long miss_count() const
+    {
+        return misses;
+    }
+
+private:
+    // Most bytes kept in free buffers; anything released beyond this is freed
+    static const size_t POOL_LIMIT = (size_t)512 << 20;
+    static const int CLASSES = 8 * 64;
+
+    /**
+     * Gets the size class of a buffer size
+     * @param size     The size in bytes
+     * @param capacity Set to the size of the buffers in that class
+     * @return the class number
+     */
+    static int class_of(size_t size, size_t& capacity)
+    {
+        // Sizes in (2^octave, 2^(octave+1)] round up to a multiple of an eighth of 2^octave
+        size = max(size, (size_t)4096);
+        int octave = 11;
+        while (((size_t)2 << octave) < size)
+        {
+            octave++;
+        }
+        size_t step = (size_t)1 << (octave - 3);
+        capacity = (size + step - 1) / step * step;
+        return (octave - 11) * 8 + (int)(capacity / step) - 9;
+    }
+
+    mutex lock;
+    vector<uint8_t*> free_buffers[CLASSES];
+    size_t held_bytes = 0;
+    atomic<long long> hits{0};
+    atomic<long long> misses{0};
+};
+
+/**
+ * Gets the pool all image buffers come from
+ * It is never destroyed, so images that outlive main() can still give their buffers back.
+ * @return the pool
+ */
+BufferPool& buffer_pool()
+{
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+// Pixel buffer class
+// Holds a buffer from the pool, which goes back to the pool once the last
+// buffer using it goes away. Copies share the pixels until one of them is
+// written to through data(), which first gives that one a buffer of its own,
+// so a cached image can be handed out without copying it up front.
+class PixelBuffer
+{
+public:
+    PixelBuffer() {}
+
+    explicit PixelBuffer(size_t size) : length(size)
+    {
+        if (size)
+        {
+            size_t capacity;
+            uint8_t* pixels = buffer_pool().acquire(size, capacity);
+            block = shared_ptr<uint8_t>(pixels, [capacity](uint8_t* buffer) {
+                buffer_pool().release(buffer, capacity);
+            });
+        }
+    }
+
+    PixelBuffer(const PixelBuffer& other) : block(other.block), length(other.length)
+    {
+        if (block)
+        {
+            sole = false;
+            other.sole = false;
+        }
+    }
+
+    PixelBuffer(PixelBuffer&& other) noexcept
+    {
+        swap(other);
+    }
+
+    PixelBuffer& operator=(const PixelBuffer& other)
+    {
+        PixelBuffer copy(other);
+        swap(copy);
+        return *this;
+    }
+
+    PixelBuffer& operator=(PixelBuffer&& other) noexcept
+    {
+        PixelBuffer taken(move(other));
+        swap(taken);
+        return *this;
+    }
+
+    void swap(PixelBuffer& other) noexcept
+    {
+        block.swap(other.block);
+        std::swap(length, other.length);
+        bool was_sole = sole.load(memory_order_relaxed);
+        sole.store(other.sole.load(memory_order_relaxed), memory_order_relaxed);
+        other.sole.store(was_sole, memory_order_relaxed);
+    }
+
+    uint8_t* data()
+    {
+        if (!sole.load(memory_order_acquire))
+        {
+            unshare();
+        }
+        return block.get();
+    }
+
+    const uint8_t* data() const
+    {
+        return block.get();
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+private:
+    /**
+     * Copies the pixels into a buffer of this one's own if another buffer still
+     * shares them. The rows of one image may be written from several threads
+     * at once, so the first of them does it and the others wait for it.
+     */
+    void unshare()
+    {
+        static mutex lock;
+        lock_guard<mutex> guard(lock);
+        if (sole.load(memory_order_relaxed))
+        {
+            return;
+        }
+        if (block.use_count() > 1)
+        {
+            PixelBuffer copy(length);
+            memcpy(copy.block.get(), block.get(), length);
+            block.swap(copy.block);
+        }
+        // The last other user may have just let go: see its reads before writing
+        atomic_thread_fence(memory_order_acquire);
+        sole.store(true, memory_order_release);
+    }
+
+    shared_ptr<uint8_t> block;
+    size_t length = 0;
+    mutable atomic<bool> sole{true};  // Whether no other buffer shares the pixels
+};
+
+// Memory mapped file structure
+// Unmaps the file when the last image using it goes away
+// (path is only set for shared mappings, whose changes go back to the file,
+// and source only for private ones, whose changes do not)
+// A file read into memory rather than mapped keeps its bytes in `contents`,
+// and address stays MAP_FAILED.
+struct MappedFile
+{
+    string path;
+    string source;
+    void* address = MAP_FAILED;
+    size_t length = 0;
+    PixelBuffer contents;
+
+    ~MappedFile()
+    {
+        if (address != MAP_FAILED)
+        {
+            munmap(address, length);
+        }
+    }
+};
+
 //***************************************************************************************************//
 //                                DO NOT MODIFY THE SECTION BELOW                                    //
 //***************************************************************************************************//
 
-// Pixel structure
-struct Pixel
+// Channel offsets inside a pixel
+// Note: pixels are kept in blue, green, red order, the same order BMP files use
+const int BLUE = 0;
+const int GREEN = 1;
+const int RED = 2;
+const int BYTES_PER_PIXEL = 3;
+
+// Image structure
+// All pixels live in one contiguous buffer of 8-bit channels. Rows are stored
+// from top to bottom and each row starts `stride` bytes after the previous one.
+// The stride is padded to a multiple of four bytes, which is exactly how a
+// 24-bit BMP scanline is laid out. The buffer comes from (and goes back to)
+// the buffer pool.
+// A mapped image points into a memory mapped BMP file instead of owning its
+// pixels. Its stride is negative because BMP rows are stored bottom to top.
+// Note: copies of a mapped image share the same pixels. Copies of any other
+// image share them only until one of them is written to (see PixelBuffer).
+struct Image
+{
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+    PixelBuffer data;
+    shared_ptr<MappedFile> mapping;
+    uint8_t* mapped_pixels = nullptr;
+
+    bool empty() const
+    {
+        return width == 0 || height == 0;
+    }
+
+    uint8_t* row(int y)
+    {
+        return (mapping ? mapped_pixels : data.data()) + (ptrdiff_t)y * stride;
+    }
+
+    const uint8_t* row(int y) const
+    {
+        return (mapping ? mapped_pixels : data.data()) + (ptrdiff_t)y * stride;
+    }
+};
+
+// The most pixel bytes an image may take, as much as a BMP file can hold
+const long long MAX_IMAGE_BYTES = 1LL << 32;
+
+/**
+ * Checks that an image of the given size can be held and indexed
+ * Rows (up to four bytes a pixel, padded) must fit an int, so no size math on
+ * the image can overflow, and the padded 24-bit rows together must stay within
+ * MAX_IMAGE_BYTES. Every decoder checks the sizes it reads from a file with
+ * this first, and every effect the size of the image it makes.
+ * @param width  The width in pixels
+ * @param height The height in pixels
+ * @return True if the size is usable and false otherwise
+ */
+bool image_size_fits(long long width, long long height)
+{
+    if (width <= 0 || height <= 0 || width > (INT_MAX - 3) / 4)
+    {
+        return false;
+    }
+    long long stride = (width * 3 + 3) & ~3LL;
+    return height <= MAX_IMAGE_BYTES / stride;
+}
+
+/**
+ * Gets the number of bytes in a row, padded to a multiple of four bytes
+ * @param width The width of the image in pixels
+ * @return the padded row size in bytes
+ */
+int padded_stride(int width)
+{
+    return (int)(((long long)width * BYTES_PER_PIXEL + 3) & ~3LL);
+}
+
+/**
+ * Creates a new image of the given size
+ * The buffer may be a recycled one, so the pixels are not cleared: every
+ * caller fills them all in.
+ * @param width  The width of the image in pixels
+ * @param height The height of the image in pixels
+ * @return the new image
+ */
+Image make_image(int width, int height)
+{
+    Image image;
+    image.width = width;
+    image.height = height;
+    image.stride = padded_stride(width);
+    image.data = PixelBuffer((size_t)image.stride * height);
+    return image;
+}
+
+/**
+ * Gets a little-endian integer from a byte array.
+ * Helper function for read_image()
+ * @param arr    the byte array
+ * @param offset the offset at which to read the integer
+ * @param bytes  the number of bytes to read
+ * @return the integer starting at the given offset
+ */
+int get_int(const unsigned char arr[], int offset, int bytes)
+{
+    unsigned int result = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        result = result | ((unsigned int)arr[offset+i] << (i*8));
+    }
+    return (int)result;
+}
+
+// BMP and DIB header sizes written by write_image()
+const int BMP_HEADER_SIZE = 14;
+const int DIB_HEADER_SIZE = 40;
+// The largest file the 32-bit size fields of the headers can describe
+const long long MAX_BMP_FILE_SIZE = 0xFFFFFFFFLL;
+
+// End of line, delta and end of bitmap codes let a small RLE pixel array stand
+// for any number of pixels, so compressed images are capped at this many
+const long long MAX_RLE_PIXELS = 1LL << 28;
+
+// BMP file structure
+// The properties read_image() and friends need from the BMP and DIB headers
+struct BmpInfo
+{
+    int start = 0;          // Offset of the pixel array in the file
+    int width = 0;
+    int height = 0;
+    int bits_per_pixel = 0;
+    int file_stride = 0;    // Bytes per scanline in the file, including padding
+    bool top_down = false;  // Rows stored from top to bottom (negative height)
+    int compression = 0;    // BI_RGB (0), BI_RLE8 (1), BI_RLE4 (2) or BI_BITFIELDS (3)
+    int palette_start = 0;  // Offset of the color table in the file (indexed images only)
+    int colors = 0;         // Entries in the color table (indexed images only)
+};
+
+/**
+ * Gets the image properties from the BMP and DIB headers
+ * Only uncompressed 24-bit and 32-bit pixels are supported
+ * (32-bit images may use BI_BITFIELDS, which is still plain BGRA)
+ * Helper function for read_image()
+ * @param header The first 54 bytes of the file
+ * @param info   Filled in with the image properties
+ * @return True if this is a supported BMP image and false otherwise
+ */
+bool parse_bmp_header(const unsigned char header[], BmpInfo& info)
+{
+    if (header[0] != 'B' || header[1] != 'M')
+    {
+        return false;
+    }
+
+    // Get the image properties
+    long long file_size = (unsigned int)get_int(header, 2, 4);
+    info.start = get_int(header, 10, 4);
+    info.width = get_int(header, 18, 4);
+    info.height = get_int(header, 22, 4);
+    info.bits_per_pixel = get_int(header, 28, 2);
+    int compression = get_int(header, 30, 4);
+
+    // A negative height means the rows are stored from top to bottom
+    info.top_down = info.height < 0;
+    if (info.top_down)
+    {
+        info.height = -info.height;
+    }
+
+    if (!image_size_fits(info.width, info.height) || info.start < 54 ||
+        !((info.bits_per_pixel == 24 && compression == 0) ||
+          (info.bits_per_pixel == 32 && (compression == 0 || compression == 3))))
+    {
+        return false;
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    long long scanline_size = (long long)info.width * (info.bits_per_pixel / 8);
+    info.file_stride = (int)((scanline_size + 3) & ~3LL);
+
+    // Not a valid image if the pixel array does not fill the file
+    return file_size == info.start + (long long)info.file_stride * info.height;
+}
+
+/**
+ * Gets the image properties from the headers of an indexed (palettized) BMP
+ * Supports 1, 4 and 8 bits per pixel, uncompressed, plus RLE8 for 8-bit and
+ * RLE4 for 4-bit images. Compressed images must be stored bottom to top.
+ * Helper function for read_image()
+ * @param header The first 54 bytes of the file
+ * @param info   Filled in with the image properties
+ * @return True if this is a supported indexed BMP image and false otherwise
+ */
+bool parse_indexed_bmp_header(const unsigned char header[], BmpInfo& info)
+{
+    if (header[0] != 'B' || header[1] != 'M')
+    {
+        return false;
+    }
+
+    long long file_size = (unsigned int)get_int(header, 2, 4);
+    int dib_size = get_int(header, 14, 4);
+    info.start = get_int(header, 10, 4);
+    info.width = get_int(header, 18, 4);
+    info.height = get_int(header, 22, 4);
+    info.bits_per_pixel = get_int(header, 28, 2);
+    info.compression = get_int(header, 30, 4);
+    info.colors = get_int(header, 46, 4);
+    // The color table follows the DIB header and must end before the pixel array
+    long long palette_start = 14LL + dib_size;
+
+    info.top_down = info.height < 0;
+    if (info.top_down)
+    {
+        info.height = -info.height;
+    }
+
+    int bits = info.bits_per_pixel;
+    if (bits != 1 && bits != 4 && bits != 8)
+    {
+        return false;
+    }
+    // An empty color table means a full one
+    if (info.colors <= 0 || info.colors > (1 << bits))
+    {
+        info.colors = 1 << bits;
+    }
+    bool compressed = (bits == 8 && info.compression == 1) || (bits == 4 && info.compression == 2);
+    info.file_stride = (int)(((long long)info.width * bits + 31) / 32 * 4);
+
+    if (!image_size_fits(info.width, info.height) || dib_size < DIB_HEADER_SIZE ||
+        info.start < palette_start + info.colors * 4LL || file_size < info.start ||
+        !(compressed || info.compression == 0) || (compressed && info.top_down) ||
+        (compressed && (long long)info.width * info.height > MAX_RLE_PIXELS))
+    {
+        return false;
+    }
+    info.palette_start = (int)palette_start;
+    // Compressed pixel arrays have no fixed size, but uncompressed ones must fill the file
+    return compressed ? file_size > info.start
+                      : file_size >= info.start + (long long)info.file_stride * info.height;
+}
+
+/**
+ * Decodes the RLE8 or RLE4 pixel array of a BMP into one palette index per pixel
+ * Pixels skipped by delta codes, or never reached, keep index 0. Codes that
+ * run past the edge of the image are clipped.
+ * Helper function for read_indexed_image()
+ * @param data    The pixel array
+ * @param size    The size of the pixel array in bytes
+ * @param info    The image properties
+ * @param indices Filled in with width * height indices, rows from bottom to top
+ */
+void decode_bmp_rle(const uint8_t* data, size_t size, const BmpInfo& info, vector<uint8_t>& indices)
+{
+    int width = info.width;
+    int height = info.height;
+    bool four_bits = info.bits_per_pixel == 4;
+    indices.assign((size_t)width * height, 0);
+    int x = 0, y = 0;
+    size_t i = 0;
+    // x stops at the right edge, so long runs and deltas cannot overflow it
+    auto put = [&](int index) {
+        if (x < width)
+        {
+            if (y < height)
+            {
+                indices[(size_t)y * width + x] = index;
+            }
+            x++;
+        }
+    };
+
+    while (i + 1 < size && y < height)
+    {
+        int count = data[i];
+        int value = data[i + 1];
+        i += 2;
+        if (count > 0)
+        {
+            // Encoded mode: count pixels of one index (alternating two for RLE4)
+            for (int n = 0; n < count; n++)
+            {
+                put(four_bits ? (n % 2 == 0 ? value >> 4 : value & 0x0F) : value);
+            }
+        }
+        else if (value == 0)
+        {
+            // End of line
+            x = 0;
+            y++;
+        }
+        else if (value == 1)
+        {
+            // End of bitmap
+            break;
+        }
+        else if (value == 2)
+        {
+            // Delta: move right and up
+            if (i + 1 >= size)
+            {
+                break;
+            }
+            x = min(x + data[i], width);
+            y += data[i + 1];
+            i += 2;
+        }
+        else
+        {
+            // Absolute mode: value literal indices, padded to a 16-bit boundary
+            int bytes = four_bits ? (value + 1) / 2 : value;
+            if (i + bytes > size)
+            {
+                break;
+            }
+            for (int n = 0; n < value; n++)
+            {
+                put(four_bits ? (n % 2 == 0 ? data[i + n / 2] >> 4 : data[i + n / 2] & 0x0F) : data[i + n]);
+            }
+            i += bytes + (bytes & 1);
+        }
+    }
+}
+
+/**
+ * Reads the color table and pixel array of an indexed BMP into an image
+ * Helper function for read_image()
+ * @param stream The file, positioned right after the first 54 bytes
+ * @param info   The image properties, from parse_indexed_bmp_header()
+ * @return the image, or an empty image if the file is cut short
+ */
+Image read_indexed_image(fstream& stream, const BmpInfo& info)
+{
+    // The rest of the file (color table and pixel array) in one read
+    const int HEADER_BYTES = BMP_HEADER_SIZE + DIB_HEADER_SIZE;
+    vector<uint8_t> rest;
+    stream.seekg(0, ios::end);
+    streamoff file_end = stream.tellg();
+    if (file_end < info.start + (info.compression ? 0 : (long long)info.file_stride * info.height))
+    {
+        return {};
+    }
+    rest.resize((size_t)(file_end - HEADER_BYTES));
+    stream.seekg(HEADER_BYTES);
+    if (!stream.read((char*)rest.data(), rest.size()))
+    {
+        return {};
+    }
+    TRACE_BYTES(file_end);
+
+    // Indices outside the color table come out black
+    uint8_t colors[256][BYTES_PER_PIXEL] = {{0}};
+    const uint8_t* table = rest.data() + (info.palette_start - HEADER_BYTES);
+    for (int c = 0; c < info.colors; c++)
+    {
+        colors[c][BLUE] = table[4 * c];
+        colors[c][GREEN] = table[4 * c + 1];
+        colors[c][RED] = table[4 * c + 2];
+    }
+    const uint8_t* data = rest.data() + (info.start - HEADER_BYTES);
+    size_t data_size = rest.size() - (info.start - HEADER_BYTES);
+
+    int width = info.width;
+    int height = info.height;
+    Image image = make_image(width, height);
+    vector<uint8_t> indices;
+    if (info.compression != 0)
+    {
+        decode_bmp_rle(data, data_size, info, indices);
+    }
+    int bits = info.bits_per_pixel;
+    int mask = (1 << bits) - 1;
+    for (int i = 0; i < height; i++)
+    {
+        uint8_t* dst = image.row(info.top_down ? i : height - 1 - i);
+        if (!indices.empty())
+        {
+            const uint8_t* src = indices.data() + (size_t)i * width;
+            for (int j = 0; j < width; j++, dst += BYTES_PER_PIXEL)
+            {
+                memcpy(dst, colors[src[j]], BYTES_PER_PIXEL);
+            }
+            continue;
+        }
+        // Packed indices, most significant bits first
+        const uint8_t* src = data + (size_t)i * info.file_stride;
+        for (int j = 0; j < width; j++, dst += BYTES_PER_PIXEL)
+        {
+            int bit = j * bits;
+            int index = (src[bit >> 3] >> (8 - bits - (bit & 7))) & mask;
+            memcpy(dst, colors[index], BYTES_PER_PIXEL);
+        }
+    }
+    return image;
+}
+
+/**
+ * Reads a binary PGM (P5) or PPM (P6) image with 8-bit samples
+ * Gray samples go to all three channels.
+ * Helper function for read_image()
+ * @param stream The file, positioned at its start
+ * @return the image, or an empty image if the file is not a supported PGM/PPM
+ */
+Image read_netpbm_image(fstream& stream)
+{
+    char magic[2];
+    if (!stream.read(magic, 2) || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6'))
+    {
+        return {};
+    }
+    bool gray = magic[1] == '5';
+
+    // Width, height and maximum value, separated by whitespace and # comments
+    long long fields[3];
+    for (long long& field : fields)
+    {
+        int c = stream.get();
+        while (isspace(c) || c == '#')
+        {
+            if (c == '#')
+            {
+                while (c != '\n' && c != EOF)
+                {
+                    c = stream.get();
+                }
+            }
+            c = stream.get();
+        }
+        if (!isdigit(c))
+        {
+            return {};
+        }
+        field = 0;
+        while (isdigit(c) && field <= INT_MAX)
+        {
+            field = field * 10 + (c - '0');
+            c = stream.get();
+        }
+        if (!isspace(c))
+        {
+            return {};
+        }
+    }
+    // Exactly one whitespace character separates the header from the samples
+    int width = (int)min<long long>(fields[0], INT_MAX);
+    int height = (int)min<long long>(fields[1], INT_MAX);
+    if (!image_size_fits(fields[0], fields[1]) || fields[2] != 255)
+    {
+        return {};
+    }
+
+    Image image = make_image(width, height);
+    int channels = gray ? 1 : 3;
+    vector<uint8_t> row((size_t)width * channels);
+    TRACE_BYTES((long long)row.size() * height);
+    for (int i = 0; i < height; i++)
+    {
+        if (!stream.read((char*)row.data(), row.size()))
+        {
+            return {};
+        }
+        uint8_t* dst = image.row(i);
+        const uint8_t* src = row.data();
+        for (int j = 0; j < width; j++, src += channels, dst += BYTES_PER_PIXEL)
+        {
+            // Samples are red, green, blue
+            dst[RED] = src[0];
+            dst[GREEN] = src[gray ? 0 : 1];
+            dst[BLUE] = src[gray ? 0 : 2];
+        }
+    }
+    return image;
+}
+
+/**
+ * Reads the BMP image specified and returns the resulting image
+ * Supports uncompressed 24-bit and 32-bit images (the alpha channel is dropped),
+ * indexed 1, 4 and 8-bit images (uncompressed, RLE8 or RLE4) and, whatever the
+ * file name, binary PGM/PPM files
+ * @param filename BMP image filename
+ * @return the image, or an empty image if the file is not a valid BMP
+ */
+Image read_image(string filename)
+{
+    TRACE_SCOPE("read_image");
+    // Open the binary file
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+
+    if (stream.peek() == 'P')
+    {
+        return read_netpbm_image(stream);
+    }
+
+    // Read both headers in one go
+    unsigned char header[54] = {0};
+    BmpInfo info;
+    if (!stream.read((char*)header, sizeof(header)))
+    {
+        return {};
+    }
+    if (!parse_bmp_header(header, info))
+    {
+        if (!parse_indexed_bmp_header(header, info))
+        {
+            return {};
+        }
+        // A compressed image's size is not backed by the file, so it may not fit in memory
+        try
+        {
+            return read_indexed_image(stream, info);
+        }
+        catch (const bad_alloc&)
+        {
+            return {};
+        }
+    }
+    int width = info.width;
+    int height = info.height;
+    int file_stride = info.file_stride;
+    bool top_down = info.top_down;
+
+    // Create an image the size of the input image
+    Image image = make_image(width, height);
+    stream.seekg(info.start);
+    TRACE_BYTES(info.start + (long long)file_stride * height);
+
+    // Note: BMP files store pixels from bottom to top unless the height was negative
+    if (info.bits_per_pixel == 24)
+    {
+        // A 24-bit scanline is already laid out like an image row (blue, green, red
+        // plus padding), so each one is read straight into place
+        for (int i = 0; i < height; i++)
+        {
+            int row = top_down ? i : height - 1 - i;
+            if (!stream.read((char*)image.row(row), file_stride))
+            {
+                return {};
+            }
+        }
+    }
+    else
+    {
+        // Read a band of scanlines at a time and drop the alpha channel
+        const int BAND_BYTES = 1 << 20;
+        int band_rows = max(1, BAND_BYTES / file_stride);
+        vector<unsigned char> band((size_t)band_rows * file_stride);
+
+        for (int i = 0; i < height; i += band_rows)
+        {
+            int rows = min(band_rows, height - i);
+            if (!stream.read((char*)band.data(), (streamsize)rows * file_stride))
+            {
+                return {};
+            }
+            for (int r = 0; r < rows; r++)
+            {
+                const unsigned char* src = band.data() + (size_t)r * file_stride;
+                uint8_t* dst = image.row(top_down ? i + r : height - 1 - (i + r));
+                for (int j = 0; j < width; j++, src += 4, dst += BYTES_PER_PIXEL)
+                {
+                    dst[BLUE] = src[0];
+                    dst[GREEN] = src[1];
+                    dst[RED] = src[2];
+                }
+            }
+        }
+    }
+
+    // Close the stream and return the image
+    stream.close();
+    return image;
+}
+
+/**
+ * Sets a value to the char array starting at the offset using the size
+ * specified by the bytes.
+ * This is a helper function for write_image()
+ * @param arr    Array to set values for
+ * @param offset Starting index offset
+ * @param bytes  Number of bytes to set
+ * @param value  Value to set
+ * @return nothing
+ */
+void set_bytes(unsigned char arr[], int offset, int bytes, int value)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        arr[offset+i] = (unsigned char)(value>>(i*8));
+    }
+}
+
+/**
+ * Fills in the BMP and DIB headers for a 24-bit image
+ * This is a helper function for write_image()
+ * @param header        Array of BMP_HEADER_SIZE+DIB_HEADER_SIZE bytes to fill in
+ * @param width_pixels  Width of the image in pixels
+ * @param height_pixels Height of the image in pixels
+ * @return the size of the pixel array in bytes, including padding, or -1 if
+ *         the file would not fit the 32-bit size fields (the headers are
+ *         filled in either way)
+ */
+long long set_bmp_headers(unsigned char header[], int width_pixels, int height_pixels)
+{
+    // Calculate the width in bytes incorporating padding (4 byte alignment)
+    long long width_bytes = (long long)width_pixels * 3;
+    long long padding_bytes = 0;
+    padding_bytes = (4 - width_bytes % 4) % 4;
+    width_bytes = width_bytes + padding_bytes;
+
+    // Pixel array size in bytes, including padding
+    long long array_bytes = width_bytes * height_pixels;
+
+    unsigned char* bmp_header = header;
+    unsigned char* dib_header = header + BMP_HEADER_SIZE;
+
+    // BMP Header
+    set_bytes(bmp_header,  0, 1, 'B');              // ID field
+    set_bytes(bmp_header,  1, 1, 'M');              // ID field
+    set_bytes(bmp_header,  2, 4, (int)(uint32_t)(BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes)); // Size of BMP file
+    set_bytes(bmp_header,  6, 2, 0);                // Reserved
+    set_bytes(bmp_header,  8, 2, 0);                // Reserved
+    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
+    set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
+    set_bytes(dib_header, 20, 4, (int)(uint32_t)array_bytes); // Size of raw bitmap data (including padding)
+    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
+    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+
+    return BMP_HEADER_SIZE + DIB_HEADER_SIZE + array_bytes <= MAX_BMP_FILE_SIZE ? array_bytes : -1;
+}
+
+/**
+ * Writes a list of buffers to a file, picking up after partial writes
+ * This is a helper function for write_image()
+ * @param fd      The file descriptor
+ * @param buffers The buffers (advanced past whatever has been written)
+ * @param count   The number of buffers
+ * @return True if everything was written and false otherwise
+ */
+bool write_buffers(int fd, iovec* buffers, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, buffers, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        // Skip the buffers that went out whole, then the part of the next one that did
+        while (count > 0 && (size_t)written >= buffers->iov_len)
+        {
+            written -= buffers->iov_len;
+            buffers++;
+            count--;
+        }
+        if (count > 0)
+        {
+            buffers->iov_base = (char*)buffers->iov_base + written;
+            buffers->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sizes a new file up front, so the filesystem allocates it in one go instead
+ * of block by block as the writes come in
+ * Where fallocate() is not available (or the filesystem does not support it)
+ * the file is extended with ftruncate() instead.
+ * @param fd   The file descriptor
+ * @param size The file size in bytes
+ * @return True if the file now has the given size and false otherwise
+ */
+bool reserve_file(int fd, off_t size)
+{
+#ifdef __linux__
+    if (fallocate(fd, 0, 0, size) == 0)
+    {
+        return true;
+    }
+#endif
+    return ftruncate(fd, size) == 0;
+}
+
+
+/**
+ * Write the input image to a BMP file name specified
+ * The rows go straight from the image to the file with writev(), up to
+ * IOV_MAX buffers (headers, rows and padding) per system call, so nothing is
+ * copied or encoded on the way.
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @return True if successful and false otherwise
+ */
+bool write_image(string filename, const Image& image)
+{
+    TRACE_SCOPE("write_image");
+    if (image.empty())
+    {
+        return false;
+    }
+
+    // Get the image width and height in pixels
+    int width_pixels = image.width;
+    int height_pixels = image.height;
+    int row_bytes = width_pixels * BYTES_PER_PIXEL;
+    int padding_bytes = (4 - row_bytes % 4) % 4;
+
+    // Create the BMP and DIB Headers
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE] = {0};
+    long long array_bytes = set_bmp_headers(header, width_pixels, height_pixels);
+    if (array_bytes < 0)
+    {
+        return false;
+    }
+    long long file_size = sizeof(header) + array_bytes;
+    TRACE_BYTES(file_size);
+
+    // Open the file for writing, replacing whatever was there
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    // If there was a problem opening the file, return false
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // Reserve the space up front, so the filesystem allocates it in one go
+    // instead of block by block as the writes come in
+    reserve_file(fd, file_size);
+
+    // Headers, then the pixel array (left to right, bottom to top, with padding)
+    // Note: the rows are already in blue, green, red order so each one is a single buffer
+    static const unsigned char padding[3] = {0};
+    // The batch lives on the stack so writing does not allocate
+    iovec buffers[IOV_MAX];
+    int count = 0;
+    buffers[count++] = {header, sizeof(header)};
+    bool ok = true;
+    for (int h = height_pixels - 1; h >= 0 && ok; h--)
+    {
+        buffers[count++] = {(void*)image.row(h), (size_t)row_bytes};
+        if (padding_bytes)
+        {
+            buffers[count++] = {(void*)padding, (size_t)padding_bytes};
+        }
+        if (h == 0 || count + 2 > IOV_MAX)
+        {
+            ok = write_buffers(fd, buffers, count);
+            count = 0;
+        }
+    }
+
+    // Close the file and report whether it all went out
+    return close(fd) == 0 && ok;
+}
+
+//***************************************************************************************************//
+//                                DO NOT MODIFY THE SECTION ABOVE                                    //
+//***************************************************************************************************//
+
+/**
+ * Reads or writes a list of buffers at a position in a file, picking up after
+ * partial transfers (reading past the end of the file is a failure)
+ * This is a helper function for the tiled image class and read_bmp_info()
+ * @param fd      The file descriptor
+ * @param buffers The buffers (advanced past whatever has been transferred)
+ * @param count   The number of buffers
+ * @param offset  The file position of the first buffer
+ * @param writing True to write the buffers and false to read them
+ * @return True if everything was transferred and false otherwise
+ */
+bool transfer_buffers_at(int fd, iovec* buffers, int count, off_t offset, bool writing)
+{
+    while (count > 0)
+    {
+#ifdef __linux__
+        ssize_t done = writing ? pwritev(fd, buffers, count, offset) : preadv(fd, buffers, count, offset);
+#else
+        // One buffer at a time where preadv()/pwritev() are not available
+        ssize_t done = writing ? pwrite(fd, buffers->iov_base, buffers->iov_len, offset)
+                               : pread(fd, buffers->iov_base, buffers->iov_len, offset);
+#endif
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return false;
+        }
+        offset += done;
+        while (count > 0 && (size_t)done >= buffers->iov_len)
+        {
+            done -= buffers->iov_len;
+            buffers++;
+            count--;
+        }
+        if (count > 0)
+        {
+            buffers->iov_base = (char*)buffers->iov_base + done;
+            buffers->iov_len -= done;
+        }
+    }
+    return true;
+}
+
+// Encoded file structure
+// An output file ready to be written: its bytes are `buffers`, in order. The
+// encoder's own bytes (headers, packed pixels) live in `chunks`, and buffers
+// may also point into `image`, which holds on to pixels that go out as they
+// are, so the file can still be written once the caller's image is gone.
+struct EncodedFile
+{
+    vector<iovec> buffers;
+    vector<vector<uint8_t>> chunks;
+    Image image;
+    long long size = 0;
+
+    // Adds bytes of the encoder's own (moving a vector keeps its bytes where they are)
+    void add_chunk(vector<uint8_t> bytes)
+    {
+        chunks.push_back(move(bytes));
+        add(chunks.back().data(), chunks.back().size());
+    }
+
+    // Adds bytes that stay where they are until the file is written
+    void add(const void* data, size_t length)
+    {
+        buffers.push_back({(void*)data, length});
+        size += length;
+    }
+};
+
+/**
+ * Writes an encoded file, IOV_MAX buffers per writev() call
+ * @param filename The file name to save to
+ * @param file     The encoded file
+ * @return True if successful and false otherwise
+ */
+bool write_encoded_file(const string& filename, const EncodedFile& file)
+{
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    // Reserve the space up front (see write_image)
+    reserve_file(fd, file.size);
+
+    iovec buffers[IOV_MAX];
+    bool ok = true;
+    for (size_t i = 0; i < file.buffers.size() && ok; i += IOV_MAX)
+    {
+        int count = (int)min<size_t>(IOV_MAX, file.buffers.size() - i);
+        copy(file.buffers.begin() + i, file.buffers.begin() + i + count, buffers);
+        ok = write_buffers(fd, buffers, count);
+    }
+    return close(fd) == 0 && ok;
+}
+
+/**
+ * Reads just the headers of a BMP file
+ * @param filename BMP image filename
+ * @param info     Filled in with the image properties
+ * @return True if this is a supported BMP image and false otherwise
+ */
+bool read_bmp_info(const string& filename, BmpInfo& info)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+    iovec buffer = {header, sizeof(header)};
+    bool ok = transfer_buffers_at(fd, &buffer, 1, 0, false) && parse_bmp_header(header, info);
+    close(fd);
+    return ok;
+}
+
+/**
+ * Encodes the input image as a 24-bit BMP file, like write_image()
+ * Only the headers are new bytes: the rows are buffers pointing into the image,
+ * so it must outlive the write (or be moved into file.image).
+ * @param image The input image to save
+ * @param file  Filled in with the file
+ * @return True if successful and false if the image is too big for a BMP file
+ */
+bool encode_bmp24_image(const Image& image, EncodedFile& file)
+{
+    vector<uint8_t> header(BMP_HEADER_SIZE + DIB_HEADER_SIZE);
+    if (set_bmp_headers(header.data(), image.width, image.height) < 0)
+    {
+        return false;
+    }
+    file.add_chunk(move(header));
+
+    static const unsigned char padding[3] = {0};
+    int row_bytes = image.width * BYTES_PER_PIXEL;
+    int padding_bytes = (4 - row_bytes % 4) % 4;
+    file.buffers.reserve(file.buffers.size() + (size_t)image.height * (padding_bytes ? 2 : 1));
+    for (int h = image.height - 1; h >= 0; h--)
+    {
+        file.add(image.row(h), row_bytes);
+        if (padding_bytes)
+        {
+            file.add(padding, padding_bytes);
+        }
+    }
+    return true;
+}
+
+/**
+ * Makes an image whose pixels are the pixel array of a BMP file in memory
+ * Helper function for map_image() and the asynchronous batch reader
+ * @param mapping The mapping (or buffer) holding the whole file, kept alive by the image
+ * @param bytes   The first byte of the file
+ * @return the image, or an empty image if the file is not an uncompressed 24-bit BMP
+ */
+Image image_in_bmp_bytes(shared_ptr<MappedFile> mapping, uint8_t* bytes)
+{
+    // Get the image properties
+    BmpInfo info;
+    if (mapping->length < BMP_HEADER_SIZE + DIB_HEADER_SIZE || !parse_bmp_header(bytes, info) ||
+        info.bits_per_pixel != 24 || info.start + (size_t)info.file_stride * info.height > mapping->length)
+    {
+        return {};
+    }
+    int width = info.width;
+    int height = info.height;
+    int start = info.start;
+    int file_stride = info.file_stride;
+    bool top_down = info.top_down;
+
+    Image image;
+    image.width = width;
+    image.height = height;
+    image.mapping = mapping;
+    if (top_down)
+    {
+        image.stride = file_stride;
+        image.mapped_pixels = bytes + start;
+    }
+    else
+    {
+        image.stride = -file_stride;
+        image.mapped_pixels = bytes + start + (size_t)(height - 1) * file_stride;
+    }
+    return image;
+}
+
+/**
+ * Checks whether two file names refer to the same existing file
+ * @param first  The first file name
+ * @param second The second file name
+ * @return True if both names exist and have the same device and inode
+ */
+bool is_same_file(const string& first, const string& second)
+{
+    struct stat first_info;
+    struct stat second_info;
+    return stat(first.c_str(), &first_info) == 0 && stat(second.c_str(), &second_info) == 0
+        && first_info.st_dev == second_info.st_dev && first_info.st_ino == second_info.st_ino;
+}
+
+/**
+ * Checks whether an image's pixels are privately mapped from a file
+ * Creating that file again would truncate the pixels before they are written
+ * out, so writers copy such an image first.
+ * @param image    The image
+ * @param filename The file name about to be written
+ * @return True if the image is mapped from that file and false otherwise
+ */
+bool is_mapped_from(const Image& image, const string& filename)
+{
+    return image.mapping && !image.mapping->source.empty() && is_same_file(image.mapping->source, filename);
+}
+
+/**
+ * Maps the BMP image specified into memory instead of reading it
+ * The mapping is private (copy-on-write), so effects can change the pixels in
+ * place without touching the file. Only uncompressed 24-bit images can be
+ * mapped since their rows are already in the Image layout.
+ * @param filename BMP image filename
+ * @return the mapped image, or an empty image if the file cannot be mapped
+ */
+Image map_image(string filename)
+{
+    TRACE_SCOPE("map_image");
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return {};
+    }
+
+    struct stat file_info;
+    if (fstat(fd, &file_info) != 0 || file_info.st_size < BMP_HEADER_SIZE + DIB_HEADER_SIZE)
+    {
+        close(fd);
+        return {};
+    }
+
+    shared_ptr<MappedFile> mapping = make_shared<MappedFile>();
+    mapping->source = filename;
+    mapping->length = file_info.st_size;
+    mapping->address = mmap(nullptr, mapping->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping->address == MAP_FAILED)
+    {
+        return {};
+    }
+    madvise(mapping->address, mapping->length, MADV_SEQUENTIAL);
+    return image_in_bmp_bytes(mapping, (uint8_t*)mapping->address);
+}
+
+/**
+ * Creates a new BMP file of the given size and maps its pixel array into memory
+ * The headers are filled in right away. Whatever is written into the returned
+ * image goes straight to the file, so nothing needs to be written afterwards.
+ * @param filename The BMP file name to create
+ * @param width    The width of the image in pixels
+ * @param height   The height of the image in pixels
+ * @return the mapped image, or an empty image if the file cannot be created
+ */
+Image map_output_image(string filename, int width, int height)
+{
+    TRACE_SCOPE("map_output_image");
+    if (width <= 0 || height <= 0)
+    {
+        return {};
+    }
+
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE] = {0};
+    long long array_bytes = set_bmp_headers(header, width, height);
+    if (array_bytes < 0)
+    {
+        return {};
+    }
+
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return {};
+    }
+
+    // Note: ftruncate zero-fills the file, so the row padding is already zero
+    shared_ptr<MappedFile> mapping = make_shared<MappedFile>();
+    mapping->path = filename;
+    mapping->length = sizeof(header) + (size_t)array_bytes;
+    if (ftruncate(fd, mapping->length) == 0)
+    {
+        mapping->address = mmap(nullptr, mapping->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping->address == MAP_FAILED)
+    {
+        return {};
+    }
+    memcpy(mapping->address, header, sizeof(header));
+
+    // Rows are stored from bottom to top
+    int file_stride = padded_stride(width);
+    Image image;
+    image.width = width;
+    image.height = height;
+    image.stride = -file_stride;
+    image.mapping = mapping;
+    image.mapped_pixels = (uint8_t*)mapping->address + sizeof(header) + (size_t)(height - 1) * file_stride;
+    return image;
+}
+
+/**
+ * Write the input image to a BMP file name specified through a memory mapping
+ * The output file is sized up front and the rows are copied straight into the
+ * mapped pixel array, without going through a stream buffer.
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @return True if successful and false otherwise
+ */
+bool write_image_mapped(string filename, const Image& image)
+{
+    TRACE_SCOPE("write_image_mapped");
+    if (image.empty())
+    {
+        return false;
+    }
+
+    // The image already lives in this file
+    if (image.mapping && image.mapping->path == filename)
+    {
+        return true;
+    }
+    if (is_mapped_from(image, filename))
+    {
+        Image copy = make_image(image.width, image.height);
+        for (int h = 0; h < image.height; h++)
+        {
+            memcpy(copy.row(h), image.row(h), (size_t)image.width * BYTES_PER_PIXEL);
+        }
+        return write_image_mapped(filename, copy);
+    }
+
+    Image output = map_output_image(filename, image.width, image.height);
+    if (output.empty())
+    {
+        return false;
+    }
+
+    int row_bytes = image.width * BYTES_PER_PIXEL;
+    TRACE_BYTES((long long)row_bytes * image.height);
+    for (int h = 0; h < image.height; h++)
+    {
+        memcpy(output.row(h), image.row(h), row_bytes);
+    }
+    return true;
+}
+
+
+// Quick terminal command
+// g++ -std=c++11 -pthread -o test main.cpp (change test to whatever you wanna call it)
+// Run with --mmap to map input and output files instead of reading/writing them
+// Run with --stream [--stream-mb N] to work from file to file a tile at a time, in at
+// most about N MB of pixels (default 256), so images larger than memory can be used
+// Results whose colors are known (high contrast, five-color, grayscale, ...) are saved as
+// indexed BMPs (1/4/8-bit, RLE when smaller); run with --bmp24 to always save 24-bit BMPs.
+// Output names ending in .ppm or .pgm are saved as PPM/PGM, which can be read back too
+// Run with --no-simd to use the portable point effects instead of the SSE4.1/AVX2 kernels
+// Run with --threads N to use N threads (default: one per core)
+// Run with --effect CHAIN --in DIR|LIST --out DIR [--jobs N] to process a batch of
+// images without the menu (CHAIN as in option 12, e.g. --effect grayscale,vignette);
+// give --effect more than once to save each image through several chains
+// Add --async-io [--io-depth N] to keep up to N reads and writes in flight (default 8)
+// through io_uring while the jobs work, or through I/O threads with --no-uring
+// Run with --serve SOCKET [--jobs N] to run as a service taking JSON requests (input,
+// output and effect chain) on a Unix domain socket, with N workers (see run_service);
+// --client SOCKET sends it the request lines from stdin, or a whole --effect/--in/--out batch
+// Run with --cache-mb N to keep up to N MB of decoded input images (default 256, 0 turns
+// it off), so applying several effects to the same image only reads it once
+// Run with --bench [--bench-sizes WxH,...] [--bench-out FILE] to time reading, writing
+// and every effect on synthetic images and get the results as JSON (build with
+// -DENABLE_ALLOC_COUNT to count every heap allocation, not just pixel buffers)
+// Run with --verify [--verify-dir DIR] to check every fast path against the reference
+// implementations on DIR/*.bmp (default sample_images) and random images; combine
+// it with --threads N, --mmap or --no-simd to cover those settings too
+// Build with -DENABLE_TRACE and run with --trace FILE to time reading, writing and every
+// effect as it runs: FILE gets a Chrome trace (open it in chrome://tracing or Perfetto)
+// and a table of time, bytes and allocations per operation is printed at exit
+
+// Set by --mmap, --stream and --bmp24 on the command line
+bool use_mmap = false;
+bool use_stream = false;
+bool use_bmp24 = false;
+
+// Thread pool class
+// Runs the tasks of one parallel_for() call across all its threads. Each thread
+// starts with its own contiguous share of the tasks and, once that runs out,
+// steals tasks from the back of the other threads' shares. Tasks write to
+// separate rows/tiles, so the output does not depend on who ran what.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads)
+    {
+        threads = max(1, threads);
+        for (int i = 0; i < threads; i++)
+        {
+            queues.emplace_back(new TaskQueue());
+        }
+        // The calling thread takes part too, so it gets queue 0
+        for (int i = 1; i < threads; i++)
+        {
+            workers.emplace_back(&ThreadPool::worker, this, i);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& t : workers)
+        {
+            t.join();
+        }
+    }
+
+    int size() const
+    {
+        return (int)queues.size();
+    }
+
+    /**
+     * Makes parallel_for() calls from the current thread run serially, for
+     * threads that already run side by side (e.g. batch jobs with an image each)
+     */
+    static void run_serially_on_this_thread()
+    {
+        inside_pool = true;
+    }
+
+    /**
+     * Runs task(0) .. task(count - 1) across the pool and waits for all of them
+     * Calls made from inside a task run serially on the calling thread.
+     * @param count The number of tasks
+     * @param task  The task to run for each index
+     */
+    void parallel_for(int count, const function<void(int)>& task)
+    {
+        if (count <= 0)
+        {
+            return;
+        }
+        if (workers.empty() || count == 1 || inside_pool)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                task(i);
+            }
+            return;
+        }
+
+        lock_guard<mutex> one_job_at_a_time(job_lock);
+        int threads = size();
+        for (int i = 0; i < threads; i++)
+        {
+            lock_guard<mutex> guard(queues[i]->lock);
+            queues[i]->begin = (int)((long long)count * i / threads);
+            queues[i]->end = (int)((long long)count * (i + 1) / threads);
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            current = &task;
+            active = (int)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        inside_pool = true;
+        run_tasks(0, task);
+        inside_pool = false;
+
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [this] { return active == 0; });
+        current = nullptr;
+    }
+
+private:
+    struct TaskQueue
+    {
+        mutex lock;
+        int begin = 0;
+        int end = 0;
+    };
+
+    // Takes the next task from our own queue, or steals one from another queue
+    bool next_task(int self, int& task)
+    {
+        int threads = size();
+        for (int i = 0; i < threads; i++)
+        {
+            TaskQueue& queue = *queues[(self + i) % threads];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.begin < queue.end)
+            {
+                task = i == 0 ? queue.begin++ : --queue.end;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run_tasks(int self, const function<void(int)>& task)
+    {
+        int index;
+        while (next_task(self, index))
+        {
+            task(index);
+        }
+    }
+
+    void worker(int self)
+    {
+        inside_pool = true;
+        int seen = 0;
+        while (true)
+        {
+            const function<void(int)>* task;
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&] { return stopping || generation != seen; });
+                if (stopping)
+                {
+                    return;
+                }
+                seen = generation;
+                task = current;
+            }
+
+            run_tasks(self, *task);
+
+            lock_guard<mutex> guard(lock);
+            if (--active == 0)
+            {
+                done.notify_one();
+            }
+        }
+    }
+
+    vector<unique_ptr<TaskQueue>> queues;
+    vector<thread> workers;
+    mutex job_lock;
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    const function<void(int)>* current = nullptr;
+    int generation = 0;
+    int active = 0;
+    bool stopping = false;
+    static thread_local bool inside_pool;
+};
+
+thread_local bool ThreadPool::inside_pool = false;
+
+// Set by --threads on the command line (0 means one per core)
+int thread_count = 0;
+
+/**
+ * Gets the shared thread pool, creating it on first use
+ * @return the thread pool
+ */
+ThreadPool& thread_pool()
+{
+    static ThreadPool pool(thread_count > 0 ? thread_count : max(1u, thread::hardware_concurrency()));
+    return pool;
+}
+
+/**
+ * Splits rows into bands and runs them across the thread pool
+ * @param rows      The number of rows
+ * @param row_bytes Roughly how many bytes each row touches, used to size the bands
+ * @param band      Called with the first row and one past the last row of each band
+ */
+void parallel_rows(int rows, int row_bytes, const function<void(int, int)>& band)
+{
+    // Bands of at least 64 KB, but enough of them to keep every thread busy
+    int band_rows = max(1, (1 << 16) / max(1, row_bytes));
+    band_rows = min(band_rows, max(1, rows / (4 * thread_pool().size())));
+    int bands = (rows + band_rows - 1) / band_rows;
+    thread_pool().parallel_for(bands, [&](int i) {
+        TRACE_SCOPE("band");
+        TRACE_BYTES((long long)(min(rows, (i + 1) * band_rows) - i * band_rows) * row_bytes);
+        band(i * band_rows, min(rows, (i + 1) * band_rows));
+    });
+}
+
+// Output palette
+// The colors an image is known to contain, when the effects that made it pin
+// them down (e.g. high contrast leaves only black and white). Each color is
+// packed like a BMP color table entry, blue | green << 8 | red << 16, and the
+// list is sorted. An empty palette means the colors are not known.
+typedef vector<uint32_t> Palette;
+
+/**
+ * Packs the color of a pixel the way palettes hold it
+ * @param px The pixel
+ * @return the packed color
+ */
+inline uint32_t pack_color(const uint8_t* px)
+{
+    return px[BLUE] | (px[GREEN] << 8) | ((uint32_t)px[RED] << 16);
+}
+
+/**
+ * Gets the palette of every gray from black to white
+ * @return the palette
+ */
+Palette gray_palette()
+{
+    Palette palette(256);
+    for (uint32_t value = 0; value < 256; value++)
+    {
+        palette[value] = value * 0x010101;
+    }
+    return palette;
+}
+
+/**
+ * Checks whether every color of a palette is a gray
+ * @param palette The palette
+ * @return True if the palette is known and only has grays and false otherwise
+ */
+bool is_gray_palette(const Palette& palette)
+{
+    for (uint32_t color : palette)
+    {
+        if (color != (color & 0xFF) * 0x010101)
+        {
+            return false;
+        }
+    }
+    return !palette.empty();
+}
+
+// Palette lookup class
+// Maps colors to palette indices through a collision-free hash table: the
+// multiplier is picked so that every palette color lands in its own slot. A
+// lookup is then one multiply and one load, with no branches. Colors that are
+// not in the palette still get an index, so index_row() checks the colors
+// back and reports any mismatch for the whole row at once.
+class PaletteLookup
+{
+public:
+    explicit PaletteLookup(const Palette& palette) : colors(palette), table(SLOTS, 0)
+    {
+        vector<bool> used(SLOTS);
+        for (int attempt = 0; attempt < 64 && palette.size() <= 256; attempt++)
+        {
+            multiplier = 2654435761u + 2u * 40503u * attempt;
+            fill(used.begin(), used.end(), false);
+            size_t i = 0;
+            for (; i < palette.size(); i++)
+            {
+                size_t slot = hash(palette[i]);
+                if (used[slot])
+                {
+                    break;
+                }
+                used[slot] = true;
+                table[slot] = (uint8_t)i;
+            }
+            if (i == palette.size())
+            {
+                found = true;
+                return;
+            }
+        }
+    }
+
+    // False if no multiplier kept the colors apart (or there are more than 256)
+    bool valid() const
+    {
+        return found;
+    }
+
+    /**
+     * Maps a row of pixels to palette indices
+     * @param px    The first pixel of the row
+     * @param width The number of pixels in the row
+     * @param dst   Set to the index of each pixel
+     * @return zero if every pixel is in the palette
+     */
+    uint32_t index_row(const uint8_t* px, int width, uint8_t* dst) const
+    {
+        // Locals, since stores through dst could otherwise alias the members
+        const uint8_t* slots = table.data();
+        const uint32_t* entries = colors.data();
+        uint32_t factor = multiplier;
+        uint32_t mismatch = 0;
+        for (int x = 0; x < width; x++, px += BYTES_PER_PIXEL)
+        {
+            uint32_t color = pack_color(px);
+            uint8_t index = slots[(color * factor) >> 16];
+            dst[x] = index;
+            mismatch |= entries[index] ^ color;
+        }
+        return mismatch;
+    }
+
+private:
+    static const size_t SLOTS = 1 << 16;
+
+    size_t hash(uint32_t color) const
+    {
+        return (color * multiplier) >> 16;
+    }
+
+    Palette colors;
+    vector<uint8_t> table;
+    uint32_t multiplier = 0;
+    bool found = false;
+};
+
+// How write_indexed_image() uses run-length encoding
+enum RleMode { RLE_NEVER, RLE_IF_SMALLER, RLE_ALWAYS };
+
+/**
+ * Gets the length of the run of equal indices starting at a position
+ * Helper function for encode_rle_row()
+ * @param indices The indices of the row
+ * @param width   The number of pixels in the row
+ * @param x       The start of the run
+ * @return the run length, at most 255
+ */
+inline int rle_run(const uint8_t* indices, int width, int x)
+{
+    int run = 1;
+    while (x + run < width && run < 255 && indices[x + run] == indices[x])
+    {
+        run++;
+    }
+    return run;
+}
+
+/**
+ * Run-length encodes a row of palette indices, BMP style (RLE8 or RLE4),
+ * without the end of line code
+ * Runs of three or more equal indices become encoded runs, and whatever lies
+ * between them goes out in absolute mode (or as single pixel runs when there
+ * are fewer than three pixels, which absolute mode cannot hold).
+ * @param indices   The indices of the row
+ * @param width     The number of pixels in the row
+ * @param four_bits True for RLE4 (indices below 16) and false for RLE8
+ * @param out       The encoded bytes are appended to this
+ */
+void encode_rle_row(const uint8_t* indices, int width, bool four_bits, vector<uint8_t>& out)
+{
+    int x = 0;
+    while (x < width)
+    {
+        int run = rle_run(indices, width, x);
+        if (run >= 3)
+        {
+            out.push_back(run);
+            out.push_back(four_bits ? indices[x] * 0x11 : indices[x]);
+            x += run;
+            continue;
+        }
+
+        // Up to the next run of three or more
+        int end = x;
+        while (end < width && end - x < 255)
+        {
+            int next = rle_run(indices, width, end);
+            if (next >= 3)
+            {
+                break;
+            }
+            end = min(end + next, x + 255);
+        }
+        // Some decoders read an odd RLE4 absolute run a byte short, so those stay even
+        if (four_bits && (end - x) % 2 && end - x > 1)
+        {
+            end--;
+        }
+        int count = end - x;
+        if (count < 3)
+        {
+            for (; x < end; x++)
+            {
+                out.push_back(1);
+                out.push_back(four_bits ? indices[x] << 4 : indices[x]);
+            }
+            continue;
+        }
+        out.push_back(0);
+        out.push_back(count);
+        size_t start = out.size();
+        if (four_bits)
+        {
+            for (int i = 0; i < count; i += 2)
+            {
+                out.push_back((indices[x + i] << 4) | (i + 1 < count ? indices[x + i + 1] : 0));
+            }
+        }
+        else
+        {
+            out.insert(out.end(), indices + x, indices + end);
+        }
+        // Absolute runs end on a 16-bit boundary
+        if ((out.size() - start) % 2)
+        {
+            out.push_back(0);
+        }
+        x = end;
+    }
+}
+
+/**
+ * Encodes palette indices as a BMP pixel array, a band of rows per task
+ * @param indices The indices, width * height of them, rows in file order (bottom to top)
+ * @param width   The width of the image in pixels
+ * @param height  The height of the image in pixels
+ * @param bits    Bits per pixel (1, 4 or 8)
+ * @param rle     True to run-length encode (RLE4 for 4 bits, RLE8 for 8)
+ * @return the encoded bands, in file order
+ */
+vector<vector<uint8_t>> encode_indexed_pixels(const vector<uint8_t>& indices, int width, int height, int bits, bool rle)
+{
+    int file_stride = (int)(((long long)width * bits + 31) / 32 * 4);
+    int band_rows = max(1, (1 << 16) / width);
+    band_rows = min(band_rows, max(1, height / (4 * thread_pool().size())));
+    int band_count = (height + band_rows - 1) / band_rows;
+    vector<vector<uint8_t>> bands(band_count);
+
+    thread_pool().parallel_for(band_count, [&](int band) {
+        int first = band * band_rows;
+        int last = min(height, first + band_rows);
+        vector<uint8_t>& out = bands[band];
+        if (!rle)
+        {
+            out.assign((size_t)(last - first) * file_stride, 0);
+        }
+        for (int row = first; row < last; row++)
+        {
+            const uint8_t* src = indices.data() + (size_t)row * width;
+            if (rle)
+            {
+                encode_rle_row(src, width, bits == 4, out);
+                // End of line, or end of bitmap after the last row
+                out.push_back(0);
+                out.push_back(row == height - 1 ? 1 : 0);
+                continue;
+            }
+            // Packed indices, most significant bits first
+            uint8_t* dst = out.data() + (size_t)(row - first) * file_stride;
+            if (bits == 8)
+            {
+                memcpy(dst, src, width);
+                continue;
+            }
+            int per_byte = 8 / bits;
+            int whole = width / per_byte * per_byte;
+            for (int x = 0; x < whole; x += per_byte)
+            {
+                int packed = 0;
+                for (int i = 0; i < per_byte; i++)
+                {
+                    packed = (packed << bits) | src[x + i];
+                }
+                *dst++ = packed;
+            }
+            // The last byte, padded with zero bits
+            for (int x = whole; x < width; x++)
+            {
+                *dst |= src[x] << (8 - bits - (x - whole) * bits);
+            }
+        }
+    });
+    return bands;
+}
+
+/**
+ * Encodes an image whose colors all come from a palette as an indexed BMP file
+ * Uses the fewest bits per pixel the palette fits in (1, 4 or 8), unless told
+ * otherwise. With RLE_IF_SMALLER the RLE4 and RLE8 encodings the palette fits
+ * are tried too (for more than two colors) and the smallest file wins; with
+ * RLE_ALWAYS only those are.
+ * Pixels are mapped to indices and encoded in parallel bands.
+ * @param image    The input image to save
+ * @param palette  The colors (at most 256)
+ * @param bits     Bits per pixel (1, 4 or 8), or 0 for the fewest that fit
+ * @param rle      When to run-length encode
+ * @param file     Filled in with the file
+ * @return True if successful and false if the palette has too many colors or
+ *         the image has a color it does not
+ */
+bool encode_indexed_image(const Image& image, const Palette& palette, int bits, RleMode rle, EncodedFile& file)
+{
+    TRACE_SCOPE("encode_indexed_image");
+    int colors = (int)palette.size();
+    if (image.empty() || colors == 0 || colors > 256)
+    {
+        return false;
+    }
+    int width = image.width;
+    int height = image.height;
+
+    // Pixels to palette indices, rows in file order (bottom to top)
+    PaletteLookup lookup(palette);
+    if (!lookup.valid())
+    {
+        return false;
+    }
+    vector<uint8_t> indices((size_t)width * height);
+    atomic<bool> missing(false);
+    parallel_rows(height, width * BYTES_PER_PIXEL, [&](int first, int last) {
+        for (int row = first; row < last && !missing; row++)
+        {
+            if (lookup.index_row(image.row(height - 1 - row), width, indices.data() + (size_t)row * width))
+            {
+                missing = true;
+            }
+        }
+    });
+    if (missing)
+    {
+        return false;
+    }
+
+    // The candidate encodings, smallest file kept
+    int fewest = colors <= 2 ? 1 : (colors <= 16 ? 4 : 8);
+    int chosen_bits = 0;
+    bool chosen_rle = false;
+    vector<vector<uint8_t>> chosen;
+    size_t chosen_size = SIZE_MAX;
+    const int depths[] = {1, 4, 8};
+    for (int depth : depths)
+    {
+        if (depth < fewest || (bits != 0 && depth != bits))
+        {
+            continue;
+        }
+        for (int compressed = 0; compressed < 2; compressed++)
+        {
+            // Uncompressed only at the fewest bits (unless asked for), compressed only at 4 and 8 bits.
+            // Two colors are only compressed when asked: 1-bit is already 24 times smaller than
+            // 24-bit, and some decoders (e.g. Pillow) cannot read black and white RLE files.
+            if ((compressed == 0 && (rle == RLE_ALWAYS || (bits == 0 && depth != fewest))) ||
+                (compressed == 1 && (rle == RLE_NEVER || depth == 1 || (rle == RLE_IF_SMALLER && fewest == 1))))
+            {
+                continue;
+            }
+            vector<vector<uint8_t>> bands = encode_indexed_pixels(indices, width, height, depth, compressed);
+            size_t size = 0;
+            for (const vector<uint8_t>& band : bands)
+            {
+                size += band.size();
+            }
+            if (size < chosen_size)
+            {
+                chosen = move(bands);
+                chosen_size = size;
+                chosen_bits = depth;
+                chosen_rle = compressed;
+            }
+        }
+    }
+    if (chosen.empty() || chosen_size > INT_MAX - 2048)
+    {
+        return false;
+    }
+
+    // Headers, color table (blue, green, red, 0 per entry), then the bands
+    vector<uint8_t> header(BMP_HEADER_SIZE + DIB_HEADER_SIZE + 4 * colors, 0);
+    set_bmp_headers(header.data(), width, height);
+    int start = (int)header.size();
+    set_bytes(header.data(),  2, 4, start + (int)chosen_size);    // Size of BMP file
+    set_bytes(header.data(), 10, 4, start);                       // Pixel array offset
+    set_bytes(header.data(), 28, 2, chosen_bits);                 // Number of bits per pixel
+    set_bytes(header.data(), 30, 4, chosen_rle ? (chosen_bits == 8 ? 1 : 2) : 0); // BI_RGB, BI_RLE8 or BI_RLE4
+    set_bytes(header.data(), 34, 4, (int)chosen_size);            // Size of raw bitmap data
+    set_bytes(header.data(), 46, 4, colors);                      // Number of colors in palette
+    for (int c = 0; c < colors; c++)
+    {
+        set_bytes(header.data(), BMP_HEADER_SIZE + DIB_HEADER_SIZE + 4 * c, 3, palette[c]);
+    }
+    file.add_chunk(move(header));
+    for (vector<uint8_t>& band : chosen)
+    {
+        file.add_chunk(move(band));
+    }
+    return true;
+}
+
+/**
+ * Writes an image whose colors all come from a palette as an indexed BMP
+ * (see encode_indexed_image), the bands going to the file with writev()
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @param palette  The colors (at most 256)
+ * @param bits     Bits per pixel (1, 4 or 8), or 0 for the fewest that fit
+ * @param rle      When to run-length encode
+ * @return True if successful and false if the file could not be written, the
+ *         palette has too many colors or the image has a color it does not
+ *         (nothing is written then)
+ */
+bool write_indexed_image(string filename, const Image& image, const Palette& palette, int bits = 0,
+                         RleMode rle = RLE_IF_SMALLER)
+{
+    TRACE_SCOPE("write_indexed_image");
+    EncodedFile file;
+    if (!encode_indexed_image(image, palette, bits, rle, file))
+    {
+        return false;
+    }
+    TRACE_BYTES(file.size);
+    return write_encoded_file(filename, file);
+}
+
+/**
+ * Checks whether a file name asks for a PPM or PGM file
+ * @param filename The file name
+ * @return True if it ends in .ppm or .pgm (any case) and false otherwise
+ */
+bool is_netpbm_name(const string& filename)
+{
+    if (filename.size() < 4)
+    {
+        return false;
+    }
+    string extension = filename.substr(filename.size() - 4);
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".ppm" || extension == ".pgm";
+}
+
+/**
+ * Makes the header of a binary PPM (P6) or PGM (P5) file
+ * @param width  The image width
+ * @param height The image height
+ * @param gray   True for PGM and false for PPM
+ * @return the header bytes
+ */
+vector<uint8_t> netpbm_header(int width, int height, bool gray)
+{
+    string header = string(gray ? "P5" : "P6") + "\n" + to_string(width) + " " + to_string(height) + "\n255\n";
+    return vector<uint8_t>(header.begin(), header.end());
+}
+
+/**
+ * Converts one row of pixels to PPM or PGM samples
+ * PPM samples are red, green, blue; PGM samples are the grayscale effect's
+ * (red + green + blue) / 3, which is exact for images that are already gray.
+ * @param px    The row's pixels
+ * @param width The number of pixels
+ * @param gray  True for PGM and false for PPM
+ * @param dst   Filled in with width (PGM) or 3 * width (PPM) samples
+ */
+void netpbm_row(const uint8_t* px, int width, bool gray, uint8_t* dst)
+{
+    int channels = gray ? 1 : 3;
+    for (int x = 0; x < width; x++, px += BYTES_PER_PIXEL, dst += channels)
+    {
+        if (gray)
+        {
+            dst[0] = (px[RED] + px[GREEN] + px[BLUE]) / 3;
+            continue;
+        }
+        dst[0] = px[RED];
+        dst[1] = px[GREEN];
+        dst[2] = px[BLUE];
+    }
+}
+
+/**
+ * Encodes the input image as a binary PPM (P6) or PGM (P5) file
+ * Netpbm files have no row padding and no header to speak of, so this is the
+ * cheapest format to write after the raw rows (see netpbm_row for the
+ * samples). Rows are converted in parallel bands of about 1 MB.
+ * @param image The input image to save
+ * @param gray  True for PGM and false for PPM
+ * @param file  Filled in with the file
+ */
+void encode_netpbm_image(const Image& image, bool gray, EncodedFile& file)
+{
+    int width = image.width;
+    int height = image.height;
+    int channels = gray ? 1 : 3;
+    size_t row_bytes = (size_t)width * channels;
+    file.add_chunk(netpbm_header(width, height, gray));
+
+    int band_rows = (int)max<size_t>(1, (1 << 20) / row_bytes);
+    int band_count = (height + band_rows - 1) / band_rows;
+    vector<vector<uint8_t>> bands(band_count);
+    thread_pool().parallel_for(band_count, [&](int band) {
+        int first = band * band_rows;
+        int rows = min(band_rows, height - first);
+        bands[band].resize(rows * row_bytes);
+        for (int i = 0; i < rows; i++)
+        {
+            netpbm_row(image.row(first + i), width, gray, bands[band].data() + i * row_bytes);
+        }
+    });
+    for (vector<uint8_t>& band : bands)
+    {
+        file.add_chunk(move(band));
+    }
+}
+
+/**
+ * Checks whether a file name asks for a PGM file rather than a PPM file
+ * @param filename The file name (is_netpbm_name() must be true)
+ * @return True if it ends in .pgm (any case) and false otherwise
+ */
+bool is_pgm_name(const string& filename)
+{
+    return tolower(filename[filename.size() - 2]) == 'g';
+}
+
+/**
+ * Writes the input image as a binary PPM (P6) or, if the file name ends in
+ * .pgm, a binary PGM (P5) (see encode_netpbm_image)
+ * @param filename The PPM or PGM file name to save the image to
+ * @param image    The input image to save
+ * @return True if successful and false otherwise
+ */
+bool write_netpbm_image(string filename, const Image& image)
+{
+    TRACE_SCOPE("write_netpbm_image");
+    if (image.empty() || !is_netpbm_name(filename))
+    {
+        return false;
+    }
+    EncodedFile file;
+    encode_netpbm_image(image, is_pgm_name(filename), file);
+    TRACE_BYTES(file.size);
+    return write_encoded_file(filename, file);
+}
+
+/**
+ * Decodes the input image, mapping it into memory when --mmap is on
+ * Falls back to read_image() for files that cannot be mapped (e.g. 32-bit BMPs)
+ * @param filename BMP image filename
+ * @return the image, or an empty image if the file is not a valid BMP
+ */
+Image decode_image(string filename)
+{
+    if (use_mmap)
+    {
+        Image image = map_image(filename);
+        if (!image.empty())
+        {
+            return image;
+        }
+    }
+    return read_image(filename);
+}
+
+/**
+ * Copies an image into a buffer of its own
+ * Unlike a plain copy, the result of copying a mapped image does not share its
+ * pixels (any other image is just copied, as its pixels are copied on write).
+ * @param image The image to copy
+ * @return the copy
+ */
+Image owned_image(const Image& image)
+{
+    if (!image.mapping)
+    {
+        return image;
+    }
+    Image copy = make_image(image.width, image.height);
+    int row_bytes = image.width * BYTES_PER_PIXEL;
+    for (int row = 0; row < image.height; ++row)
+    {
+        memcpy(copy.row(row), image.row(row), row_bytes);
+    }
+    return copy;
+}
+
+// Decoded image cache
+// Keeps the most recently loaded images so applying several effects to the same
+// input decodes it once. An entry only counts while the file still has the same
+// modification time, size and inode; once the cached pixels go over the budget
+// the least recently used images are dropped. A cached image shares its pixels
+// with the images loaded from it, so they are only copied if the caller changes them.
+class ImageCache
+{
+public:
+    /**
+     * Finds the cached copy of a file
+     * @param filename  BMP image filename
+     * @param file_info What stat() says about the file now
+     * @return the image, or null if it is not cached or the file has changed since
+     */
+    shared_ptr<const Image> find(const string& filename, const struct stat& file_info)
+    {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].path != filename)
+            {
+                continue;
+            }
+            if (!same_file(entries[i], file_info))
+            {
+                total_bytes -= entries[i].bytes;
+                entries.erase(entries.begin() + i);
+                break;
+            }
+            Entry entry = entries[i];
+            entries.erase(entries.begin() + i);
+            entries.push_back(entry);
+            hits++;
+            return entry.image;
+        }
+        misses++;
+        return nullptr;
+    }
+
+    /**
+     * Adds a decoded image, dropping the least recently used ones to stay in budget
+     * Files changed within the last second are left out: a rewrite in the same
+     * timestamp tick with the same size would otherwise go unnoticed.
+     * @param filename  BMP image filename
+     * @param file_info What stat() said about the file before it was decoded
+     * @param image     The decoded image (must own its pixels)
+     */
+    void insert(const string& filename, const struct stat& file_info, shared_ptr<const Image> image)
+    {
+        size_t bytes = image->data.size();
+        if (bytes > budget || time(nullptr) - file_info.st_mtime < 1)
+        {
+            return;
+        }
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].path == filename)
+            {
+                total_bytes -= entries[i].bytes;
+                entries.erase(entries.begin() + i);
+                break;
+            }
+        }
+        entries.push_back({filename, file_info.st_mtim, file_info.st_size, file_info.st_ino, move(image), bytes});
+        total_bytes += bytes;
+        trim();
+    }
+
+    // Sets how many bytes of pixels may be kept (0 turns the cache off)
+    void set_budget(size_t bytes)
+    {
+        lock_guard<mutex> guard(lock);
+        budget = bytes;
+        trim();
+    }
+
+    bool enabled() const
+    {
+        return budget > 0;
+    }
+
+    long long hit_count() const
+    {
+        return hits;
+    }
+
+    long long miss_count() const
+    {
+        return misses;
+    }
+
+private:
+    struct Entry
+    {
+        string path;
+        timespec modified;
+        off_t size;
+        ino_t inode;
+        shared_ptr<const Image> image;
+        size_t bytes;
+    };
+
+    static bool same_file(const Entry& entry, const struct stat& file_info)
+    {
+        return entry.modified.tv_sec == file_info.st_mtim.tv_sec && entry.modified.tv_nsec == file_info.st_mtim.tv_nsec
+            && entry.size == file_info.st_size && entry.inode == file_info.st_ino;
+    }
+
+    // Drops the least recently used images until the rest fit the budget (lock held)
+    void trim()
+    {
+        size_t dropped = 0;
+        while (dropped < entries.size() && total_bytes > budget)
+        {
+            total_bytes -= entries[dropped++].bytes;
+        }
+        entries.erase(entries.begin(), entries.begin() + dropped);
+    }
+
+    mutex lock;
+    vector<Entry> entries;  // Most recently used last
+    size_t total_bytes = 0;
+    atomic<size_t> budget{256u << 20};
+    atomic<long long> hits{0};
+    atomic<long long> misses{0};
+};
+
+ImageCache& image_cache()
+{
+    static ImageCache* cache = new ImageCache();
+    return *cache;
+}
+
+/**
+ * Loads the input image for reading only, from the image cache when it is there
+ * @param filename BMP image filename
+ * @return the image, or an empty image if the file is not a valid BMP
+ */
+shared_ptr<const Image> load_source_image(string filename)
+{
+    struct stat file_info;
+    if (!image_cache().enabled() || stat(filename.c_str(), &file_info) != 0)
+    {
+        return make_shared<const Image>(decode_image(filename));
+    }
+    shared_ptr<const Image> image = image_cache().find(filename, file_info);
+    if (image)
+    {
+        return image;
+    }
+    image = make_shared<const Image>(owned_image(decode_image(filename)));
+    if (!image->empty())
+    {
+        image_cache().insert(filename, file_info, image);
+    }
+    return image;
+}
+
+/**
+ * Loads the input image, from the image cache when it is there
+ * Without a cached copy it is decoded (or mapped when --mmap is on) and kept for next time.
+ * @param filename BMP image filename
+ * @return the image, or an empty image if the file is not a valid BMP
+ */
+Image load_image(string filename)
+{
+    struct stat file_info;
+    if (!image_cache().enabled() || stat(filename.c_str(), &file_info) != 0)
+    {
+        return decode_image(filename);
+    }
+    shared_ptr<const Image> cached = image_cache().find(filename, file_info);
+    if (cached)
+    {
+        return *cached;
+    }
+    Image image = decode_image(filename);
+    if (!image.empty())
+    {
+        image_cache().insert(filename, file_info, make_shared<const Image>(owned_image(image)));
+    }
+    return image;
+}
+
+/**
+ * Loads the input image for an effect that changes the pixels in place
+ * When --mmap is on, the output file is created and mapped up front and the
+ * input pixels are copied straight into it, so the effect writes directly into
+ * the output file and save_image() has nothing left to do.
+ * Note: when the output is the input file itself, creating the output would
+ * truncate the file the input pixels are still mapped from, so the image is
+ * left as it is and save_image() copies it out before replacing the file.
+ * @param filename   BMP image filename
+ * @param outputname The BMP file name the result will be saved to
+ * @return the image, or an empty image if the file is not a valid BMP
+ */
+Image load_image_for_output(string filename, string outputname)
+{
+    Image image = load_image(filename);
+    if (!use_mmap || image.empty() || is_netpbm_name(outputname))
+    {
+        return image;
+    }
+    if (is_same_file(filename, outputname))
+    {
+        return image;
+    }
+
+    Image output = map_output_image(outputname, image.width, image.height);
+    if (output.empty())
+    {
+        return image;
+    }
+
+    int row_bytes = image.width * BYTES_PER_PIXEL;
+    for (int row = 0; row < image.height; ++row)
+    {
+        memcpy(output.row(row), image.row(row), row_bytes);
+    }
+    return output;
+}
+
+/**
+ * Saves the output image in the format that suits it
+ * - File names ending in .ppm or .pgm get a PPM or PGM file.
+ * - With --mmap the file is a 24-bit BMP written through a memory mapping.
+ * - When the effects that made the image pin down its colors, it is saved as
+ *   an indexed BMP (1, 4 or 8 bits per pixel, RLE compressed when that is
+ *   smaller), unless --bmp24 is on.
+ * - Anything else is saved as a 24-bit BMP.
+ * @param filename The file name to save the image to
+ * @param image    The image to save
+ * @param palette  The colors the image is known to contain, if any
+ * @return True if successful and false otherwise
+ */
+bool save_image(string filename, const Image& image, const Palette& palette = Palette())
+{
+    // Saving over the file the pixels are mapped from (--mmap) would truncate them first
+    if (is_mapped_from(image, filename))
+    {
+        return save_image(filename, owned_image(image), palette);
+    }
+    if (is_netpbm_name(filename))
+    {
+        return write_netpbm_image(filename, image);
+    }
+    if (use_mmap)
+    {
+        return write_image_mapped(filename, image);
+    }
+    if (!use_bmp24 && !palette.empty() && palette.size() <= 256 && write_indexed_image(filename, image, palette))
+    {
+        return true;
+    }
+    return write_image(filename, image);
+}
+
+/**
+ * Encodes the output image in the format save_image() would pick (short of
+ * --mmap), for a writer that runs later
+ * @param filename The file name the image will be saved to
+ * @param image    The image to save (24-bit rows point into it)
+ * @param palette  The colors the image is known to contain, if any
+ * @param file     Filled in with the file
+ * @return True if successful and false if the image is empty
+ */
+bool encode_output_file(const string& filename, const Image& image, const Palette& palette, EncodedFile& file)
+{
+    if (image.empty())
+    {
+        return false;
+    }
+    if (is_netpbm_name(filename))
+    {
+        encode_netpbm_image(image, is_pgm_name(filename), file);
+        return true;
+    }
+    if (!use_bmp24 && !palette.empty() && palette.size() <= 256 &&
+        encode_indexed_image(image, palette, 0, RLE_IF_SMALLER, file))
+    {
+        return true;
+    }
+    file = EncodedFile();
+    return encode_bmp24_image(image, file);
+}
+
+// Note on the effects below: channel math is still done in int/double like it was
+// with the int Pixel fields, but results outside 0-255 (lighten or darken with a
+// scaling factor above 1, Clarendon, the corners of a wide vignette) now saturate
+// instead of wrapping around the way the old (unsigned char) cast in write_image did.
+
+/**
+ * Narrows a channel result to 8 bits
+ * Truncates toward zero like the old int casts, but saturates at 0 and 255
+ * instead of keeping the low 8 bits. Works for any double (NaN gives 0).
+ * @param value The channel result
+ * @return the 8-bit channel value
+ */
+inline uint8_t saturate_channel(double value) {
+    return !(value > 0) ? 0 : (value >= 255 ? 255 : (uint8_t)value);
+}
+
+// Per-channel formulas shared by the effects below, saturated to 8 bits
+
+// Lighten (process 8)
+inline uint8_t lighten_value(int value, double scaling_factor) {
+    return saturate_channel(255 - (255 - value) * scaling_factor);
+}
+// Darken (process 9) and the dark branch of Clarendon (process 2)
+inline uint8_t darken_value(int value, double scaling_factor) {
+    return saturate_channel(value * scaling_factor);
+}
+// Light branch of Clarendon (process 2)
+inline uint8_t clarendon_light_value(int value, double scaling_factor) {
+    return saturate_channel(225 - (225 - value) * scaling_factor);
+}
+
+// Vignette multipliers are fixed-point fractions of 1 << shift, with shift at most this
+const int VIGNETTE_BITS = 23;
+// VIGNETTE_LOOKUP + i stands for the table's exact lookup i instead of a multiplier.
+// Real multipliers are never negative, so they cannot be mistaken for it.
+const int32_t VIGNETTE_LOOKUP = INT32_MIN;
+
+// Precomputed vignette mask structure
+// The falloff only depends on the distance from the center, so it is
+// mirrored in both axes: one quadrant of multipliers covers the whole image.
+struct VignetteTable
+{
+    int width = 0;
+    int height = 0;
+    int shift = 0;
+    int quadrant_width = 0;       // Multipliers per quadrant row
+    int first_row = 0;            // Quadrant row multipliers starts at (see make_vignette_table)
+    vector<int32_t> multipliers;  // Quadrant rows, nearest the center first
+    vector<int> column_index;     // Quadrant column of each image column
+    vector<array<uint8_t, 256>> lookups;  // Exact channel maps for the few factors no multiplier matches
+    mutex lookups_lock;                   // Guards lookups while the table is built
+};
+
+/**
+ * Marks the fixed-point units that hold a fraction n / v with v <= 255
+ * Unit u covers [u, u + 1) / (1 << shift), wrapping around at one, so
+ * the marks stand for the fractional parts of all such numbers.
+ * Built by stepping through the Farey sequence of order 255.
+ * @param shift The number of fraction bits
+ * @return one bit per unit
+ */
+vector<uint64_t> fraction_units(int shift)
+{
+    const int order = 255;
+    const long long one = 1LL << shift;
+    vector<uint64_t> units((one + 63) / 64);
+    long long a = 0, b = 1, c = 1, d = order;  // Consecutive terms a/b < c/d
+    while (a < b)
+    {
+        long long unit = ((a << shift) / b) & (one - 1);
+        units[unit / 64] |= 1ULL << (unit % 64);
+        long long k = (order + b) / d;
+        long long e = k * c - a, f = k * d - b;
+        a = c; b = d; c = e; d = f;
+    }
+    return units;
+}
+
+/**
+ * Finds a fixed-point multiplier that matches the old (int)(value * factor)
+ * for every channel value, trying the factor rounded either way.
+ * The factor is between zero and one, so nothing needs saturating.
+ * A few factors cannot be matched by any multiplier (the double product
+ * rounds one way for some values and the other way for the rest); they get
+ * an exact lookup table instead.
+ * Helper function for vignette_multiplier()
+ * @param table          The table being built, which collects the lookups
+ * @param scaling_factor The vignette factor
+ * @return the multiplier, or VIGNETTE_LOOKUP plus the lookup's index
+ */
+int32_t matching_vignette_multiplier(VignetteTable& table, double scaling_factor)
+{
+    const int shift = table.shift;
+    double scaled = scaling_factor * (1 << shift);
+
+    int expected[256];
+    for (int v = 0; v < 256; v++)
+    {
+        expected[v] = darken_value(v, scaling_factor);
+    }
+    int32_t candidates[] = {(int32_t)ceil(scaled), (int32_t)floor(scaled), (int32_t)ceil(scaled) + 1, (int32_t)floor(scaled) - 1};
+    for (int32_t multiplier : candidates)
+    {
+        bool exact = multiplier >= 0;
+        for (int v = 1; v < 256 && exact; v++)
+        {
+            exact = ((v * multiplier) >> shift) == expected[v];
+        }
+        if (exact)
+        {
+            return multiplier;
+        }
+    }
+
+    array<uint8_t, 256> lookup;
+    for (int v = 0; v < 256; v++)
+    {
+        lookup[v] = (uint8_t)expected[v];
+    }
+    lock_guard<mutex> guard(table.lookups_lock);
+    table.lookups.push_back(lookup);
+    return VIGNETTE_LOOKUP + (int32_t)(table.lookups.size() - 1);
+}
+
+/**
+ * Gets the fixed-point multiplier for a vignette factor
+ * Factors at or below zero saturate every channel to zero. Otherwise the
+ * factor rounded up works unless value * factor lands on or just short of a
+ * whole number for some channel value. Those factors sit on or just below a
+ * fraction n / value, so only they are checked value by value.
+ * @param table          The table being built
+ * @param fractions      fraction_units() for the table's shift
+ * @param scaling_factor The vignette factor
+ * @return the multiplier, or VIGNETTE_LOOKUP plus a lookup's index
+ */
+inline int32_t vignette_multiplier(VignetteTable& table, const vector<uint64_t>& fractions, double scaling_factor)
+{
+    if (!(scaling_factor > 0))
+    {
+        return 0;
+    }
+    const int shift = table.shift;
+    const int32_t unit_mask = (1 << shift) - 1;
+    int32_t away = (int32_t)ceil(scaling_factor * (1 << shift));
+
+    // The factor lies in the unit below away, so a fraction at most a unit below that is close enough to matter
+    bool near_fraction = false;
+    for (int32_t unit = away - 2; unit <= away; unit++)
+    {
+        near_fraction |= (fractions[(unit & unit_mask) / 64] >> (unit & 63)) & 1;
+    }
+    if (near_fraction)
+    {
+        return matching_vignette_multiplier(table, scaling_factor);
+    }
+    return away;
+}
+
+/**
+ * Builds the vignette multipliers for an image size
+ * Each multiplier is the old (height - distance) / height factor in fixed
+ * point, chosen so that (value * multiplier) >> shift equals the saturated
+ * (int)(value * factor) for every channel value.
+ * A table for part of a huge image can hold just the quadrant rows it needs.
+ * @param width     The image width
+ * @param height    The image height
+ * @param first_row The first quadrant row to build
+ * @param last_row  One past the last quadrant row (-1 for all of them)
+ * @return the table
+ */
+shared_ptr<VignetteTable> make_vignette_table(int width, int height, int first_row = 0, int last_row = -1)
+{
+    TRACE_SCOPE("vignette_table");
+    shared_ptr<VignetteTable> table = make_shared<VignetteTable>();
+    table->width = width;
+    table->height = height;
+
+    // Doubled distances from the center are |2 * col - width|, which share width's parity
+    if (last_row < 0)
+    {
+        last_row = height / 2 + 1;
+    }
+    table->first_row = first_row;
+    table->quadrant_width = width / 2 + 1;
+    table->column_index.resize(width);
+    for (int col = 0; col < width; ++col)
+    {
+        table->column_index[col] = abs(2 * col - width) / 2;
+    }
+
+    // The factor is at most one (it goes negative far from the center of wide
+    // images, but those pixels saturate to zero), so 255 times a multiplier fits
+    table->shift = VIGNETTE_BITS;
+
+    vector<uint64_t> fractions = fraction_units(table->shift);
+    table->multipliers.resize((size_t)(last_row - first_row) * table->quadrant_width);
+    parallel_rows(last_row - first_row, table->quadrant_width * 4, [&](int first, int last) {
+        for (int y = first_row + first; y < first_row + last; ++y)
+        {
+            double dy = (2 * y + (height & 1)) / 2.0;
+            int32_t* multiplier = &table->multipliers[(size_t)(y - first_row) * table->quadrant_width];
+            for (int x = 0; x < table->quadrant_width; ++x)
+            {
+                double dx = (2 * x + (width & 1)) / 2.0;
+                double distance = sqrt(dx * dx + dy * dy);
+                double scaling_factor = (height - distance) / height;
+                multiplier[x] = vignette_multiplier(*table, fractions, scaling_factor);
+            }
+        }
+    });
+    return table;
+}
+
+/**
+ * Gets the number of bytes a vignette table holds
+ * @param table The table
+ * @return its size in bytes
+ */
+size_t vignette_table_bytes(const VignetteTable& table)
+{
+    return table.multipliers.size() * sizeof(int32_t) + table.column_index.size() * sizeof(int) +
+           table.lookups.size() * sizeof(table.lookups[0]);
+}
+
+/**
+ * Gets the vignette table for an image size, building it on first use
+ * The most recently used tables are kept, up to cache_bytes in all, so a
+ * batch of same-sized photos builds it once. A table bigger than that (a
+ * quadrant of a 16384 x 16384 image is about 268 MB) is built and not kept.
+ * @param width  The image width
+ * @param height The image height
+ * @return the table
+ */
+shared_ptr<VignetteTable> vignette_table(int width, int height)
+{
+    static mutex cache_lock;
+    static vector<shared_ptr<VignetteTable>> cache;  // Most recently used last
+    static size_t cached_bytes = 0;
+    const size_t cache_bytes = 64 << 20;
+
+    lock_guard<mutex> guard(cache_lock);
+    for (size_t i = 0; i < cache.size(); i++)
+    {
+        if (cache[i]->width == width && cache[i]->height == height)
+        {
+            shared_ptr<VignetteTable> table = cache[i];
+            cache.erase(cache.begin() + i);
+            cache.push_back(table);
+            return table;
+        }
+    }
+    shared_ptr<VignetteTable> table = make_vignette_table(width, height);
+    size_t bytes = vignette_table_bytes(*table);
+    if (bytes > cache_bytes)
+    {
+        return table;
+    }
+    while (cached_bytes + bytes > cache_bytes)
+    {
+        cached_bytes -= vignette_table_bytes(*cache.front());
+        cache.erase(cache.begin());
+    }
+    cache.push_back(table);
+    cached_bytes += bytes;
+    return table;
+}
+
+/**
+ * Process 1 on a single row: Applies the vignette effect to the pixels
+ * Every channel is a single multiply and shift by the pixel's table entry.
+ * @param table The vignette table for the image size
+ * @param row   The row number
+ * @param px    The first pixel of the row
+ */
+void vignette_row(const VignetteTable& table, int row, uint8_t* px) {
+    const int shift = table.shift;
+    const int32_t* multipliers = &table.multipliers[(size_t)(abs(2 * row - table.height) / 2 - table.first_row) * table.quadrant_width];
+    const int* column_index = table.column_index.data();
+    const int width = table.width;
+    // Locals, since the pixel stores could otherwise alias the table
+    const int32_t lookups_end = VIGNETTE_LOOKUP + (int32_t)table.lookups.size();
+    for (int col = 0; col < width; ++col, px += BYTES_PER_PIXEL) {
+        int32_t multiplier = multipliers[column_index[col]];
+        if (multiplier < lookups_end) {
+            const uint8_t* lookup = table.lookups[multiplier - VIGNETTE_LOOKUP].data();
+            px[RED] = lookup[px[RED]];
+            px[GREEN] = lookup[px[GREEN]];
+            px[BLUE] = lookup[px[BLUE]];
+            continue;
+        }
+        px[RED] = (px[RED] * multiplier) >> shift;
+        px[GREEN] = (px[GREEN] * multiplier) >> shift;
+        px[BLUE] = (px[BLUE] * multiplier) >> shift;
+    }
+}
+/**
+ * Process 1: Applies a vignette effect to the specified image
+ * @param image The Image
+ */
+void applyVignetteEffect(Image& image) {
+    TRACE_SCOPE("vignette");
+    if (image.empty())
+    {
+        return;
+    }
+    TRACE_BYTES((long long)image.width * image.height * BYTES_PER_PIXEL);
+    shared_ptr<VignetteTable> table = vignette_table(image.width, image.height);
+    parallel_rows(image.height, image.width * BYTES_PER_PIXEL, [&](int first, int last) {
+        for (int row = first; row < last; ++row) {
+            vignette_row(*table, row, image.row(row));
+        }
+    });
+}
+/**
+ * Process 2 on a single row: Applies a clarendon effect to the pixels
+ * @param px The first pixel of the row
+ * @param width The number of pixels in the row
+ * @param scaling_factor a double value you'd like to apply to the effect
+ */
+void clarendon_row(uint8_t* px, int width, double scaling_factor) {
+    for (int col = 0; col < width; ++col, px += BYTES_PER_PIXEL) {
+        int average = (px[RED] + px[GREEN] + px[BLUE])/3;
+        // If cell is light, make it lighter
+        if(average >= 170)
+        {
+            px[RED] = clarendon_light_value(px[RED], scaling_factor);
+            px[GREEN] = clarendon_light_value(px[GREEN], scaling_factor);
+            px[BLUE] = clarendon_light_value(px[BLUE], scaling_factor);
+
+        } else if(average < 90)
+        {
+            px[RED] = darken_value(px[RED], scaling_factor);
+            px[GREEN] = darken_value(px[GREEN], scaling_factor);
+            px[BLUE] = darken_value(px[BLUE], scaling_factor);
+        }
+        // Otherwise the pixel is left as it is
+    }
+}
+/**
+ * Process 2: Applies a clarendon effect to the specified image
+ * @param image The Image
+ * @param scaling_factor a double value you'd like to apply to the effect
+ */
+void applyClarendonEffect(Image& image, double scaling_factor) {
+    for (int row = 0; row < image.height; ++row) {
+        clarendon_row(image.row(row), image.width, scaling_factor);
+    }
+}
+/**
+ * Process 3 on a single row: Applies a grayscale effect to the pixels
+ * @param px The first pixel of the row
+ * @param width The number of pixels in the row
+ */
+void grayscale_row(uint8_t* px, int width) {
+    for (int col = 0; col < width; ++col, px += BYTES_PER_PIXEL) {
+        int average = (px[RED] + px[GREEN] + px[BLUE])/3;
+        px[RED] = average;
+        px[GREEN] = average;
+        px[BLUE] = average;
+    }
+}
+/**
+ * Process 3: Applies a grayscale effect to the specified image
+ * @param image The Image
+ */
+void applyGrayscaleEffect(Image& image) {
+    for (int row = 0; row < image.height; ++row) {
+        grayscale_row(image.row(row), image.width);
+    }
+}
+// Rotations are done in square tiles so that both the rows being read and the
+// rows being written stay in cache while a tile is copied
+const int ROTATE_TILE = 32;
+
+/**
+ * Gets the number of clockwise quarter turns a rotation count amounts to
+ * @param rotations The number of 90 degree rotations (negative turns counterclockwise)
+ * @return 0, 1, 2 or 3
+ */
+int quarter_turns(int rotations) {
+    return ((rotations % 4) + 4) % 4;
+}
+
+// Pixel format policies
+// How one pixel is stored, for the geometry kernels below. The kernels take
+// the format as a template parameter, so the pixel size is a compile-time
+// constant and copying a pixel is one fixed-size move rather than a loop over
+// channels. Bgr24Format is the Image layout.
+struct Bgr24Format
+{
+    static const int BYTES = 3;
+};
+
+/**
+ * Copies one pixel
+ * @param dst The pixel written
+ * @param src The pixel read
+ */
+template <typename Format>
+inline void copy_pixel(uint8_t* dst, const uint8_t* src)
+{
+    memcpy(dst, src, Format::BYTES);
+}
+
+// Pixel view structure
+// Rows of pixels, `stride` bytes apart (negative
+// when the rows are stored bottom to top, like a mapped image)
+struct PixelView
+{
+    uint8_t* pixels = nullptr;  // Row 0
+    int width = 0;
+    int height = 0;
+    ptrdiff_t stride = 0;
+
+    uint8_t* row(int y) const
+    {
+        return pixels + y * stride;
+    }
+};
+
+/**
+ * Views an image's pixels (a view of a const image is only ever read, or
+ * written when the image was just made and so shares its pixels with nothing)
+ * @param image The Image
+ * @return the BGR24 view
+ */
+PixelView image_view(const Image& image)
+{
+    PixelView view;
+    view.pixels = image.empty() ? nullptr : (uint8_t*)image.row(0);
+    view.width = image.width;
+    view.height = image.height;
+    view.stride = image.stride;
+    return view;
+}
+
+/**
+ * Views an image's pixels to change them in place
+ * Pixels still shared with a copy of the image are copied first (see PixelBuffer).
+ * @param image The Image
+ * @return the BGR24 view
+ */
+PixelView writable_view(Image& image)
+{
+    PixelView view = image_view(image);
+    view.pixels = image.empty() ? nullptr : image.row(0);
+    return view;
+}
+
+/**
+ * Rotation kernel: turns pixels a fixed number of clockwise quarter turns
+ * into a second view (height x width for odd turns, same size otherwise).
+ * Quarter turns go in square tiles (see ROTATE_TILE); along an output row the
+ * source pixel moves by one source row, a constant step, so the inner loop is
+ * just a pointer bump and a fixed-size copy.
+ *     90:  output (y, x) comes from source (height-1-x, y)
+ *     180: output (y, x) comes from source (height-1-y, width-1-x)
+ *     270: output (y, x) comes from source (x, width-1-y)
+ */
+template <typename Format, int Turns>
+struct RotateKernel
+{
+    static void run(const PixelView& src, const PixelView& dst)
+    {
+        const int bytes = Format::BYTES;
+        if (Turns == 0 || Turns == 2)
+        {
+            parallel_rows(dst.height, dst.width * bytes, [&](int first, int last) {
+                for (int row = first; row < last; ++row)
+                {
+                    uint8_t* out = dst.row(row);
+                    if (Turns == 0)
+                    {
+                        memcpy(out, src.row(row), (size_t)dst.width * bytes);
+                        continue;
+                    }
+                    const uint8_t* in = src.row(src.height - 1 - row) + (ptrdiff_t)(src.width - 1) * bytes;
+                    for (int col = 0; col < dst.width; ++col, in -= bytes, out += bytes)
+                    {
+                        copy_pixel<Format>(out, in);
+                    }
+                }
+            });
+            return;
+        }
+
+        const ptrdiff_t step = Turns == 1 ? -src.stride : src.stride;
+        int tile_rows = (dst.height + ROTATE_TILE - 1) / ROTATE_TILE;
+        thread_pool().parallel_for(tile_rows, [&](int tile_row) {
+            int tile_y = tile_row * ROTATE_TILE;
+            int end_y = min(dst.height, tile_y + ROTATE_TILE);
+            for (int tile_x = 0; tile_x < dst.width; tile_x += ROTATE_TILE)
+            {
+                int count = min(dst.width, tile_x + ROTATE_TILE) - tile_x;
+                for (int y = tile_y; y < end_y; ++y)
+                {
+                    uint8_t* out = dst.row(y) + (ptrdiff_t)tile_x * bytes;
+                    const uint8_t* in = Turns == 1 ? src.row(src.height - 1 - tile_x) + (ptrdiff_t)y * bytes
+                                                   : src.row(tile_x) + (ptrdiff_t)(src.width - 1 - y) * bytes;
+                    for (int x = 0; x < count; ++x, out += bytes, in += step)
+                    {
+                        copy_pixel<Format>(out, in);
+                    }
+                }
+            }
+        });
+    }
+};
+
+/**
+ * In-place rotation kernel for 180 degrees: row y swaps with row height-1-y,
+ * reversing the pixel order of both
+ */
+template <typename Format>
+struct Rotate180InPlaceKernel
+{
+    static void run(const PixelView& view)
+    {
+        const int bytes = Format::BYTES;
+        int height = view.height;
+        int width = view.width;
+        parallel_rows((height + 1) / 2, 2 * width * bytes, [&](int first, int last) {
+            for (int row = first; row < last; ++row)
+            {
+                uint8_t* top = view.row(row);
+                uint8_t* bottom = view.row(height - 1 - row) + (ptrdiff_t)(width - 1) * bytes;
+                // The middle row of an odd height image is swapped with itself, so only go halfway
+                int count = (row == height - 1 - row) ? width / 2 : width;
+                for (int col = 0; col < count; ++col, top += bytes, bottom -= bytes)
+                {
+                    uint8_t pixel[bytes];
+                    copy_pixel<Format>(pixel, top);
+                    copy_pixel<Format>(top, bottom);
+                    copy_pixel<Format>(bottom, pixel);
+                }
+            }
+        });
+    }
+};
+
+/**
+ * Enlarge kernel: repeats every pixel x_scale times across and every row
+ * y_scale times down (whole-number nearest neighbor, like process 6).
+ * A nonzero XScale or YScale fixes that factor at compile time, which unrolls
+ * the repeat into straight-line copies; 0 takes the factor given at run time.
+ */
+template <typename Format, int XScale, int YScale>
+struct EnlargeKernel
+{
+    static void run(const PixelView& src, const PixelView& dst, int x_scale, int y_scale)
+    {
+        const int bytes = Format::BYTES;
+        const int x_repeat = XScale ? XScale : x_scale;
+        const int y_repeat = YScale ? YScale : y_scale;
+        size_t row_bytes = (size_t)dst.width * bytes;
+        parallel_rows(src.height, (int)row_bytes * y_repeat, [&](int first, int last) {
+            for (int row = first; row < last; ++row)
+            {
+                const uint8_t* in = src.row(row);
+                uint8_t* first_copy = dst.row(row * y_repeat);
+                uint8_t* out = first_copy;
+                for (int col = 0; col < src.width; ++col, in += bytes)
+                {
+                    for (int i = 0; i < x_repeat; ++i, out += bytes)
+                    {
+                        copy_pixel<Format>(out, in);
+                    }
+                }
+                for (int i = 1; i < y_repeat; ++i)
+                {
+                    memcpy(dst.row(row * y_repeat + i), first_copy, row_bytes);
+                }
+            }
+        });
+    }
+};
+
+// Kernel dispatch tables
+// Rotations by quarter turns; enlarges by x and y factor, with factors up to
+// MAX_FIXED_SCALE specialized and index 0 for any other
+typedef void (*RotateFunction)(const PixelView& src, const PixelView& dst);
+typedef void (*EnlargeFunction)(const PixelView& src, const PixelView& dst, int x_scale, int y_scale);
+const int MAX_FIXED_SCALE = 4;
+
+#define ROTATE_KERNELS(F) \
+    {RotateKernel<F, 0>::run, RotateKernel<F, 1>::run, RotateKernel<F, 2>::run, RotateKernel<F, 3>::run}
+#define ENLARGE_KERNEL_ROW(F, X)                                                                   \
+    {EnlargeKernel<F, X, 0>::run, EnlargeKernel<F, X, 1>::run, EnlargeKernel<F, X, 2>::run,        \
+     EnlargeKernel<F, X, 3>::run, EnlargeKernel<F, X, 4>::run}
+#define ENLARGE_KERNELS(F)                                                                          \
+    {ENLARGE_KERNEL_ROW(F, 0), ENLARGE_KERNEL_ROW(F, 1), ENLARGE_KERNEL_ROW(F, 2),                  \
+     ENLARGE_KERNEL_ROW(F, 3), ENLARGE_KERNEL_ROW(F, 4)}
+
+const RotateFunction rotate_kernels[4] = ROTATE_KERNELS(Bgr24Format);
+const EnlargeFunction enlarge_kernels[MAX_FIXED_SCALE + 1][MAX_FIXED_SCALE + 1] = ENLARGE_KERNELS(Bgr24Format);
+
+#undef ROTATE_KERNELS
+#undef ENLARGE_KERNEL_ROW
+#undef ENLARGE_KERNELS
+
+/**
+ * Rotates pixels into a second view through the kernel for the turns
+ * @param src   The pixels to rotate
+ * @param dst   The output, already the rotated size
+ * @param turns Clockwise quarter turns, 0 to 3
+ */
+void rotate_pixels(const PixelView& src, const PixelView& dst, int turns)
+{
+    rotate_kernels[turns](src, dst);
+}
+
+/**
+ * Enlarges pixels into a second view through the kernel for the factors
+ * @param src     The pixels to enlarge
+ * @param dst     The output, x_scale times as wide and y_scale times as tall
+ * @param x_scale The whole-number x factor
+ * @param y_scale The whole-number y factor
+ */
+void enlarge_pixels(const PixelView& src, const PixelView& dst, int x_scale, int y_scale)
+{
+    int x = x_scale <= MAX_FIXED_SCALE ? x_scale : 0;
+    int y = y_scale <= MAX_FIXED_SCALE ? y_scale : 0;
+    enlarge_kernels[x][y](src, dst, x_scale, y_scale);
+}
+
+/**
+ * Rotates an image 180 degrees without a second buffer
+ * Row y swaps with row height-1-y, reversing the pixel order of both.
+ * @param image The Image
+ */
+void rotate_180_in_place(Image& image) {
+    Rotate180InPlaceKernel<Bgr24Format>::run(writable_view(image));
+}
+
+/**
+ * Rotates an image 90 or 270 degrees clockwise into a new image
+ * @param image The Image
+ * @param turns 1 for 90 degrees, 3 for 270 degrees
+ * @return the rotated image
+ */
+Image rotate_quarter(const Image& image, int turns) {
+    Image rotated = make_image(image.height, image.width);
+    rotate_pixels(image_view(image), image_view(rotated), turns);
+    return rotated;
+}
+
+/**
+ * Rotates an image by any number of quarter turns, in place when possible
+ * 0 and 180 degrees never allocate; 90 and 270 degrees replace the image.
+ * @param image The Image
+ * @param rotations The number of 90 degree rotations (negative turns counterclockwise)
+ */
+void rotate_image(Image& image, int rotations) {
+    TRACE_SCOPE("rotate");
+    TRACE_BYTES((long long)image.width * image.height * BYTES_PER_PIXEL);
+    int turns = quarter_turns(rotations);
+    if (turns == 2) {
+        rotate_180_in_place(image);
+    } else if (turns != 0) {
+        image = rotate_quarter(image, turns);
+    }
+}
+
+/**
+ * Process 4: Rotates the specified image 90 degrees
+ * Any rotation count is done in a single pass, by the kernel for its turns
+ * @param image The Image
+ * @param rotations The number of rotations (negative turns counterclockwise)
+ */
+Image apply90Rotation(const Image& image, int rotations) {
+    TRACE_SCOPE("rotate");
+    TRACE_BYTES((long long)image.width * image.height * BYTES_PER_PIXEL);
+    int turns = quarter_turns(rotations);
+    Image rotatedImage = turns % 2 ? make_image(image.height, image.width) : make_image(image.width, image.height);
+    rotate_pixels(image_view(image), image_view(rotatedImage), turns);
+    return rotatedImage;
+}
+// Resampling filters for resize_image()
+// NEAREST picks the source pixel under the output pixel's center, BILINEAR
+// blends the two nearest source pixels in each direction and BOX averages
+// every source pixel the output pixel covers (best for shrinking)
+enum ResampleFilter { NEAREST, BILINEAR, BOX };
+
+// Resampling weights are fixed-point fractions of 1 << RESAMPLE_BITS
+const int RESAMPLE_BITS = 14;
+
+// Coefficient table structure
+// For each output column (or row), the source columns (or rows) it reads and
+// their weights. Built once per resize and shared by every row (or column).
+struct ResampleTable
+{
+    vector<int> first;   // Where each output position's taps start in source/weight
+    vector<int> count;   // How many taps each output position has
+    vector<int> source;
+    vector<int> weight;
+};
+
+/**
+ * Builds the coefficient table for resampling one dimension
+ * @param source_size The number of source pixels
+ * @param target_size The number of output pixels
+ * @param filter      The resampling filter
+ * @return the table
+ */
+ResampleTable make_resample_table(int source_size, int target_size, ResampleFilter filter)
+{
+    ResampleTable table;
+    double scale = (double)source_size / target_size;
+    vector<int> sources;
+    vector<double> weights;
+
+    for (int i = 0; i < target_size; i++)
+    {
+        sources.clear();
+        weights.clear();
+        if (filter == NEAREST)
+        {
+            // Center of the output pixel, in integers so integer factors match process_6 exactly
+            sources.push_back((int)(((2LL * i + 1) * source_size) / (2LL * target_size)));
+            weights.push_back(1);
+        }
+        else if (filter == BILINEAR)
+        {
+            double center = (i + 0.5) * scale - 0.5;
+            int left = (int)floor(center);
+            double fraction = center - left;
+            sources.push_back(min(max(left, 0), source_size - 1));
+            weights.push_back(1 - fraction);
+            sources.push_back(min(max(left + 1, 0), source_size - 1));
+            weights.push_back(fraction);
+        }
+        else
+        {
+            // Each source pixel counts by how much of it the output pixel covers
+            double start = i * scale;
+            double end = min((i + 1) * scale, (double)source_size);
+            for (int s = (int)start; s < end; s++)
+            {
+                double coverage = min(end, s + 1.0) - max(start, (double)s);
+                if (coverage > 0)
+                {
+                    sources.push_back(s);
+                    weights.push_back(coverage);
+                }
+            }
+        }
+
+        // Turn the weights into fixed point, making sure they add up to exactly one
+        double total = 0;
+        for (double w : weights)
+        {
+            total += w;
+        }
+        table.first.push_back((int)table.source.size());
+        table.count.push_back((int)sources.size());
+        int remaining = 1 << RESAMPLE_BITS;
+        int largest = (int)table.weight.size();
+        for (size_t k = 0; k < sources.size(); k++)
+        {
+            int w = (int)lround(weights[k] / total * (1 << RESAMPLE_BITS));
+            table.source.push_back(sources[k]);
+            table.weight.push_back(w);
+            remaining -= w;
+            if (w > table.weight[largest])
+            {
+                largest = (int)table.weight.size() - 1;
+            }
+        }
+        table.weight[largest] += remaining;
+    }
+    return table;
+}
+
+/**
+ * Makes the byte offsets nearest neighbor sampling gathers an output row from
+ * @param columns The nearest neighbor table for the row
+ * @return the source byte offset of every output pixel
+ */
+vector<int> nearest_offsets(const ResampleTable& columns)
+{
+    vector<int> offsets(columns.count.size());
+    for (size_t col = 0; col < offsets.size(); ++col)
+    {
+        offsets[col] = columns.source[col] * BYTES_PER_PIXEL;
+    }
+    return offsets;
+}
+
+/**
+ * Gathers one output row for nearest neighbor sampling
+ * @param src     The source row
+ * @param dst     The output row
+ * @param offsets The source byte offsets from nearest_offsets
+ */
+inline void nearest_row(const uint8_t* src, uint8_t* dst, const vector<int>& offsets)
+{
+    for (size_t col = 0; col < offsets.size(); ++col, dst += BYTES_PER_PIXEL)
+    {
+        const uint8_t* px = src + offsets[col];
+        dst[BLUE] = px[BLUE];
+        dst[GREEN] = px[GREEN];
+        dst[RED] = px[RED];
+    }
+}
+
+/**
+ * Resamples one row to a new width (the horizontal pass of resize_image)
+ * @param src     The source row
+ * @param dst     The output row, as many pixels as columns has entries
+ * @param columns The table for the row
+ */
+inline void resample_row(const uint8_t* src, uint8_t* dst, const ResampleTable& columns)
+{
+    const int half = 1 << (RESAMPLE_BITS - 1);
+    int new_width = (int)columns.count.size();
+    for (int col = 0; col < new_width; ++col, dst += BYTES_PER_PIXEL)
+    {
+        int sum[3] = {half, half, half};
+        int end = columns.first[col] + columns.count[col];
+        for (int k = columns.first[col]; k < end; ++k)
+        {
+            const uint8_t* px = src + columns.source[k] * BYTES_PER_PIXEL;
+            int w = columns.weight[k];
+            sum[BLUE] += px[BLUE] * w;
+            sum[GREEN] += px[GREEN] * w;
+            sum[RED] += px[RED] * w;
+        }
+        dst[BLUE] = sum[BLUE] >> RESAMPLE_BITS;
+        dst[GREEN] = sum[GREEN] >> RESAMPLE_BITS;
+        dst[RED] = sum[RED] >> RESAMPLE_BITS;
+    }
+}
+
+/**
+ * Blends horizontally resampled rows into one output row (the vertical pass of
+ * resize_image), a whole row of sums at a time so the rows are read in order
+ * @param rows       The table for the columns
+ * @param row        The output row
+ * @param source_row Returns the horizontally resampled source row for a row index
+ * @param row_bytes  The bytes in a row
+ * @param sums       Scratch space for row_bytes sums
+ * @param dst        The output row
+ */
+template <typename SourceRow>
+inline void blend_rows(const ResampleTable& rows, int row, SourceRow source_row, int row_bytes,
+                       int* sums, uint8_t* dst)
+{
+    fill(sums, sums + row_bytes, 1 << (RESAMPLE_BITS - 1));
+    int end = rows.first[row] + rows.count[row];
+    for (int k = rows.first[row]; k < end; ++k)
+    {
+        const uint8_t* src = source_row(rows.source[k]);
+        int w = rows.weight[k];
+        for (int i = 0; i < row_bytes; ++i)
+        {
+            sums[i] += src[i] * w;
+        }
+    }
+    for (int i = 0; i < row_bytes; ++i)
+    {
+        dst[i] = sums[i] >> RESAMPLE_BITS;
+    }
+}
+
+/**
+ * Resizes an image with nearest neighbor sampling
+ * Whole-number enlarges go through the enlarge kernels. Otherwise each output
+ * row is gathered through a table of source byte offsets; output rows that come
+ * from the same source row as the row above are copied whole.
+ * @param image      The Image
+ * @param new_width  The width of the output image
+ * @param new_height The height of the output image
+ * @return the resized image
+ */
+Image resize_nearest(const Image& image, int new_width, int new_height)
+{
+    Image resized = make_image(new_width, new_height);
+    if (new_width % image.width == 0 && new_height % image.height == 0)
+    {
+        // Whole-number factors just repeat pixels and rows
+        enlarge_pixels(image_view(image), image_view(resized), new_width / image.width,
+                       new_height / image.height);
+        return resized;
+    }
+    vector<int> offsets = nearest_offsets(make_resample_table(image.width, new_width, NEAREST));
+    ResampleTable rows = make_resample_table(image.height, new_height, NEAREST);
+
+    parallel_rows(new_height, new_width * BYTES_PER_PIXEL, [&](int first, int last) {
+        for (int row = first; row < last; ++row)
+        {
+            uint8_t* dst = resized.row(row);
+            if (row > first && rows.source[row] == rows.source[row - 1])
+            {
+                memcpy(dst, resized.row(row - 1), new_width * BYTES_PER_PIXEL);
+                continue;
+            }
+            nearest_row(image.row(rows.source[row]), dst, offsets);
+        }
+    });
+    return resized;
+}
+
+/**
+ * Resizes an image to the given size
+ * Bilinear and box filtering run as two passes: every source row is resampled
+ * to the new width, then every column of that is resampled to the new height.
+ * @param image      The Image
+ * @param new_width  The width of the output image
+ * @param new_height The height of the output image
+ * @param filter     The resampling filter
+ * @return the resized image, or an empty image if the size is not positive or
+ *         too big (see image_size_fits)
+ */
+Image resize_image(const Image& image, int new_width, int new_height, ResampleFilter filter)
+{
+    TRACE_SCOPE("resize");
+    if (image.empty() || !image_size_fits(new_width, new_height))
+    {
+        return {};
+    }
+    TRACE_BYTES((long long)new_width * new_height * BYTES_PER_PIXEL);
+    if (filter == NEAREST)
+    {
+        return resize_nearest(image, new_width, new_height);
+    }
+
+    ResampleTable columns = make_resample_table(image.width, new_width, filter);
+    ResampleTable rows = make_resample_table(image.height, new_height, filter);
+
+    // Horizontal pass
+    Image wide = make_image(new_width, image.height);
+    parallel_rows(image.height, new_width * BYTES_PER_PIXEL, [&](int first, int last) {
+        for (int row = first; row < last; ++row)
+        {
+            resample_row(image.row(row), wide.row(row), columns);
+        }
+    });
+
+    // Vertical pass
+    Image resized = make_image(new_width, new_height);
+    int row_bytes = new_width * BYTES_PER_PIXEL;
+    parallel_rows(new_height, row_bytes, [&](int first, int last) {
+        vector<int> sums(row_bytes);
+        for (int row = first; row < last; ++row)
+        {
+            blend_rows(rows, row, [&](int source) { return (const uint8_t*)wide.row(source); },
+                       row_bytes, sums.data(), resized.row(row));
+        }
+    });
+    return resized;
+}
+
+/**
+ * Resizes an image by fractional scale factors
+ * @param image   The Image
+ * @param x_scale The horizontal scale factor (e.g. 0.5 halves the width)
+ * @param y_scale The vertical scale factor
+ * @param filter  The resampling filter
+ * @return the resized image, or an empty image if the new size is not positive
+ *         or too big (see image_size_fits)
+ */
+Image scale_image(const Image& image, double x_scale, double y_scale, ResampleFilter filter)
+{
+    // The new size is checked before it is narrowed to int
+    double scaled_width = image.width * x_scale;
+    double scaled_height = image.height * y_scale;
+    if (!(x_scale > 0) || !(y_scale > 0) || !(scaled_width < INT_MAX) || !(scaled_height < INT_MAX))
+    {
+        return {};
+    }
+    int new_width = max(1, (int)lround(scaled_width));
+    int new_height = max(1, (int)lround(scaled_height));
+    return resize_image(image, new_width, new_height, filter);
+}
+
+/**
+ * Process 6: Enlarges the image in the x and y direction
+ * (nearest neighbor, see resize_image for other filters and fractional scales)
+ * @param x_scale The x scale direction
+ * @param y_scale The y scale direction
+ * @return the enlarged image, or an empty image if it would be too big (see image_size_fits)
+ */
+Image process_6(const Image& image, int x_scale, int y_scale){
+    long long new_width = (long long)image.width * x_scale;
+    long long new_height = (long long)image.height * y_scale;
+    if (!image_size_fits(new_width, new_height))
+    {
+        return {};
+    }
+    return resize_image(image, (int)new_width, (int)new_height, NEAREST);
+}
+/**
+ * Process 7 on a single row: Convert pixels to high contrast (black and white only)
+ * @param px The first pixel of the row
+ * @param width The number of pixels in the row
+ */
+void high_contrast_row(uint8_t* px, int width){
+    for (int col = 0; col < width; ++col, px += BYTES_PER_PIXEL) {
+        // Grey value
+        int average = (px[RED] + px[GREEN] + px[BLUE])/3;
+
+        if(average >= 255/2){
+            px[RED] = 255;
+            px[GREEN] = 255;
+            px[BLUE] = 255;
+        } else{
+            px[RED] = 0;
+            px[GREEN] = 0;
+            px[BLUE] = 0;
+        }
+    }
+}
+/**
+ * Process 7: Convert image to high contrast (black and white only)
+ * @param image The Image
+ */
+void process_7(Image& image){
+    for (int row = 0; row < image.height; ++row) {
+        high_contrast_row(image.row(row), image.width);
+    }
+}
+/**
+ * Process 8 on a single row: Lightens pixels by a scaling factor
+ * @param px The first pixel of the row
+ * @param width The number of pixels in the row
+ * @param scaling_factor The scaling factor
+ */
+void lighten_row(uint8_t* px, int width, double scaling_factor){
+    for (int col = 0; col < width; ++col, px += BYTES_PER_PIXEL) {
+        px[RED] = lighten_value(px[RED], scaling_factor);
+        px[GREEN] = lighten_value(px[GREEN], scaling_factor);
+        px[BLUE] = lighten_value(px[BLUE], scaling_factor);
+    }
+}
+/**
+ * Process 8: Lightens image by a scaling factor
+ * @param image The Image
+ * @param scaling_factor The scaling factor
+ */
+void process_8(Image& image, double scaling_factor){
+    for (int row = 0; row < image.height; ++row) {
+        lighten_row(image.row(row), image.width, scaling_factor);
+    }
+}
+/**
+ * Process 9 on a single row: Darkens pixels by a scaling factor
+ * @param px The first pixel of the row
+ * @param width The number of pixels in the row
+ * @param scaling_factor The scaling factor
+ */
+void darken_row(uint8_t* px, int width, double scaling_factor){
+    for (int col = 0; col < width; ++col, px += BYTES_PER_PIXEL) {
+        px[RED] = darken_value(px[RED], scaling_factor);
+        px[GREEN] = darken_value(px[GREEN], scaling_factor);
+        px[BLUE] = darken_value(px[BLUE], scaling_factor);
+    }
+}
+/**
+ * Process 9: Darkens image by a scaling factor
+ * @param image The Image
+ * @param scaling_factor The scaling factor
+ */
+void process_9(Image& image, double scaling_factor){
+    for (int row = 0; row < image.height; ++row) {
+        darken_row(image.row(row), image.width, scaling_factor);
+    }
+}
+/**
+ * Process 10 on a single row: Converts pixels to only black, white, red, blue, and green
+ * @param px The first pixel of the row
+ * @param width The number of pixels in the row
+ */
+void five_color_row(uint8_t* px, int width){
+    for (int col = 0; col < width; ++col, px += BYTES_PER_PIXEL) {
+        int maximum = px[RED];
+
+        if(px[BLUE] > maximum){
+            maximum = px[BLUE];
+        }
+        if(px[GREEN] > maximum){
+            maximum = px[GREEN];
+        }
+
+        int sum = px[RED] + px[BLUE] + px[GREEN];
+        if(sum >= 550){
+            px[RED] = 255;
+            px[BLUE] = 255;
+            px[GREEN] = 255;
+        } else if(sum <= 150) {
+            px[RED] = 0;
+            px[BLUE] = 0;
+            px[GREEN] = 0;
+        } else if(maximum == px[RED]){
+            px[RED] = 255;
+            px[BLUE] = 0;
+            px[GREEN] = 0;
+        } else if(maximum == px[GREEN]){
+            px[RED] = 0;
+            px[BLUE] = 0;
+            px[GREEN] = 255;
+        } else {
+            px[RED] = 0;
+            px[BLUE] = 255;
+            px[GREEN] = 0;
+        }
+    }
+}
+/**
+ * Process 10: Converts image to only black, white, red, blue, and green
+ * @param image The Image
+ */
+void process_10(Image& image){
+    for (int row = 0; row < image.height; ++row) {
+        five_color_row(image.row(row), image.width);
+    }
+}
+
+// Point effect structure
+// Describes one of the effects that only need the pixel they are changing
+// (grayscale, Clarendon, high contrast, lighten, darken, five-color), so it
+// can be applied a row at a time without the rest of the image
+enum PointEffectType { GRAYSCALE, CLARENDON, HIGH_CONTRAST, LIGHTEN, DARKEN, FIVE_COLOR };
+struct PointEffect
+{
+    PointEffectType type;
+    double scaling_factor;
+};
+
+/**
+ * Gets the name of a point effect, as option 12 spells it
+ * @param type The point effect
+ * @return the name
+ */
+const char* point_effect_name(PointEffectType type)
+{
+    const char* names[] = {"grayscale", "clarendon", "high_contrast", "lighten", "darken", "five_color"};
+    return names[type];
+}
+
+/**
+ * Applies a point effect to a single row of pixels
+ * @param effect The point effect
+ * @param px     The first pixel of the row
+ * @param width  The number of pixels in the row
+ */
+void apply_point_effect_row(const PointEffect& effect, uint8_t* px, int width)
+{
+    switch (effect.type)
+    {
+    case GRAYSCALE:
+        grayscale_row(px, width);
+        break;
+    case CLARENDON:
+        clarendon_row(px, width, effect.scaling_factor);
+        break;
+    case HIGH_CONTRAST:
+        high_contrast_row(px, width);
+        break;
+    case LIGHTEN:
+        lighten_row(px, width, effect.scaling_factor);
+        break;
+    case DARKEN:
+        darken_row(px, width, effect.scaling_factor);
+        break;
+    case FIVE_COLOR:
+        five_color_row(px, width);
+        break;
+    }
+}
+
+// Number of distinct r + g + b sums
+const int CHANNEL_SUMS = 3 * 255 + 1;
+
+// Compiled tone table structure
+// Every effect except five-color is a function of the channel value, the pixel
+// sum, or both, so once its scaling factor is known it can be compiled into
+// lookups and applied without any floating point:
+//   PER_CHANNEL  channel = tables[classes[r + g + b]][channel]
+//                (lighten and darken have one class, Clarendon has three:
+//                unchanged, light and dark)
+//   PER_SUM      channel = sums[channel][r + g + b]
+//                (grayscale and high contrast)
+// A chain of tone effects compiles into a single table (see fuse_tone_effect).
+enum ToneLutForm { PER_CHANNEL, PER_SUM };
+struct ToneLut
+{
+    ToneLutForm form = PER_CHANNEL;
+    int class_count = 1;
+    uint8_t classes[CHANNEL_SUMS];           // PER_CHANNEL: table for each sum
+    uint8_t tables[3][256];                  // PER_CHANNEL: [class][channel value]
+    uint8_t sums[BYTES_PER_PIXEL][CHANNEL_SUMS];  // PER_SUM: [channel][sum]
+};
+
+/**
+ * Makes the tone table that leaves every pixel as it is
+ * @return the table
+ */
+ToneLut identity_tone_lut()
+{
+    ToneLut lut;
+    memset(lut.classes, 0, sizeof(lut.classes));
+    for (int v = 0; v < 256; v++)
+    {
+        lut.tables[0][v] = lut.tables[1][v] = lut.tables[2][v] = v;
+    }
+    return lut;
+}
+
+/**
+ * Checks whether a tone table leaves every pixel as it is
+ * @param lut The tone table
+ * @return True if it does
+ */
+bool is_identity_tone_lut(const ToneLut& lut)
+{
+    if (lut.form != PER_CHANNEL || lut.class_count != 1)
+    {
+        return false;
+    }
+    for (int v = 0; v < 256; v++)
+    {
+        if (lut.tables[0][v] != v)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Compiles a point effect into a tone table
+ * The entries come from the same formulas as the row functions, narrowed to a
+ * byte the same way, so the table gives exactly the same pixels.
+ * @param effect The point effect
+ * @param lut    The table to fill in
+ * @return True if successful and false if the effect is not a tone effect (five-color)
+ */
+bool make_tone_lut(const PointEffect& effect, ToneLut& lut)
+{
+    lut = identity_tone_lut();
+    double s = effect.scaling_factor;
+    switch (effect.type)
+    {
+    case LIGHTEN:
+    case DARKEN:
+        for (int v = 0; v < 256; v++)
+        {
+            lut.tables[0][v] = effect.type == LIGHTEN ? lighten_value(v, s) : darken_value(v, s);
+        }
+        return true;
+    case CLARENDON:
+        lut.class_count = 3;
+        for (int sum = 0; sum < CHANNEL_SUMS; sum++)
+        {
+            int average = sum / 3;
+            lut.classes[sum] = average >= 170 ? 1 : (average < 90 ? 2 : 0);
+        }
+        for (int v = 0; v < 256; v++)
+        {
+            lut.tables[1][v] = clarendon_light_value(v, s);
+            lut.tables[2][v] = darken_value(v, s);
+        }
+        return true;
+    case GRAYSCALE:
+    case HIGH_CONTRAST:
+        lut.form = PER_SUM;
+        for (int sum = 0; sum < CHANNEL_SUMS; sum++)
+        {
+            int average = sum / 3;
+            uint8_t value = effect.type == GRAYSCALE ? average : (average >= 255 / 2 ? 255 : 0);
+            lut.sums[BLUE][sum] = lut.sums[GREEN][sum] = lut.sums[RED][sum] = value;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Folds another point effect into the end of a tone table
+ * A per-sum table already makes the whole pixel from its sum, so any effect can
+ * follow it. A per-channel table can be followed by lighten or darken; an
+ * effect that looks at the pixel sum can only start from the identity table.
+ * @param lut    The tone table, updated to apply the effect after its own
+ * @param effect The point effect
+ * @return True if the effect was folded in, false if it needs a pass of its own
+ */
+bool fuse_tone_effect(ToneLut& lut, const PointEffect& effect)
+{
+    if (lut.form == PER_SUM)
+    {
+        // Run the effect on one pixel per sum
+        uint8_t pixels[CHANNEL_SUMS * BYTES_PER_PIXEL];
+        for (int sum = 0; sum < CHANNEL_SUMS; sum++)
+        {
+            for (int channel = 0; channel < BYTES_PER_PIXEL; channel++)
+            {
+                pixels[sum * BYTES_PER_PIXEL + channel] = lut.sums[channel][sum];
+            }
+        }
+        apply_point_effect_row(effect, pixels, CHANNEL_SUMS);
+        for (int sum = 0; sum < CHANNEL_SUMS; sum++)
+        {
+            for (int channel = 0; channel < BYTES_PER_PIXEL; channel++)
+            {
+                lut.sums[channel][sum] = pixels[sum * BYTES_PER_PIXEL + channel];
+            }
+        }
+        return true;
+    }
+
+    if (is_identity_tone_lut(lut))
+    {
+        return make_tone_lut(effect, lut);
+    }
+
+    ToneLut next;
+    if (!make_tone_lut(effect, next) || next.form != PER_CHANNEL || next.class_count != 1)
+    {
+        return false;
+    }
+    for (int k = 0; k < lut.class_count; k++)
+    {
+        for (int v = 0; v < 256; v++)
+        {
+            lut.tables[k][v] = next.tables[0][lut.tables[k][v]];
+        }
+    }
+    return true;
+}
+
+/**
+ * Applies a tone table to a single row of pixels
+ * @param lut   The tone table
+ * @param px    The first pixel of the row
+ * @param width The number of pixels in the row
+ */
+void apply_tone_lut_row(const ToneLut& lut, uint8_t* px, int width)
+{
+    if (lut.form == PER_SUM)
+    {
+        for (int col = 0; col < width; ++col, px += BYTES_PER_PIXEL)
+        {
+            int sum = px[RED] + px[GREEN] + px[BLUE];
+            px[RED] = lut.sums[RED][sum];
+            px[GREEN] = lut.sums[GREEN][sum];
+            px[BLUE] = lut.sums[BLUE][sum];
+        }
+    }
+    else if (lut.class_count == 1)
+    {
+        int bytes = width * BYTES_PER_PIXEL;
+        for (int i = 0; i < bytes; i++)
+        {
+            px[i] = lut.tables[0][px[i]];
+        }
+    }
+    else
+    {
+        for (int col = 0; col < width; ++col, px += BYTES_PER_PIXEL)
+        {
+            const uint8_t* table = lut.tables[lut.classes[px[RED] + px[GREEN] + px[BLUE]]];
+            px[RED] = table[px[RED]];
+            px[GREEN] = table[px[GREEN]];
+            px[BLUE] = table[px[BLUE]];
+        }
+    }
+}
+
+// SIMD levels, best first picked at startup by detect_simd_level()
+enum SimdLevel { SIMD_NONE, SIMD_SSE41, SIMD_AVX2 };
+
+// Fixed-point channel map structure
+// Stands in for one of the per-channel formulas above as
+//     result = saturate((offset + value * scale) >> 16)
+// which vectorizes with plain integer multiplies and saturating packs. It is only
+// used when it gives exactly the same 8-bit result as the double formula for all
+// 256 inputs. Before saturating, the result always fits in 16 bits.
+// Note: Clarendon's last few pixels of each SIMD row, and the reference row
+// functions (--verify, palette colors), still use the double formulas. So does
+// building the tone tables, these maps, vignette tables and resize weights,
+// once per factor or image size, before any pixel is touched.
+struct FixedPointMap
+{
+    bool exact = false;
+    int offset = 0;
+    int scale = 0;
+    // The same offset and scale split into 16-bit halves, for map_bytes_fixed()
+    uint16_t offset_high = 0;
+    uint16_t offset_low = 0;
+    uint16_t scale_whole = 0;
+    uint16_t scale_fraction = 0;
+};
+
+/**
+ * Finds a fixed-point map that reproduces a per-channel formula exactly
+ * A saturated result of 0 or 255 only needs the map to reach at most 0 or at
+ * least 255 there, so formulas that saturate still fit.
+ * @param results The 8-bit result of the formula for each of the 256 channel values
+ * @param slope   The slope of the formula (the scaling factor)
+ * @return the map, with exact set to false if no 16-bit fraction reproduces every result
+ */
+FixedPointMap fit_fixed_point_map(const int results[256], double slope)
+{
+    FixedPointMap map;
+    if (!(fabs(slope) < 64))
+    {
+        return map;
+    }
+
+    // For a given scale, every value narrows the offsets that floor to the right
+    // result down to a range (open ended where the result saturates); any offset
+    // left in all 256 ranges works. The chosen offset hits some value's result
+    // exactly, so with the slope below 64 no unsaturated result leaves 16 bits.
+    long long nominal = llround(slope * 65536);
+    for (long long scale = nominal - 64; scale <= nominal + 64; ++scale)
+    {
+        long long lowest = LLONG_MIN;
+        long long highest = LLONG_MAX;
+        for (int v = 0; v < 256 && lowest <= highest; ++v)
+        {
+            if (results[v] > 0)
+            {
+                lowest = max(lowest, results[v] * 65536LL - v * scale);
+            }
+            if (results[v] < 255)
+            {
+                highest = min(highest, results[v] * 65536LL + 65535 - v * scale);
+            }
+        }
+        long long offset = lowest != LLONG_MIN ? lowest : highest;
+        // The sum must also fit in the 32-bit lanes
+        if (lowest <= highest && llabs(offset) + 255 * llabs(scale) < (1LL << 31))
+        {
+            map.exact = true;
+            map.offset = (int)offset;
+            map.scale = (int)scale;
+            map.offset_high = (uint16_t)(map.offset >> 16);
+            map.offset_low = (uint16_t)map.offset;
+            map.scale_whole = (uint16_t)(map.scale >> 16);
+            map.scale_fraction = (uint16_t)map.scale;
+            return map;
+        }
+    }
+    return map;
+}
+
+/**
+ * Applies a fixed-point map to a run of channel bytes without SIMD intrinsics
+ * The map is worked out in 16-bit lanes, splitting the offset and scale into
+ * whole and fractional parts:
+ *     (offset + v * scale) >> 16 = offset_high + v * scale_whole
+ *                                  + high half of v * scale_fraction
+ *                                  + carry of (low half of v * scale_fraction + offset_low)
+ * The result fits in a signed 16-bit lane, so the sums may wrap along the way
+ * and it is then saturated to 0-255. Blocks
+ * of 16 bytes have no dependencies between them, and compilers turn them into
+ * vector code for whatever the target has (SSE2, NEON, ...). The halves are
+ * kept in the map as 16-bit fields: narrowed from an int here, GCC no longer
+ * sees a 16-bit multiply and widens the lanes to 32 bits.
+ * @param bytes The channel bytes
+ * @param count The number of bytes
+ * @param map   The fixed-point map (exact)
+ * @param table The same map as a table, for the bytes after the last full block
+ */
+void map_bytes_fixed(uint8_t* bytes, int count, const FixedPointMap& map, const uint8_t table[256])
+{
+    const uint16_t scale_whole = map.scale_whole;
+    const uint16_t scale_fraction = map.scale_fraction;
+    const uint16_t offset_high = map.offset_high;
+    const uint16_t offset_low = map.offset_low;
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        uint8_t* block = bytes + i;
+        for (int j = 0; j < 16; j++)
+        {
+            uint16_t v = block[j];
+            uint16_t product_low = (uint16_t)(v * scale_fraction);
+            uint16_t product_high = (uint16_t)(((uint32_t)v * scale_fraction) >> 16);
+            uint16_t low_sum = (uint16_t)(product_low + offset_low);
+            int16_t result = (int16_t)(offset_high + v * scale_whole + product_high + (low_sum < product_low));
+            block[j] = (uint8_t)(result < 0 ? 0 : (result > 255 ? 255 : result));
+        }
+    }
+    for (; i < count; i++)
+    {
+        bytes[i] = table[bytes[i]];
+    }
+}
+
+// pshufb masks for splitting 16 interleaved pixels (48 bytes in three 16 byte
+// blocks) into blue, green and red vectors, and for joining them back
+uint8_t split_masks[3][3][16];  // [channel][block][byte]
+uint8_t join_masks[3][3][16];   // [block][channel][byte]
+
+/**
+ * Fills in the pshufb masks and picks the best SIMD level this CPU supports
+ * @return the SIMD level
+ */
+SimdLevel detect_simd_level()
+{
+    for (int block = 0; block < 3; block++)
+    {
+        for (int channel = 0; channel < 3; channel++)
+        {
+            for (int i = 0; i < 16; i++)
+            {
+                // Byte 3*i+channel of the pixels goes to byte i of the channel vector
+                int source = 3 * i + channel;
+                split_masks[channel][block][i] = source / 16 == block ? source % 16 : 0x80;
+                // Byte i of the block comes from pixel (16*block+i)/3
+                int target = 16 * block + i;
+                join_masks[block][channel][i] = target % 3 == channel ? target / 3 : 0x80;
+            }
+        }
+    }
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return SIMD_SSE41;
+    }
+#endif
+    return SIMD_NONE;
+}
+
+// The SIMD level the point effects run at (--no-simd turns it off)
+SimdLevel simd_level = detect_simd_level();
+
+#ifdef HAVE_X86_SIMD
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+// SSE4.1 kernels: 16 pixels (48 bytes) per iteration
+// Pixels are split into blue, green and red vectors, channel sums are taken in
+// 16-bit lanes and the per-pixel branches of the scalar code become masks.
+
+// Split and join masks loaded into registers
+struct Shuffles128
+{
+    __m128i split[3][3];
+    __m128i join[3][3];
+};
+
+TARGET_SSE41 static inline Shuffles128 load_shuffles_sse41()
+{
+    Shuffles128 s;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            s.split[i][j] = _mm_loadu_si128((const __m128i*)split_masks[i][j]);
+            s.join[i][j] = _mm_loadu_si128((const __m128i*)join_masks[i][j]);
+        }
+    }
+    return s;
+}
+
+// Blocks of interleaved bytes -> one vector per channel
+TARGET_SSE41 static inline void split_sse41(const Shuffles128& s, const __m128i in[3], __m128i out[3])
+{
+    for (int c = 0; c < 3; c++)
+    {
+        out[c] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in[0], s.split[c][0]),
+                                           _mm_shuffle_epi8(in[1], s.split[c][1])),
+                              _mm_shuffle_epi8(in[2], s.split[c][2]));
+    }
+}
+
+// One vector per channel -> blocks of interleaved bytes
+TARGET_SSE41 static inline void join_sse41(const Shuffles128& s, const __m128i in[3], __m128i out[3])
+{
+    for (int k = 0; k < 3; k++)
+    {
+        out[k] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in[BLUE], s.join[k][BLUE]),
+                                           _mm_shuffle_epi8(in[GREEN], s.join[k][GREEN])),
+                              _mm_shuffle_epi8(in[RED], s.join[k][RED]));
+    }
+}
+
+TARGET_SSE41 static inline void load_blocks_sse41(const uint8_t* px, __m128i blocks[3])
+{
+    for (int k = 0; k < 3; k++)
+    {
+        blocks[k] = _mm_loadu_si128((const __m128i*)(px + 16 * k));
+    }
+}
+
+TARGET_SSE41 static inline void store_blocks_sse41(uint8_t* px, const __m128i blocks[3])
+{
+    for (int k = 0; k < 3; k++)
+    {
+        _mm_storeu_si128((__m128i*)(px + 16 * k), blocks[k]);
+    }
+}
+
+// r+g+b of each pixel in 16-bit lanes (low and high 8 pixels)
+TARGET_SSE41 static inline void sums_sse41(const __m128i channels[3], __m128i& low, __m128i& high)
+{
+    __m128i zero = _mm_setzero_si128();
+    low = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(channels[0], zero), _mm_unpacklo_epi8(channels[1], zero)),
+                        _mm_unpacklo_epi8(channels[2], zero));
+    high = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(channels[0], zero), _mm_unpackhi_epi8(channels[1], zero)),
+                         _mm_unpackhi_epi8(channels[2], zero));
+}
+
+// 0xFF where the sum is above the limit, as 8-bit lanes
+TARGET_SSE41 static inline __m128i sum_above_sse41(__m128i low, __m128i high, int limit)
+{
+    __m128i l = _mm_set1_epi16(limit);
+    return _mm_packs_epi16(_mm_cmpgt_epi16(low, l), _mm_cmpgt_epi16(high, l));
+}
+
+// 0xFF where the sum is below the limit, as 8-bit lanes
+TARGET_SSE41 static inline __m128i sum_below_sse41(__m128i low, __m128i high, int limit)
+{
+    __m128i l = _mm_set1_epi16(limit);
+    return _mm_packs_epi16(_mm_cmpgt_epi16(l, low), _mm_cmpgt_epi16(l, high));
+}
+
+// Applies a fixed-point map to 16 channel values
+// The packs saturate, signed 32 to 16 bits and then 16 bits to unsigned 8 bits
+TARGET_SSE41 static inline __m128i map_sse41(__m128i v, __m128i offset, __m128i scale)
+{
+    __m128i y[4] = {_mm_cvtepu8_epi32(v), _mm_cvtepu8_epi32(_mm_srli_si128(v, 4)),
+                    _mm_cvtepu8_epi32(_mm_srli_si128(v, 8)), _mm_cvtepu8_epi32(_mm_srli_si128(v, 12))};
+    for (int i = 0; i < 4; i++)
+    {
+        y[i] = _mm_srai_epi32(_mm_add_epi32(offset, _mm_mullo_epi32(y[i], scale)), 16);
+    }
+    return _mm_packus_epi16(_mm_packs_epi32(y[0], y[1]), _mm_packs_epi32(y[2], y[3]));
+}
+
+TARGET_SSE41 void grayscale_row_sse41(uint8_t* px, int width)
+{
+    Shuffles128 s = load_shuffles_sse41();
+    __m128i third = _mm_set1_epi16(21846);  // x * 21846 >> 16 == x / 3 for x <= 765
+    int col = 0;
+    for (; col + 16 <= width; col += 16, px += 48)
+    {
+        __m128i blocks[3], channels[3], low, high;
+        load_blocks_sse41(px, blocks);
+        split_sse41(s, blocks, channels);
+        sums_sse41(channels, low, high);
+        __m128i average = _mm_packus_epi16(_mm_mulhi_epu16(low, third), _mm_mulhi_epu16(high, third));
+        __m128i gray[3] = {average, average, average};
+        join_sse41(s, gray, blocks);
+        store_blocks_sse41(px, blocks);
+    }
+    grayscale_row(px, width - col);
+}
+
+TARGET_SSE41 void high_contrast_row_sse41(uint8_t* px, int width)
+{
+    Shuffles128 s = load_shuffles_sse41();
+    int col = 0;
+    for (; col + 16 <= width; col += 16, px += 48)
+    {
+        __m128i blocks[3], channels[3], low, high;
+        load_blocks_sse41(px, blocks);
+        split_sse41(s, blocks, channels);
+        sums_sse41(channels, low, high);
+        // average >= 127 is the same as sum >= 381
+        __m128i white = sum_above_sse41(low, high, 380);
+        __m128i bw[3] = {white, white, white};
+        join_sse41(s, bw, blocks);
+        store_blocks_sse41(px, blocks);
+    }
+    high_contrast_row(px, width - col);
+}
+
+TARGET_SSE41 void five_color_row_sse41(uint8_t* px, int width)
+{
+    Shuffles128 s = load_shuffles_sse41();
+    int col = 0;
+    for (; col + 16 <= width; col += 16, px += 48)
+    {
+        __m128i blocks[3], channels[3], low, high;
+        load_blocks_sse41(px, blocks);
+        split_sse41(s, blocks, channels);
+        sums_sse41(channels, low, high);
+        __m128i white = sum_above_sse41(low, high, 549);
+        __m128i black = sum_below_sse41(low, high, 151);
+
+        // Red wins ties, then green, then blue (same order as the scalar code)
+        __m128i maximum = _mm_max_epu8(_mm_max_epu8(channels[RED], channels[GREEN]), channels[BLUE]);
+        __m128i is_red = _mm_cmpeq_epi8(maximum, channels[RED]);
+        __m128i is_green = _mm_andnot_si128(is_red, _mm_cmpeq_epi8(maximum, channels[GREEN]));
+        __m128i is_blue = _mm_andnot_si128(_mm_or_si128(is_red, is_green), _mm_set1_epi8(-1));
+
+        __m128i colors[3];
+        colors[RED] = _mm_or_si128(white, _mm_andnot_si128(black, is_red));
+        colors[GREEN] = _mm_or_si128(white, _mm_andnot_si128(black, is_green));
+        colors[BLUE] = _mm_or_si128(white, _mm_andnot_si128(black, is_blue));
+        join_sse41(s, colors, blocks);
+        store_blocks_sse41(px, blocks);
+    }
+    five_color_row(px, width - col);
+}
+
+TARGET_SSE41 void clarendon_row_sse41(uint8_t* px, int width, const FixedPointMap& light, const FixedPointMap& dark,
+                                      double scaling_factor)
+{
+    Shuffles128 s = load_shuffles_sse41();
+    __m128i light_offset = _mm_set1_epi32(light.offset), light_scale = _mm_set1_epi32(light.scale);
+    __m128i dark_offset = _mm_set1_epi32(dark.offset), dark_scale = _mm_set1_epi32(dark.scale);
+    int col = 0;
+    for (; col + 16 <= width; col += 16, px += 48)
+    {
+        __m128i blocks[3], channels[3], low, high;
+        load_blocks_sse41(px, blocks);
+        split_sse41(s, blocks, channels);
+        sums_sse41(channels, low, high);
+        // average >= 170 is sum >= 510, average < 90 is sum < 270
+        __m128i is_light = sum_above_sse41(low, high, 509);
+        __m128i is_dark = sum_below_sse41(low, high, 270);
+        __m128i light_pixels[3] = {is_light, is_light, is_light};
+        __m128i dark_pixels[3] = {is_dark, is_dark, is_dark};
+        __m128i light_bytes[3], dark_bytes[3];
+        join_sse41(s, light_pixels, light_bytes);
+        join_sse41(s, dark_pixels, dark_bytes);
+
+        for (int k = 0; k < 3; k++)
+        {
+            __m128i out = _mm_blendv_epi8(blocks[k], map_sse41(blocks[k], light_offset, light_scale), light_bytes[k]);
+            blocks[k] = _mm_blendv_epi8(out, map_sse41(blocks[k], dark_offset, dark_scale), dark_bytes[k]);
+        }
+        store_blocks_sse41(px, blocks);
+    }
+    clarendon_row(px, width - col, scaling_factor);
+}
+
+// Applies a fixed-point map to a run of channel bytes; leftover bytes use the table
+TARGET_SSE41 void map_bytes_sse41(uint8_t* bytes, int count, const FixedPointMap& map, const uint8_t table[256])
+{
+    __m128i offset = _mm_set1_epi32(map.offset), scale = _mm_set1_epi32(map.scale);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(bytes + i));
+        _mm_storeu_si128((__m128i*)(bytes + i), map_sse41(v, offset, scale));
+    }
+    for (; i < count; i++)
+    {
+        bytes[i] = table[bytes[i]];
+    }
+}
+
+// AVX2 kernels: 32 pixels (96 bytes) per iteration
+// Each 128-bit lane holds its own group of 16 pixels, so the SSE4.1 split and
+// join masks work unchanged in both lanes.
+
+struct Shuffles256
+{
+    __m256i split[3][3];
+    __m256i join[3][3];
+};
+
+TARGET_AVX2 static inline Shuffles256 load_shuffles_avx2()
+{
+    Shuffles256 s;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            s.split[i][j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)split_masks[i][j]));
+            s.join[i][j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)join_masks[i][j]));
+        }
+    }
+    return s;
+}
+
+// Block k holds bytes 16k..16k+15 in the low lane and 48+16k.. in the high lane
+TARGET_AVX2 static inline void load_blocks_avx2(const uint8_t* px, __m256i blocks[3])
+{
+    for (int k = 0; k < 3; k++)
+    {
+        __m128i low = _mm_loadu_si128((const __m128i*)(px + 16 * k));
+        __m128i high = _mm_loadu_si128((const __m128i*)(px + 48 + 16 * k));
+        blocks[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+    }
+}
+
+TARGET_AVX2 static inline void store_blocks_avx2(uint8_t* px, const __m256i blocks[3])
+{
+    for (int k = 0; k < 3; k++)
+    {
+        _mm_storeu_si128((__m128i*)(px + 16 * k), _mm256_castsi256_si128(blocks[k]));
+        _mm_storeu_si128((__m128i*)(px + 48 + 16 * k), _mm256_extracti128_si256(blocks[k], 1));
+    }
+}
+
+TARGET_AVX2 static inline void split_avx2(const Shuffles256& s, const __m256i in[3], __m256i out[3])
+{
+    for (int c = 0; c < 3; c++)
+    {
+        out[c] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(in[0], s.split[c][0]),
+                                                 _mm256_shuffle_epi8(in[1], s.split[c][1])),
+                                 _mm256_shuffle_epi8(in[2], s.split[c][2]));
+    }
+}
+
+TARGET_AVX2 static inline void join_avx2(const Shuffles256& s, const __m256i in[3], __m256i out[3])
+{
+    for (int k = 0; k < 3; k++)
+    {
+        out[k] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(in[BLUE], s.join[k][BLUE]),
+                                                 _mm256_shuffle_epi8(in[GREEN], s.join[k][GREEN])),
+                                 _mm256_shuffle_epi8(in[RED], s.join[k][RED]));
+    }
+}
+
+TARGET_AVX2 static inline void sums_avx2(const __m256i channels[3], __m256i& low, __m256i& high)
+{
+    __m256i zero = _mm256_setzero_si256();
+    low = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(channels[0], zero), _mm256_unpacklo_epi8(channels[1], zero)),
+                           _mm256_unpacklo_epi8(channels[2], zero));
+    high = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(channels[0], zero), _mm256_unpackhi_epi8(channels[1], zero)),
+                            _mm256_unpackhi_epi8(channels[2], zero));
+}
+
+TARGET_AVX2 static inline __m256i sum_above_avx2(__m256i low, __m256i high, int limit)
+{
+    __m256i l = _mm256_set1_epi16(limit);
+    return _mm256_packs_epi16(_mm256_cmpgt_epi16(low, l), _mm256_cmpgt_epi16(high, l));
+}
+
+TARGET_AVX2 static inline __m256i sum_below_avx2(__m256i low, __m256i high, int limit)
+{
+    __m256i l = _mm256_set1_epi16(limit);
+    return _mm256_packs_epi16(_mm256_cmpgt_epi16(l, low), _mm256_cmpgt_epi16(l, high));
+}
+
+// Applies a fixed-point map to 32 channel values, saturating like map_sse41()
+TARGET_AVX2 static inline __m256i map_avx2(__m256i v, __m256i offset, __m256i scale)
+{
+    __m128i halves[2] = {_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)};
+    __m256i y[4];
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i part = (i % 2 == 0) ? halves[i / 2] : _mm_srli_si128(halves[i / 2], 8);
+        __m256i x = _mm256_cvtepu8_epi32(part);
+        y[i] = _mm256_srai_epi32(_mm256_add_epi32(offset, _mm256_mullo_epi32(x, scale)), 16);
+    }
+    // The packs work within lanes, so put the 4-byte groups back in order afterwards
+    __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(y[0], y[1]), _mm256_packs_epi32(y[2], y[3]));
+    return _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+TARGET_AVX2 void grayscale_row_avx2(uint8_t* px, int width)
+{
+    Shuffles256 s = load_shuffles_avx2();
+    __m256i third = _mm256_set1_epi16(21846);
+    int col = 0;
+    for (; col + 32 <= width; col += 32, px += 96)
+    {
+        __m256i blocks[3], channels[3], low, high;
+        load_blocks_avx2(px, blocks);
+        split_avx2(s, blocks, channels);
+        sums_avx2(channels, low, high);
+        __m256i average = _mm256_packus_epi16(_mm256_mulhi_epu16(low, third), _mm256_mulhi_epu16(high, third));
+        __m256i gray[3] = {average, average, average};
+        join_avx2(s, gray, blocks);
+        store_blocks_avx2(px, blocks);
+    }
+    grayscale_row_sse41(px, width - col);
+}
+
+TARGET_AVX2 void high_contrast_row_avx2(uint8_t* px, int width)
+{
+    Shuffles256 s = load_shuffles_avx2();
+    int col = 0;
+    for (; col + 32 <= width; col += 32, px += 96)
+    {
+        __m256i blocks[3], channels[3], low, high;
+        load_blocks_avx2(px, blocks);
+        split_avx2(s, blocks, channels);
+        sums_avx2(channels, low, high);
+        __m256i white = sum_above_avx2(low, high, 380);
+        __m256i bw[3] = {white, white, white};
+        join_avx2(s, bw, blocks);
+        store_blocks_avx2(px, blocks);
+    }
+    high_contrast_row_sse41(px, width - col);
+}
+
+TARGET_AVX2 void five_color_row_avx2(uint8_t* px, int width)
+{
+    Shuffles256 s = load_shuffles_avx2();
+    int col = 0;
+    for (; col + 32 <= width; col += 32, px += 96)
+    {
+        __m256i blocks[3], channels[3], low, high;
+        load_blocks_avx2(px, blocks);
+        split_avx2(s, blocks, channels);
+        sums_avx2(channels, low, high);
+        __m256i white = sum_above_avx2(low, high, 549);
+        __m256i black = sum_below_avx2(low, high, 151);
+
+        __m256i maximum = _mm256_max_epu8(_mm256_max_epu8(channels[RED], channels[GREEN]), channels[BLUE]);
+        __m256i is_red = _mm256_cmpeq_epi8(maximum, channels[RED]);
+        __m256i is_green = _mm256_andnot_si256(is_red, _mm256_cmpeq_epi8(maximum, channels[GREEN]));
+        __m256i is_blue = _mm256_andnot_si256(_mm256_or_si256(is_red, is_green), _mm256_set1_epi8(-1));
+
+        __m256i colors[3];
+        colors[RED] = _mm256_or_si256(white, _mm256_andnot_si256(black, is_red));
+        colors[GREEN] = _mm256_or_si256(white, _mm256_andnot_si256(black, is_green));
+        colors[BLUE] = _mm256_or_si256(white, _mm256_andnot_si256(black, is_blue));
+        join_avx2(s, colors, blocks);
+        store_blocks_avx2(px, blocks);
+    }
+    five_color_row_sse41(px, width - col);
+}
+
+TARGET_AVX2 void clarendon_row_avx2(uint8_t* px, int width, const FixedPointMap& light, const FixedPointMap& dark,
+                                    double scaling_factor)
+{
+    Shuffles256 s = load_shuffles_avx2();
+    __m256i light_offset = _mm256_set1_epi32(light.offset), light_scale = _mm256_set1_epi32(light.scale);
+    __m256i dark_offset = _mm256_set1_epi32(dark.offset), dark_scale = _mm256_set1_epi32(dark.scale);
+    int col = 0;
+    for (; col + 32 <= width; col += 32, px += 96)
+    {
+        __m256i blocks[3], channels[3], low, high;
+        load_blocks_avx2(px, blocks);
+        split_avx2(s, blocks, channels);
+        sums_avx2(channels, low, high);
+        __m256i is_light = sum_above_avx2(low, high, 509);
+        __m256i is_dark = sum_below_avx2(low, high, 270);
+        __m256i light_pixels[3] = {is_light, is_light, is_light};
+        __m256i dark_pixels[3] = {is_dark, is_dark, is_dark};
+        __m256i light_bytes[3], dark_bytes[3];
+        join_avx2(s, light_pixels, light_bytes);
+        join_avx2(s, dark_pixels, dark_bytes);
+
+        for (int k = 0; k < 3; k++)
+        {
+            __m256i out = _mm256_blendv_epi8(blocks[k], map_avx2(blocks[k], light_offset, light_scale), light_bytes[k]);
+            blocks[k] = _mm256_blendv_epi8(out, map_avx2(blocks[k], dark_offset, dark_scale), dark_bytes[k]);
+        }
+        store_blocks_avx2(px, blocks);
+    }
+    clarendon_row_sse41(px, width - col, light, dark, scaling_factor);
+}
+
+TARGET_AVX2 void map_bytes_avx2(uint8_t* bytes, int count, const FixedPointMap& map, const uint8_t table[256])
+{
+    __m256i offset = _mm256_set1_epi32(map.offset), scale = _mm256_set1_epi32(map.scale);
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(bytes + i));
+        _mm256_storeu_si256((__m256i*)(bytes + i), map_avx2(v, offset, scale));
+    }
+    map_bytes_sse41(bytes + i, count - i, map, table);
+}
+#endif
+
+// Point kernel structure
+// A point effect prepared for its scaling factor: its compiled tone table and,
+// when one exists, the fixed-point form of its formula for SIMD
+struct PointKernel
+{
+    PointEffect effect;
+    SimdLevel simd = SIMD_NONE;
+    bool has_lut = false;        // All but five-color
+    ToneLut lut;
+    FixedPointMap map;           // lighten/darken
+    FixedPointMap light_map;     // Clarendon light pixels
+    FixedPointMap dark_map;      // Clarendon dark pixels
+};
+
+/**
+ * Prepares a point effect for run_point_kernel()
+ * @param effect The point effect
+ * @return the kernel
+ */
+PointKernel make_point_kernel(const PointEffect& effect)
+{
+    PointKernel kernel;
+    kernel.effect = effect;
+    kernel.simd = simd_level;
+    kernel.has_lut = make_tone_lut(effect, kernel.lut);
+
+    double s = effect.scaling_factor;
+    int results[256];
+    switch (effect.type)
+    {
+    case LIGHTEN:
+    case DARKEN:
+        for (int v = 0; v < 256; v++)
+        {
+            results[v] = effect.type == LIGHTEN ? lighten_value(v, s) : darken_value(v, s);
+        }
+        kernel.map = fit_fixed_point_map(results, s);
+        if (!kernel.map.exact)
+        {
+            kernel.simd = SIMD_NONE;
+        }
+        break;
+    case CLARENDON:
+        for (int v = 0; v < 256; v++)
+        {
+            results[v] = clarendon_light_value(v, s);
+        }
+        kernel.light_map = fit_fixed_point_map(results, s);
+        for (int v = 0; v < 256; v++)
+        {
+            results[v] = darken_value(v, s);
+        }
+        kernel.dark_map = fit_fixed_point_map(results, s);
+        if (!kernel.light_map.exact || !kernel.dark_map.exact)
+        {
+            kernel.simd = SIMD_NONE;
+        }
+        break;
+    default:
+        break;
+    }
+    return kernel;
+}
+
+/**
+ * Runs a prepared point effect on a single row of pixels, using the best SIMD
+ * kernel available, then the portable fixed-point map (lighten and darken), and
+ * the tone table otherwise
+ * @param kernel The point kernel
+ * @param px     The first pixel of the row
+ * @param width  The number of pixels in the row
+ */
+void run_point_kernel(const PointKernel& kernel, uint8_t* px, int width)
+{
+#ifdef HAVE_X86_SIMD
+    if (kernel.simd == SIMD_AVX2)
+    {
+        switch (kernel.effect.type)
+        {
+        case GRAYSCALE: grayscale_row_avx2(px, width); return;
+        case CLARENDON: clarendon_row_avx2(px, width, kernel.light_map, kernel.dark_map, kernel.effect.scaling_factor); return;
+        case HIGH_CONTRAST: high_contrast_row_avx2(px, width); return;
+        case LIGHTEN:
+        case DARKEN: map_bytes_avx2(px, width * BYTES_PER_PIXEL, kernel.map, kernel.lut.tables[0]); return;
+        case FIVE_COLOR: five_color_row_avx2(px, width); return;
+        }
+    }
+    if (kernel.simd == SIMD_SSE41)
+    {
+        switch (kernel.effect.type)
+        {
+        case GRAYSCALE: grayscale_row_sse41(px, width); return;
+        case CLARENDON: clarendon_row_sse41(px, width, kernel.light_map, kernel.dark_map, kernel.effect.scaling_factor); return;
+        case HIGH_CONTRAST: high_contrast_row_sse41(px, width); return;
+        case LIGHTEN:
+        case DARKEN: map_bytes_sse41(px, width * BYTES_PER_PIXEL, kernel.map, kernel.lut.tables[0]); return;
+        case FIVE_COLOR: five_color_row_sse41(px, width); return;
+        }
+    }
+#endif
+    if ((kernel.effect.type == LIGHTEN || kernel.effect.type == DARKEN) && kernel.map.exact)
+    {
+        map_bytes_fixed(px, width * BYTES_PER_PIXEL, kernel.map, kernel.lut.tables[0]);
+        return;
+    }
+    if (kernel.has_lut)
+    {
+        apply_tone_lut_row(kernel.lut, px, width);
+        return;
+    }
+    apply_point_effect_row(kernel.effect, px, width);
+}
+
+/**
+ * Applies a point effect to the whole image
+ * @param effect The point effect
+ * @param image  The Image
+ */
+void apply_point_effect(const PointEffect& effect, Image& image)
+{
+    TRACE_SCOPE(point_effect_name(effect.type));
+    TRACE_BYTES((long long)image.width * image.height * BYTES_PER_PIXEL);
+    PointKernel kernel = make_point_kernel(effect);
+    parallel_rows(image.height, image.width * BYTES_PER_PIXEL, [&](int first, int last) {
+        for (int row = first; row < last; ++row)
+        {
+            run_point_kernel(kernel, image.row(row), image.width);
+        }
+    });
+}
+
+// Pipeline step structure
+// One step of a chain of effects run by run_pipeline()
+enum PipelineStepType { EFFECT_STEP, VIGNETTE_STEP, ROTATE_STEP, RESIZE_STEP };
+struct PipelineStep
+{
+    PipelineStepType type;
+    PointEffect effect;       // EFFECT_STEP
+    int rotations;            // ROTATE_STEP, 90 degrees each (negative turns counterclockwise)
+    double x_scale;           // RESIZE_STEP
+    double y_scale;           // RESIZE_STEP
+    ResampleFilter filter;    // RESIZE_STEP
+};
+
+// Pipeline remap structure
+// Any chain of rotations and nearest neighbor resizes only moves pixels around,
+// so it composes into a single lookup: output pixel (x, y) comes from source
+//     column by_x[x], row by_y[y]       or, when transposed,
+//     column by_y[y], row by_x[x]
+struct PipelineRemap
+{
+    int width = 0;
+    int height = 0;
+    bool transposed = false;
+    vector<int> by_x;
+    vector<int> by_y;
+    int kernel_turns = -1;   // With x_factor and y_factor, the geometry kernel doing the same (see match_remap_kernel)
+    int x_factor = 1;
+    int y_factor = 1;
+};
+
+/**
+ * Makes the remap that leaves an image as it is
+ * @param width  The image width
+ * @param height The image height
+ * @return the remap
+ */
+PipelineRemap identity_remap(int width, int height)
+{
+    PipelineRemap remap;
+    remap.width = width;
+    remap.height = height;
+    for (int x = 0; x < width; x++)
+    {
+        remap.by_x.push_back(x);
+    }
+    for (int y = 0; y < height; y++)
+    {
+        remap.by_y.push_back(y);
+    }
+    return remap;
+}
+
+/**
+ * Adds a clockwise quarter turn to the end of a remap
+ * Output pixel (x, y) of the turn is (y, height-1-x) before it (see rotate_quarter).
+ * @param remap The remap
+ */
+void turn_remap(PipelineRemap& remap)
+{
+    reverse(remap.by_y.begin(), remap.by_y.end());
+    swap(remap.by_x, remap.by_y);
+    swap(remap.width, remap.height);
+    remap.transposed = !remap.transposed;
+}
+
+/**
+ * Adds a nearest neighbor resize to the end of a remap
+ * @param remap      The remap
+ * @param new_width  The width after the resize
+ * @param new_height The height after the resize
+ */
+void resize_remap(PipelineRemap& remap, int new_width, int new_height)
+{
+    ResampleTable columns = make_resample_table(remap.width, new_width, NEAREST);
+    ResampleTable rows = make_resample_table(remap.height, new_height, NEAREST);
+    vector<int> by_x(new_width), by_y(new_height);
+    for (int x = 0; x < new_width; x++)
+    {
+        by_x[x] = remap.by_x[columns.source[x]];
+    }
+    for (int y = 0; y < new_height; y++)
+    {
+        by_y[y] = remap.by_y[rows.source[y]];
+    }
+    remap.by_x.swap(by_x);
+    remap.by_y.swap(by_y);
+    remap.width = new_width;
+    remap.height = new_height;
+}
+
+/**
+ * Works out whether a remap is just a quarter turn or just a whole-number
+ * enlarge, which the geometry kernels do without looking anything up
+ * (any other remap leaves kernel_turns at -1)
+ * @param remap         The remap
+ * @param source_width  The width of the image it reads
+ * @param source_height The height of the image it reads
+ */
+void match_remap_kernel(PipelineRemap& remap, int source_width, int source_height)
+{
+    remap.kernel_turns = -1;
+    // by_x walks source columns, or source rows when transposed
+    int x_extent = remap.transposed ? source_height : source_width;
+    int y_extent = remap.transposed ? source_width : source_height;
+    if (remap.width % x_extent != 0 || remap.height % y_extent != 0)
+    {
+        return;
+    }
+    int x_factor = remap.width / x_extent;
+    int y_factor = remap.height / y_extent;
+    // 1 when the lookup counts up through the source, -1 when it counts down, 0 otherwise
+    auto direction = [](const vector<int>& lookup, int extent, int factor) {
+        bool up = true, down = true;
+        for (size_t i = 0; i < lookup.size(); i++)
+        {
+            int index = (int)i / factor;
+            up = up && lookup[i] == index;
+            down = down && lookup[i] == extent - 1 - index;
+        }
+        return up ? 1 : (down ? -1 : 0);
+    };
+    int x_direction = direction(remap.by_x, x_extent, x_factor);
+    int y_direction = direction(remap.by_y, y_extent, y_factor);
+    int turns = -1;
+    if (!remap.transposed)
+    {
+        turns = x_direction == 1 && y_direction == 1 ? 0 : (x_direction == -1 && y_direction == -1 ? 2 : -1);
+    }
+    else
+    {
+        turns = x_direction == -1 && y_direction == 1 ? 1 : (x_direction == 1 && y_direction == -1 ? 3 : -1);
+    }
+    // A turn and an enlarge together stay with the remap's single pass
+    if (turns < 0 || (turns != 0 && (x_factor != 1 || y_factor != 1)))
+    {
+        return;
+    }
+    remap.kernel_turns = turns;
+    remap.x_factor = x_factor;
+    remap.y_factor = y_factor;
+}
+
+// Pipeline pass structure
+// Everything run_pipeline() does in one trip through memory: an optional
+// remap or filtered resize, then per-row stages (point kernels and vignettes)
+// applied to each output row while it is still in cache
+struct PipelineStage
+{
+    bool vignette;
+    PointKernel kernel;
+};
+struct PipelinePass
+{
+    bool remapped = false;
+    PipelineRemap remap;
+    bool resampled = false;          // Bilinear or box resize to remap's size
+    ResampleFilter filter = NEAREST;
+    vector<PipelineStage> stages;
+    vector<PointEffect> effects;     // Point effects not yet compiled into stages
+};
+
+/**
+ * Compiles a pass's pending point effects into as few stages as possible
+ * Runs of tone effects become one fused table; a lone effect keeps its own
+ * kernel so it can still use SIMD.
+ * @param pass The pipeline pass
+ */
+void compile_pass_effects(PipelinePass& pass)
+{
+    ToneLut lut = identity_tone_lut();
+    int fused = 0;
+    PointEffect last = {GRAYSCALE, 0};
+    auto flush = [&]() {
+        if (fused == 1)
+        {
+            pass.stages.push_back({false, make_point_kernel(last)});
+        }
+        else if (fused > 1)
+        {
+            PipelineStage stage = {false, PointKernel()};
+            stage.kernel.effect = last;
+            stage.kernel.has_lut = true;
+            stage.kernel.lut = lut;
+            pass.stages.push_back(stage);
+        }
+        lut = identity_tone_lut();
+        fused = 0;
+    };
+
+    for (const PointEffect& effect : pass.effects)
+    {
+        if (fuse_tone_effect(lut, effect))
+        {
+            fused++;
+            last = effect;
+            continue;
+        }
+        flush();
+        if (fuse_tone_effect(lut, effect))
+        {
+            fused = 1;
+            last = effect;
+        }
+        else
+        {
+            pass.stages.push_back({false, make_point_kernel(effect)});
+        }
+    }
+    flush();
+    pass.effects.clear();
+}
+
+/**
+ * Plans the passes for a chain of effects
+ * Point effects only look at the pixel they change, so they commute with
+ * rotations and nearest neighbor resizes: those all compose into the pass's
+ * remap and the point effects run on its output. A vignette depends on the
+ * pixel's position, so geometry after it starts a new pass, and filtered
+ * resizes blend pixels so they always start one.
+ * @param width  The input image width
+ * @param height The input image height
+ * @param steps  The steps
+ * @return the passes, or none if an image along the way would be too big (see image_size_fits)
+ */
+vector<PipelinePass> plan_pipeline(int width, int height, const vector<PipelineStep>& steps)
+{
+    vector<PipelinePass> passes(1);
+    passes.back().remap = identity_remap(width, height);
+    auto new_pass = [&]() {
+        compile_pass_effects(passes.back());
+        PipelineRemap& last = passes.back().remap;
+        int w = last.width, h = last.height;
+        passes.emplace_back();
+        passes.back().remap = identity_remap(w, h);
+    };
+
+    for (const PipelineStep& step : steps)
+    {
+        PipelinePass* pass = &passes.back();
+        switch (step.type)
+        {
+        case EFFECT_STEP:
+            pass->effects.push_back(step.effect);
+            break;
+        case VIGNETTE_STEP:
+            compile_pass_effects(*pass);
+            pass->stages.push_back({true, PointKernel()});
+            break;
+        case ROTATE_STEP:
+        case RESIZE_STEP:
+        {
+            bool has_vignette = false;
+            for (const PipelineStage& stage : pass->stages)
+            {
+                has_vignette = has_vignette || stage.vignette;
+            }
+            if (has_vignette || pass->resampled)
+            {
+                new_pass();
+                pass = &passes.back();
+            }
+            if (step.type == ROTATE_STEP)
+            {
+                for (int turn = 0; turn < quarter_turns(step.rotations); turn++)
+                {
+                    turn_remap(pass->remap);
+                }
+                pass->remapped = pass->remapped || quarter_turns(step.rotations) != 0;
+                break;
+            }
+
+            // The new size is checked before it is narrowed to int
+            double scaled_width = pass->remap.width * step.x_scale;
+            double scaled_height = pass->remap.height * step.y_scale;
+            if (!(scaled_width < INT_MAX) || !(scaled_height < INT_MAX) ||
+                !image_size_fits(max(1L, lround(scaled_width)), max(1L, lround(scaled_height))))
+            {
+                return {};
+            }
+            int new_width = max(1, (int)lround(scaled_width));
+            int new_height = max(1, (int)lround(scaled_height));
+            if (step.filter == NEAREST)
+            {
+                resize_remap(pass->remap, new_width, new_height);
+                pass->remapped = true;
+                break;
+            }
+            // A filtered resize reads the pass's input, so it needs one to itself
+            if (pass->remapped || !pass->stages.empty() || !pass->effects.empty())
+            {
+                new_pass();
+                pass = &passes.back();
+            }
+            pass->resampled = true;
+            pass->filter = step.filter;
+            pass->remap = identity_remap(new_width, new_height);
+            break;
+        }
+        }
+    }
+    compile_pass_effects(passes.back());
+    for (size_t i = 0; i < passes.size(); i++)
+    {
+        if (passes[i].remapped)
+        {
+            match_remap_kernel(passes[i].remap, i ? passes[i - 1].remap.width : width,
+                               i ? passes[i - 1].remap.height : height);
+        }
+    }
+    return passes;
+}
+
+/**
+ * Runs a pass's point stages on a run of pixels
+ * @param pass  The pipeline pass (with no vignette stages)
+ * @param px    The first pixel
+ * @param count The number of pixels
+ */
+void run_pass_point_stages(const PipelinePass& pass, uint8_t* px, int count)
+{
+    for (const PipelineStage& stage : pass.stages)
+    {
+        run_point_kernel(stage.kernel, px, count);
+    }
+}
+
+/**
+ * Runs a pass's per-row stages on one output row
+ * @param pass      The pipeline pass
+ * @param vignettes The vignette table for the output size, if any stage needs it
+ * @param row       The row's number in the pass's output
+ * @param px        The first pixel of the row
+ * @param width     The number of pixels in the row
+ */
+inline void run_row_stages(const PipelinePass& pass, const VignetteTable* vignettes, int row, uint8_t* px, int width)
+{
+    for (const PipelineStage& stage : pass.stages)
+    {
+        if (stage.vignette)
+        {
+            vignette_row(*vignettes, row, px);
+        }
+        else
+        {
+            run_point_kernel(stage.kernel, px, width);
+        }
+    }
+}
+
+/**
+ * Runs a pass's per-row stages on a run of output rows
+ * @param pass      The pipeline pass
+ * @param image     The pass's output image
+ * @param vignettes The vignette table for the output size, if any stage needs it
+ * @param first     The first row
+ * @param last      One past the last row
+ */
+void run_pass_stages(const PipelinePass& pass, Image& image, const VignetteTable* vignettes, int first, int last)
+{
+    for (int row = first; row < last; ++row)
+    {
+        run_row_stages(pass, vignettes, row, image.row(row), image.width);
+    }
+}
+
+/**
+ * Runs one pipeline pass
+ * A pass that only rotates or only enlarges goes to the geometry kernel for it.
+ * Without a vignette nothing depends on where a pixel ends up, so point stages
+ * run on source pixels before an enlarge copies them, and output rows that
+ * repeat the one above are copied whole.
+ * @param pass  The pipeline pass
+ * @param image The pass's input, replaced by its output
+ */
+void run_pipeline_pass(const PipelinePass& pass, Image& image)
+{
+    TRACE_SCOPE("pipeline_pass");
+    const PipelineRemap& remap = pass.remap;
+    TRACE_BYTES((long long)remap.width * remap.height * BYTES_PER_PIXEL);
+    shared_ptr<VignetteTable> vignettes;
+    for (const PipelineStage& stage : pass.stages)
+    {
+        if (stage.vignette)
+        {
+            vignettes = vignette_table(remap.width, remap.height);
+        }
+    }
+    int row_bytes = remap.width * BYTES_PER_PIXEL;
+
+    if (pass.resampled)
+    {
+        image = resize_image(image, remap.width, remap.height, pass.filter);
+    }
+    if (!pass.remapped)
+    {
+        // Nothing moves, so the stages run in place
+        parallel_rows(image.height, row_bytes, [&](int first, int last) {
+            run_pass_stages(pass, image, vignettes.get(), first, last);
+        });
+        return;
+    }
+
+    Image output = make_image(remap.width, remap.height);
+    if (pass.stages.empty() && remap.kernel_turns >= 0)
+    {
+        // Just a rotation or just an enlarge: the kernel for it needs no lookups
+        if (remap.x_factor == 1 && remap.y_factor == 1)
+        {
+            rotate_pixels(image_view(image), image_view(output), remap.kernel_turns);
+        }
+        else
+        {
+            enlarge_pixels(image_view(image), image_view(output), remap.x_factor, remap.y_factor);
+        }
+        image = move(output);
+        return;
+    }
+    bool anywhere = !vignettes;
+    // Locals, since the compiler can't assume pixel writes leave the tables alone
+    const int width = remap.width;
+    const int* by_x = remap.by_x.data();
+    const int* by_y = remap.by_y.data();
+    if (!remap.transposed)
+    {
+        // Each output row gathers from one source row
+        bool before = anywhere && !pass.stages.empty() && image.width < width;
+        parallel_rows(remap.height, row_bytes, [&](int first, int last) {
+            vector<uint8_t> source_row(before ? image.width * BYTES_PER_PIXEL : 0);
+            for (int row = first; row < last; ++row)
+            {
+                uint8_t* dst = output.row(row);
+                if (anywhere && row > first && by_y[row] == by_y[row - 1])
+                {
+                    memcpy(dst, output.row(row - 1), row_bytes);
+                    continue;
+                }
+                const uint8_t* src = image.row(by_y[row]);
+                if (before)
+                {
+                    memcpy(source_row.data(), src, source_row.size());
+                    run_pass_point_stages(pass, source_row.data(), image.width);
+                    src = source_row.data();
+                }
+                for (int col = 0; col < width; ++col, dst += BYTES_PER_PIXEL)
+                {
+                    const uint8_t* px = src + by_x[col] * BYTES_PER_PIXEL;
+                    dst[BLUE] = px[BLUE];
+                    dst[GREEN] = px[GREEN];
+                    dst[RED] = px[RED];
+                }
+                if (!before)
+                {
+                    run_pass_stages(pass, output, vignettes.get(), row, row + 1);
+                }
+            }
+        });
+    }
+    else
+    {
+        // Each output column gathers from one source row, so output is made in
+        // square tiles (like rotate_quarter): each column of a tile is gathered
+        // into a strip, the strips are written out a row at a time. A column
+        // from the same source row as the one to its left reuses its strip, and
+        // output rows that repeat the one above are copied whole.
+        int bands = (remap.height + ROTATE_TILE - 1) / ROTATE_TILE;
+        thread_pool().parallel_for(bands, [&](int band) {
+            int first = band * ROTATE_TILE;
+            int last = min(remap.height, first + ROTATE_TILE);
+            int rows = last - first;
+            uint8_t strips[ROTATE_TILE][ROTATE_TILE * BYTES_PER_PIXEL];
+            for (int tile_x = 0; tile_x < width; tile_x += ROTATE_TILE)
+            {
+                int end_x = min(width, tile_x + ROTATE_TILE);
+                for (int col = tile_x; col < end_x; ++col)
+                {
+                    uint8_t* strip = strips[col - tile_x];
+                    if (col > tile_x && by_x[col] == by_x[col - 1])
+                    {
+                        memcpy(strip, strips[col - tile_x - 1], rows * BYTES_PER_PIXEL);
+                        continue;
+                    }
+                    const uint8_t* src = image.row(by_x[col]);
+                    for (int i = 0; i < rows; ++i)
+                    {
+                        const uint8_t* px = src + by_y[first + i] * BYTES_PER_PIXEL;
+                        strip[i * BYTES_PER_PIXEL + BLUE] = px[BLUE];
+                        strip[i * BYTES_PER_PIXEL + GREEN] = px[GREEN];
+                        strip[i * BYTES_PER_PIXEL + RED] = px[RED];
+                    }
+                    if (anywhere)
+                    {
+                        run_pass_point_stages(pass, strip, rows);
+                    }
+                }
+                for (int row = first; row < last; ++row)
+                {
+                    if (anywhere && row > first && by_y[row] == by_y[row - 1])
+                    {
+                        continue;
+                    }
+                    uint8_t* dst = output.row(row) + tile_x * BYTES_PER_PIXEL;
+                    const uint8_t* px = strips[0] + (row - first) * BYTES_PER_PIXEL;
+                    for (int col = tile_x; col < end_x; ++col, dst += BYTES_PER_PIXEL, px += sizeof(strips[0]))
+                    {
+                        dst[BLUE] = px[BLUE];
+                        dst[GREEN] = px[GREEN];
+                        dst[RED] = px[RED];
+                    }
+                }
+            }
+            if (anywhere)
+            {
+                for (int row = first + 1; row < last; ++row)
+                {
+                    if (by_y[row] == by_y[row - 1])
+                    {
+                        memcpy(output.row(row), output.row(row - 1), row_bytes);
+                    }
+                }
+            }
+            else
+            {
+                run_pass_stages(pass, output, vignettes.get(), first, last);
+            }
+        });
+    }
+    image = move(output);
+}
+
+/**
+ * Runs a chain of effects on an image
+ * Consecutive point effects collapse into one per-pixel pass and rotations and
+ * nearest neighbor resizes into one remap (see plan_pipeline), so a chain is
+ * usually one trip through memory rather than one per step.
+ * @param image The Image, replaced by the result (or emptied if it would be too big)
+ * @param steps The steps, in order
+ * @return True if successful and false otherwise
+ */
+bool run_pipeline(Image& image, const vector<PipelineStep>& steps)
+{
+    TRACE_SCOPE("pipeline");
+    if (image.empty())
+    {
+        return false;
+    }
+    vector<PipelinePass> passes = plan_pipeline(image.width, image.height, steps);
+    if (passes.empty())
+    {
+        image = Image();
+        return false;
+    }
+    for (const PipelinePass& pass : passes)
+    {
+        run_pipeline_pass(pass, image);
+    }
+    return true;
+}
+
+/**
+ * Gets the plan for a chain of effects on an image size, planning it on first use
+ * The last few plans are kept (like vignette_table), so a long-running service
+ * applying the same chain to same-sized photos builds its tone tables and
+ * remaps once.
+ * @param chain  The chain's text, which names it in the cache
+ * @param width  The image width
+ * @param height The image height
+ * @param steps  The chain, parsed from the text
+ * @return the passes for run_pipeline_pass(), or none if the result would be too big
+ */
+shared_ptr<const vector<PipelinePass>> pipeline_plan(const string& chain, int width, int height,
+                                                     const vector<PipelineStep>& steps)
+{
+    struct Plan
+    {
+        string chain;
+        int width;
+        int height;
+        shared_ptr<const vector<PipelinePass>> passes;
+    };
+    static mutex cache_lock;
+    static vector<Plan> cache;  // Most recently used last
+    const size_t cache_size = 16;
+
+    {
+        lock_guard<mutex> guard(cache_lock);
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            if (cache[i].width == width && cache[i].height == height && cache[i].chain == chain)
+            {
+                Plan plan = cache[i];
+                cache.erase(cache.begin() + i);
+                cache.push_back(plan);
+                return plan.passes;
+            }
+        }
+    }
+    shared_ptr<const vector<PipelinePass>> passes =
+        make_shared<const vector<PipelinePass>>(plan_pipeline(width, height, steps));
+    lock_guard<mutex> guard(cache_lock);
+    if (cache.size() == cache_size)
+    {
+        cache.erase(cache.begin());
+    }
+    cache.push_back({chain, width, height, passes});
+    return passes;
+}
+
+/**
+ * Parses a chain of effects
+ * Steps are separated by commas, with their numbers after colons:
+ *     vignette, clarendon:F, grayscale, rotate:N, enlarge:X:Y, high_contrast,
+ *     lighten:F, darken:F, five_color, resize:X:Y[:nearest|bilinear|box]
+ * e.g. "grayscale,lighten:0.5,rotate:1,vignette"
+ * @param text  The chain
+ * @param steps The parsed steps
+ * @return True if successful and false if a step is not understood
+ */
+bool parse_pipeline(const string& text, vector<PipelineStep>& steps)
+{
+    steps.clear();
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == string::npos)
+        {
+            end = text.size();
+        }
+
+        // Split the step into its name and numbers
+        vector<string> parts;
+        string item = text.substr(start, end - start);
+        size_t part_start = 0;
+        while (true)
+        {
+            size_t colon = item.find(':', part_start);
+            parts.push_back(item.substr(part_start, colon == string::npos ? string::npos : colon - part_start));
+            if (colon == string::npos)
+            {
+                break;
+            }
+            part_start = colon + 1;
+        }
+        vector<double> numbers;
+        string filter_name;
+        for (size_t i = 1; i < parts.size(); i++)
+        {
+            char* number_end = nullptr;
+            double number = strtod(parts[i].c_str(), &number_end);
+            if (parts[i].empty() || *number_end != '\0')
+            {
+                if (i != 3)
+                {
+                    return false;
+                }
+                filter_name = parts[i];
+            }
+            numbers.push_back(number);
+        }
+
+        const string& name = parts[0];
+        PipelineStep step = {EFFECT_STEP, {GRAYSCALE, 0}, 0, 1, 1, NEAREST};
+        size_t wanted = 0;
+        if (name == "vignette") { step.type = VIGNETTE_STEP; }
+        else if (name == "clarendon") { step.effect = {CLARENDON, 0}; wanted = 1; }
+        else if (name == "grayscale") { step.effect = {GRAYSCALE, 0}; }
+        else if (name == "high_contrast") { step.effect = {HIGH_CONTRAST, 0}; }
+        else if (name == "lighten") { step.effect = {LIGHTEN, 0}; wanted = 1; }
+        else if (name == "darken") { step.effect = {DARKEN, 0}; wanted = 1; }
+        else if (name == "five_color") { step.effect = {FIVE_COLOR, 0}; }
+        else if (name == "rotate") { step.type = ROTATE_STEP; wanted = 1; }
+        else if (name == "enlarge" || name == "resize") { step.type = RESIZE_STEP; wanted = 2; }
+        else
+        {
+            return false;
+        }
+
+        if (name == "resize" && numbers.size() == 3)
+        {
+            if (filter_name == "nearest") step.filter = NEAREST;
+            else if (filter_name == "bilinear") step.filter = BILINEAR;
+            else if (filter_name == "box") step.filter = BOX;
+            else return false;
+        }
+        else if (numbers.size() != wanted || !filter_name.empty())
+        {
+            return false;
+        }
+
+        if (step.type == EFFECT_STEP && wanted == 1)
+        {
+            step.effect.scaling_factor = numbers[0];
+        }
+        else if (step.type == ROTATE_STEP)
+        {
+            // A whole number of quarter turns; only the remainder of four matters
+            if (numbers[0] != floor(numbers[0]) || fabs(numbers[0]) > INT_MAX)
+            {
+                return false;
+            }
+            step.rotations = ((int)numbers[0] % 4 + 4) % 4;
+        }
+        else if (step.type == RESIZE_STEP)
+        {
+            step.x_scale = numbers[0];
+            step.y_scale = numbers[1];
+            // Enlarge is process 6: whole number scales. Scales that would make even a
+            // 1x1 image too big are rejected here; the rest once the size is known (plan_pipeline)
+            if (!(step.x_scale > 0) || !(step.y_scale > 0) || !(step.x_scale < INT_MAX) ||
+                !(step.y_scale < INT_MAX) ||
+                !image_size_fits(max(1L, lround(step.x_scale)), max(1L, lround(step.y_scale))) ||
+                (name == "enlarge" && (step.x_scale != floor(step.x_scale) || step.y_scale != floor(step.y_scale))))
+            {
+                return false;
+            }
+        }
+        steps.push_back(step);
+        start = end + 1;
+    }
+    return !steps.empty();
+}
+
+/**
+ * Works out the colors a chain of effects can leave in an image, so it can be
+ * saved as an indexed BMP
+ * Grayscale, high contrast and five-color pin the colors down whatever the
+ * input. Point effects map a known palette color by color. Rotations and
+ * nearest neighbor resizes only move pixels. The vignette and filtered
+ * resizes mix colors, which only keeps them known when they are all gray
+ * (any gray can come out then).
+ * @param steps The steps, in order
+ * @return the palette, or an empty one if the colors are not known
+ */
+Palette chain_palette(const vector<PipelineStep>& steps)
+{
+    Palette palette;
+    for (const PipelineStep& step : steps)
+    {
+        switch (step.type)
+        {
+        case EFFECT_STEP:
+            if (!palette.empty())
+            {
+                // Run the colors through the effect as a row of pixels
+                vector<uint8_t> pixels(palette.size() * BYTES_PER_PIXEL);
+                for (size_t i = 0; i < palette.size(); i++)
+                {
+                    set_bytes(&pixels[i * BYTES_PER_PIXEL], 0, BYTES_PER_PIXEL, palette[i]);
+                }
+                apply_point_effect_row(step.effect, pixels.data(), (int)palette.size());
+                for (size_t i = 0; i < palette.size(); i++)
+                {
+                    palette[i] = pack_color(&pixels[i * BYTES_PER_PIXEL]);
+                }
+                sort(palette.begin(), palette.end());
+                palette.erase(unique(palette.begin(), palette.end()), palette.end());
+            }
+            else if (step.effect.type == GRAYSCALE)
+            {
+                palette = gray_palette();
+            }
+            else if (step.effect.type == HIGH_CONTRAST)
+            {
+                palette = {0x000000, 0xFFFFFF};
+            }
+            else if (step.effect.type == FIVE_COLOR)
+            {
+                // Black, blue, green, red, white
+                palette = {0x000000, 0x0000FF, 0x00FF00, 0xFF0000, 0xFFFFFF};
+            }
+            break;
+        case VIGNETTE_STEP:
+            palette = is_gray_palette(palette) ? gray_palette() : Palette();
+            break;
+        case ROTATE_STEP:
+            break;
+        case RESIZE_STEP:
+            if (step.filter != NEAREST)
+            {
+                palette = is_gray_palette(palette) ? gray_palette() : Palette();
+            }
+            break;
+        }
+    }
+    return palette;
+}
+
+// Tiled image class
+// A BMP file served a tile at a time through a cache of bounded size, so
+// images larger than memory can be worked on. The image is cut into
+// tile_width x tile_height tiles (smaller along the right and bottom edges);
+// the cache keeps the most recently used last and, once it is full, drops the
+// oldest, writing it back first if it was changed. A tile as wide as the image
+// is one run of the file, read or written with a preadv()/pwritev() per
+// IOV_MAX rows, so going through an image band by band is sequential I/O.
+// open() reads 24-bit and 32-bit files stored either way up; create() makes a
+// 24-bit bottom to top file that starts out black.
+enum TileAccess { TILE_READ, TILE_WRITE };  // TILE_WRITE: the caller fills in the whole tile
+class TiledImage
+{
+public:
+    int width = 0;
+    int height = 0;
+    int tile_width = 0;
+    int tile_height = 0;
+
+    TiledImage() = default;
+    TiledImage(const TiledImage&) = delete;
+    TiledImage& operator=(const TiledImage&) = delete;
+    ~TiledImage()
+    {
+        close();
+    }
+
+    /**
+     * Opens a BMP file to read tiles from
+     * @param filename    BMP image filename
+     * @param tile_width  The tile width (at most the image width)
+     * @param tile_height The tile height (at most the image height)
+     * @param budget      The bytes of tiles the cache may hold (at least one tile is)
+     * @return True if successful and false if the file is not a supported BMP
+     */
+    bool open(const string& filename, int tile_width, int tile_height, size_t budget)
+    {
+        close();
+        unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+        iovec buffer = {header, sizeof(header)};
+        fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0 || !transfer_buffers_at(fd, &buffer, 1, 0, false) || !parse_bmp_header(header, info))
+        {
+            close();
+            return false;
+        }
+        writable = false;
+        set_tiles(tile_width, tile_height, budget);
+#ifdef __linux__
+        if (this->tile_width == width)
+        {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+#endif
+        return true;
+    }
+
+    /**
+     * Creates a BMP file to write tiles to, replacing whatever was there
+     * @param filename    BMP image filename
+     * @param width       The image width
+     * @param height      The image height
+     * @param tile_width  The tile width (at most the image width)
+     * @param tile_height The tile height (at most the image height)
+     * @param budget      The bytes of tiles the cache may hold (at least one tile is)
+     * @return True if successful and false otherwise
+     */
+    bool create(const string& filename, int width, int height, int tile_width, int tile_height, size_t budget)
+    {
+        close();
+        unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE] = {0};
+        if (set_bmp_headers(header, width, height) < 0)
+        {
+            return false;
+        }
+        iovec buffer = {header, sizeof(header)};
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || !parse_bmp_header(header, info) || !transfer_buffers_at(fd, &buffer, 1, 0, true))
+        {
+            close();
+            return false;
+        }
+        // Reserve the space up front (see write_image); tiles never written read back as zeros
+        off_t file_size = info.start + (off_t)info.file_stride * info.height;
+        if (!reserve_file(fd, file_size))
+        {
+            close();
+            return false;
+        }
+        writable = true;
+        set_tiles(tile_width, tile_height, budget);
+        return true;
+    }
+
+    /**
+     * Gets a tile, reading it from the file if it is not in the cache
+     * The pointer is good until the next call.
+     * @param tile_x The tile column
+     * @param tile_y The tile row
+     * @param access TILE_WRITE if the tile will be filled in (only for created files)
+     * @return the tile, or null if it could not be read or a write back failed
+     */
+    Image* tile(int tile_x, int tile_y, TileAccess access)
+    {
+        if (fd < 0 || failed || (access == TILE_WRITE && !writable))
+        {
+            return nullptr;
+        }
+        for (size_t i = tiles.size(); i-- > 0;)
+        {
+            if (tiles[i].x == tile_x && tiles[i].y == tile_y)
+            {
+                if (i + 1 != tiles.size())
+                {
+                    Tile found = move(tiles[i]);
+                    tiles.erase(tiles.begin() + i);
+                    tiles.push_back(move(found));
+                }
+                tiles.back().dirty = tiles.back().dirty || access == TILE_WRITE;
+                return &tiles.back().pixels;
+            }
+        }
+
+        if (tiles.size() >= capacity)
+        {
+            if (tiles.front().dirty && !transfer(tiles.front(), true))
+            {
+                failed = true;
+                return nullptr;
+            }
+            tiles.erase(tiles.begin());
+        }
+        Tile fresh;
+        fresh.x = tile_x;
+        fresh.y = tile_y;
+        fresh.dirty = access == TILE_WRITE;
+        fresh.pixels = make_image(min(tile_width, width - tile_x * tile_width),
+                                  min(tile_height, height - tile_y * tile_height));
+        if (access == TILE_READ && !transfer(fresh, false))
+        {
+            failed = true;
+            return nullptr;
+        }
+        tiles.push_back(move(fresh));
+        return &tiles.back().pixels;
+    }
+
+    /**
+     * Writes back the changed tiles and closes the file
+     * @return True if every tile made it to the file and false otherwise
+     */
+    bool close()
+    {
+        if (fd < 0)
+        {
+            return true;
+        }
+        // Only the changed tiles go back, in the order they sit in the file
+        tiles.erase(remove_if(tiles.begin(), tiles.end(), [](const Tile& tile) { return !tile.dirty; }),
+                    tiles.end());
+        sort(tiles.begin(), tiles.end(), [&](const Tile& a, const Tile& b) {
+            return a.y != b.y ? info.top_down == (a.y < b.y) : a.x < b.x;
+        });
+        for (Tile& tile : tiles)
+        {
+            failed = failed || !transfer(tile, true);
+        }
+        tiles.clear();
+        bool ok = ::close(fd) == 0 && !failed;
+        fd = -1;
+        failed = false;
+        return ok;
+    }
+
+private:
+    struct Tile
+    {
+        int x;
+        int y;
+        Image pixels;
+        bool dirty;
+    };
+
+    int fd = -1;
+    BmpInfo info;
+    bool writable = false;
+    bool failed = false;      // A tile could not be read or written back
+    size_t capacity = 1;      // Tiles the cache may hold
+    vector<Tile> tiles;       // Most recently used last
+
+    // Sets the tile size and how many tiles fit in the budget
+    void set_tiles(int new_tile_width, int new_tile_height, size_t budget)
+    {
+        width = info.width;
+        height = info.height;
+        tile_width = max(1, min(new_tile_width, width));
+        tile_height = max(1, min(new_tile_height, height));
+        capacity = max<size_t>(1, budget / ((size_t)padded_stride(tile_width) * tile_height));
+    }
+
+    /**
+     * Reads or writes one tile
+     * @param tile    The tile
+     * @param writing True to write the tile and false to read it
+     * @return True if successful and false otherwise
+     */
+    bool transfer(Tile& tile, bool writing)
+    {
+        TRACE_SCOPE(writing ? "tile_write" : "tile_read");
+        Image& pixels = tile.pixels;
+        int pixel_bytes = info.bits_per_pixel / 8;
+        size_t row_bytes = (size_t)pixels.width * BYTES_PER_PIXEL;
+        TRACE_BYTES((long long)row_bytes * pixels.height);
+        // File position of a row of the tile
+        auto offset = [&](int row) {
+            long long file_row = tile.y * tile_height + row;
+            if (!info.top_down)
+            {
+                file_row = height - 1 - file_row;
+            }
+            return (off_t)(info.start + file_row * info.file_stride + (long long)tile.x * tile_width * pixel_bytes);
+        };
+
+        if (pixel_bytes == BYTES_PER_PIXEL && pixels.width == width)
+        {
+            // Whole rows are one run of the file, rows and padding alternating
+            static const unsigned char zeros[3] = {0};
+            unsigned char skipped[3];
+            size_t padding = info.file_stride - row_bytes;
+            int first = info.top_down ? 0 : pixels.height - 1;
+            int step = info.top_down ? 1 : -1;
+            // The batch lives on the stack so a transfer does not allocate
+            iovec buffers[IOV_MAX];
+            int count = 0;
+            off_t start = offset(first);
+            int batch_rows = 0;
+            for (int i = 0, row = first; i < pixels.height; i++, row += step)
+            {
+                buffers[count++] = {pixels.row(row), row_bytes};
+                if (padding)
+                {
+                    buffers[count++] = {writing ? (void*)zeros : (void*)skipped, padding};
+                }
+                batch_rows++;
+                if (i == pixels.height - 1 || count + 2 > IOV_MAX)
+                {
+                    if (!transfer_buffers_at(fd, buffers, count, start, writing))
+                    {
+                        return false;
+                    }
+                    start += (off_t)batch_rows * info.file_stride;
+                    count = 0;
+                    batch_rows = 0;
+                }
+            }
+            return true;
+        }
+
+        // Part of each row, or pixels with alpha to drop: one transfer per row
+        vector<uint8_t> wide_pixels(pixel_bytes == BYTES_PER_PIXEL ? 0 : (size_t)pixels.width * pixel_bytes);
+        for (int row = 0; row < pixels.height; row++)
+        {
+            uint8_t* px = pixels.row(row);
+            iovec buffer = {px, row_bytes};
+            if (!wide_pixels.empty())
+            {
+                buffer = {wide_pixels.data(), wide_pixels.size()};
+            }
+            if (!transfer_buffers_at(fd, &buffer, 1, offset(row), writing))
+            {
+                return false;
+            }
+            for (size_t j = 0; j < wide_pixels.size(); j += pixel_bytes, px += BYTES_PER_PIXEL)
+            {
+                px[BLUE] = wide_pixels[j];
+                px[GREEN] = wide_pixels[j + 1];
+                px[RED] = wide_pixels[j + 2];
+            }
+        }
+        return true;
+    }
+};
+
+// Streaming settings, from --stream-mb
+struct StreamOptions
+{
+    size_t budget = (size_t)256 << 20;  // Bytes of pixels held in memory at once
+    int tile_size = 512;                 // Side of the square tiles quarter turns read
+};
+StreamOptions stream_options;
+
+/**
+ * Fills in a band of a pass's output rows from full-width input bands, for
+ * passes whose output rows each come from one source row
+ * @param pass    The pipeline pass (no filtered resize, rows and columns not swapped)
+ * @param input   The pass's input, in full-width tiles
+ * @param band    The output band
+ * @param first   The band's first row in the pass's output
+ * @param offsets The source byte offset of every output pixel
+ * @return True if successful and false if the input could not be read
+ */
+bool stream_rows(const PipelinePass& pass, TiledImage& input, Image& band, int first, const vector<int>& offsets)
+{
+    const int* by_y = pass.remap.by_y.data();
+    int row_bytes = band.width * BYTES_PER_PIXEL;
+    int row = 0;
+    while (row < band.height)
+    {
+        // The run of rows whose source rows are in the same input tile
+        int tile_y = by_y[first + row] / input.tile_height;
+        int end = row + 1;
+        while (end < band.height && by_y[first + end] / input.tile_height == tile_y)
+        {
+            end++;
+        }
+        const Image* source = input.tile(0, tile_y, TILE_READ);
+        if (!source)
+        {
+            return false;
+        }
+        int base = tile_y * input.tile_height;
+        parallel_rows(end - row, row_bytes, [&](int run_first, int run_last) {
+            for (int i = row + run_first; i < row + run_last; ++i)
+            {
+                const uint8_t* src = source->row(by_y[first + i] - base);
+                if (pass.remapped)
+                {
+                    nearest_row(src, band.row(i), offsets);
+                }
+                else
+                {
+                    memcpy(band.row(i), src, row_bytes);
+                }
+            }
+        });
+        row = end;
+    }
+    return true;
+}
+
+/**
+ * Fills in a band of a pass's output rows from square input tiles, for passes
+ * whose output rows each come from one source column (quarter turns)
+ * Bands go through the source a column of tiles at a time, each tile once.
+ * @param pass  The pipeline pass (rows and columns swapped)
+ * @param input The pass's input, in square tiles
+ * @param spans The output columns that come from each row of tiles
+ * @param band  The output band
+ * @param first The band's first row in the pass's output
+ * @return True if successful and false if the input could not be read
+ */
+bool stream_columns(const PipelinePass& pass, TiledImage& input, const vector<pair<int, int>>& spans,
+                    Image& band, int first)
+{
+    const int* by_x = pass.remap.by_x.data();
+    const int* by_y = pass.remap.by_y.data();
+    const int side = input.tile_width;
+    int row = 0;
+    while (row < band.height)
+    {
+        // The run of rows whose source columns are in the same column of tiles
+        int tile_x = by_y[first + row] / side;
+        int end = row + 1;
+        while (end < band.height && by_y[first + end] / side == tile_x)
+        {
+            end++;
+        }
+        for (int tile_y = 0; tile_y < (int)spans.size(); tile_y++)
+        {
+            int first_col = spans[tile_y].first, last_col = spans[tile_y].second;
+            if (first_col >= last_col)
+            {
+                continue;
+            }
+            const Image* source = input.tile(tile_x, tile_y, TILE_READ);
+            if (!source)
+            {
+                return false;
+            }
+            int column_base = tile_x * side, row_base = tile_y * side;
+            parallel_rows(end - row, (last_col - first_col) * BYTES_PER_PIXEL, [&](int run_first, int run_last) {
+                for (int i = row + run_first; i < row + run_last; ++i)
+                {
+                    int offset = (by_y[first + i] - column_base) * BYTES_PER_PIXEL;
+                    uint8_t* dst = band.row(i) + first_col * BYTES_PER_PIXEL;
+                    for (int col = first_col; col < last_col; ++col, dst += BYTES_PER_PIXEL)
+                    {
+                        const uint8_t* px = source->row(by_x[col] - row_base) + offset;
+                        dst[BLUE] = px[BLUE];
+                        dst[GREEN] = px[GREEN];
+                        dst[RED] = px[RED];
+                    }
+                }
+            });
+        }
+        row = end;
+    }
+    return true;
+}
+
+/**
+ * Fills in a band of a filtered resize's output rows
+ * Output rows are made a few at a time: the source rows they blend are
+ * resampled to the new width into a window, then blended as in resize_image().
+ * @param columns The resample table for the rows
+ * @param rows    The resample table for the columns
+ * @param input   The pass's input, in full-width tiles
+ * @param band    The output band
+ * @param first   The band's first row in the pass's output
+ * @param budget  The bytes the window of resampled rows may take (at least one output row's worth)
+ * @return True if successful and false if the input could not be read
+ */
+bool stream_resampled(const ResampleTable& columns, const ResampleTable& rows, TiledImage& input,
+                      Image& band, int first, size_t budget)
+{
+    int row_bytes = band.width * BYTES_PER_PIXEL;
+    size_t window_row_bytes = padded_stride(band.width);
+    int row = 0;
+    while (row < band.height)
+    {
+        // As many output rows as have their source rows fit in the window
+        int low = INT_MAX, high = -1;
+        int end = row;
+        while (end < band.height)
+        {
+            int start = rows.first[first + end], stop = start + rows.count[first + end];
+            int new_low = min(low, *min_element(&rows.source[start], &rows.source[stop - 1] + 1));
+            int new_high = max(high, *max_element(&rows.source[start], &rows.source[stop - 1] + 1));
+            if (end > row && (size_t)(new_high - new_low + 1) * window_row_bytes > budget)
+            {
+                break;
+            }
+            low = new_low;
+            high = new_high;
+            end++;
+        }
+
+        // Resample the source rows, an input tile at a time
+        Image window = make_image(band.width, high - low + 1);
+        for (int source_row = low; source_row <= high;)
+        {
+            int tile_y = source_row / input.tile_height;
+            int base = tile_y * input.tile_height;
+            int stop = min(high + 1, base + input.tile_height);
+            const Image* source = input.tile(0, tile_y, TILE_READ);
+            if (!source)
+            {
+                return false;
+            }
+            parallel_rows(stop - source_row, row_bytes, [&](int run_first, int run_last) {
+                for (int s = source_row + run_first; s < source_row + run_last; ++s)
+                {
+                    resample_row(source->row(s - base), window.row(s - low), columns);
+                }
+            });
+            source_row = stop;
+        }
+
+        parallel_rows(end - row, row_bytes, [&](int run_first, int run_last) {
+            vector<int> sums(row_bytes);
+            for (int i = row + run_first; i < row + run_last; ++i)
+            {
+                blend_rows(rows, first + i, [&](int source) { return (const uint8_t*)window.row(source - low); },
+                           row_bytes, sums.data(), band.row(i));
+            }
+        });
+        row = end;
+    }
+    return true;
+}
+
+/**
+ * Runs one pipeline pass from file to file, a band of output rows at a time
+ * Half the budget goes to input tiles, a quarter to the output band and a
+ * quarter to a filtered resize's window of resampled rows.
+ * @param pass       The pipeline pass
+ * @param filename   The pass's input BMP file
+ * @param outputname The BMP file name to save the pass's output to
+ * @param options    The memory budget and tile size
+ * @return True if successful and false otherwise
+ */
+bool stream_pass(const PipelinePass& pass, const string& filename, const string& outputname,
+                 const StreamOptions& options)
+{
+    TRACE_SCOPE("stream_pass");
+    const PipelineRemap& remap = pass.remap;
+    const int width = remap.width;
+    const int height = remap.height;
+    const int row_bytes = width * BYTES_PER_PIXEL;
+    TRACE_BYTES((long long)row_bytes * height);
+    size_t input_budget = options.budget / 2;
+    size_t band_budget = options.budget / 4;
+
+    BmpInfo info;
+    if (!read_bmp_info(filename, info))
+    {
+        return false;
+    }
+    TiledImage input;
+    bool by_columns = pass.remapped && remap.transposed;
+    bool opened;
+    if (by_columns)
+    {
+        // Small enough that a whole column of tiles fits, unless that makes them tiny
+        size_t column_bytes = (size_t)info.height * BYTES_PER_PIXEL;
+        int side = (int)min<size_t>(options.tile_size, max<size_t>(input_budget / column_bytes, 16));
+        opened = input.open(filename, side, side, input_budget);
+    }
+    else
+    {
+        // Two bands fit, so a band is still there for rows that straddle the next one
+        int band_height = (int)max<size_t>(1, input_budget / 2 / padded_stride(info.width));
+        opened = input.open(filename, info.width, band_height, input_budget);
+    }
+    int band_rows = (int)max<size_t>(1, min<size_t>(height, band_budget / padded_stride(width)));
+    TiledImage output;
+    if (!opened || !output.create(outputname, width, height, width, band_rows, band_budget))
+    {
+        return false;
+    }
+
+    // What the bands share
+    vector<int> offsets;
+    vector<pair<int, int>> spans;
+    ResampleTable columns, rows;
+    if (pass.resampled)
+    {
+        columns = make_resample_table(input.width, width, pass.filter);
+        rows = make_resample_table(input.height, height, pass.filter);
+    }
+    else if (by_columns)
+    {
+        // Output columns that come from each row of tiles, a run since turns and resizes keep order
+        spans.assign((input.height + input.tile_height - 1) / input.tile_height, {INT_MAX, 0});
+        for (int col = 0; col < width; col++)
+        {
+            pair<int, int>& span = spans[remap.by_x[col] / input.tile_height];
+            span.first = min(span.first, col);
+            span.second = max(span.second, col + 1);
+        }
+    }
+    else if (pass.remapped)
+    {
+        for (int source : remap.by_x)
+        {
+            offsets.push_back(source * BYTES_PER_PIXEL);
+        }
+    }
+    bool has_vignette = false;
+    for (const PipelineStage& stage : pass.stages)
+    {
+        has_vignette = has_vignette || stage.vignette;
+    }
+
+    for (int first = 0; first < height; first += band_rows)
+    {
+        Image* band = output.tile(0, first / band_rows, TILE_WRITE);
+        bool filled = band && (pass.resampled ? stream_resampled(columns, rows, input, *band, first, band_budget)
+                               : by_columns   ? stream_columns(pass, input, spans, *band, first)
+                                              : stream_rows(pass, input, *band, first, offsets));
+        if (!filled)
+        {
+            return false;
+        }
+        if (pass.stages.empty())
+        {
+            continue;
+        }
+
+        // Only the vignette rows the band needs, unless it is the whole image
+        shared_ptr<VignetteTable> vignettes;
+        if (has_vignette)
+        {
+            int low = INT_MAX, high = 0;
+            for (int row = first; row < first + band->height; row++)
+            {
+                low = min(low, abs(2 * row - height) / 2);
+                high = max(high, abs(2 * row - height) / 2);
+            }
+            vignettes = low == 0 && high == height / 2 ? vignette_table(width, height)
+                                                       : make_vignette_table(width, height, low, high + 1);
+        }
+        parallel_rows(band->height, row_bytes, [&](int run_first, int run_last) {
+            for (int i = run_first; i < run_last; ++i)
+            {
+                run_row_stages(pass, vignettes.get(), first + i, band->row(i), width);
+            }
+        });
+    }
+    return input.close() && output.close();
+}
+
+/**
+ * Converts a BMP file to a PPM or PGM file a band of rows at a time
+ * Helper function for stream_pipeline(), for output names that ask for a
+ * netpbm file (see is_netpbm_name)
+ * @param filename   BMP image filename
+ * @param outputname The PPM or PGM file name to save the image to
+ * @param options    The memory budget
+ * @return True if successful and false otherwise
+ */
+bool stream_to_netpbm(const string& filename, const string& outputname, const StreamOptions& options)
+{
+    TRACE_SCOPE("stream_to_netpbm");
+    BmpInfo info;
+    if (!read_bmp_info(filename, info))
+    {
+        return false;
+    }
+    bool gray = is_pgm_name(outputname);
+    size_t row_bytes = (size_t)info.width * (gray ? 1 : 3);
+    int band_rows = (int)max<size_t>(1, options.budget / 2 / padded_stride(info.width));
+    TiledImage input;
+    int fd = -1;
+    if (!input.open(filename, info.width, band_rows, options.budget / 2) ||
+        (fd = open(outputname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        return false;
+    }
+    vector<uint8_t> header = netpbm_header(info.width, info.height, gray);
+    iovec buffer = {header.data(), header.size()};
+    bool ok = write_buffers(fd, &buffer, 1);
+    vector<uint8_t> samples;
+    for (int tile_y = 0; tile_y * input.tile_height < info.height && ok; tile_y++)
+    {
+        const Image* band = input.tile(0, tile_y, TILE_READ);
+        if (!band)
+        {
+            ok = false;
+            break;
+        }
+        samples.resize(band->height * row_bytes);
+        parallel_rows(band->height, (int)row_bytes, [&](int first, int last) {
+            for (int i = first; i < last; i++)
+            {
+                netpbm_row(band->row(i), info.width, gray, samples.data() + i * row_bytes);
+            }
+        });
+        buffer = {samples.data(), samples.size()};
+        ok = write_buffers(fd, &buffer, 1);
+    }
+    return close(fd) == 0 && input.close() && ok;
+}
+
+/**
+ * Runs a chain of effects from file to file without holding whole images in
+ * memory, so inputs far bigger than memory can be processed
+ * The chain is planned into passes as in run_pipeline(). Each pass reads its
+ * input through a TiledImage and writes its output a band of rows at a time,
+ * staying within options.budget bytes of pixels: rows come from full-width
+ * input bands read in file order, quarter turns read square tiles a column
+ * of them at a time, and filtered resizes blend a window of resampled rows.
+ * The results match run_pipeline() exactly. Each pass writes to a temporary
+ * file next to outputname, which the last one replaces outputname with. If
+ * outputname ends in .ppm or .pgm, the last pass's BMP is converted instead.
+ * Only 24-bit BMP inputs can be read a tile at a time: the other files
+ * read_image() takes (indexed BMP, PPM and PGM) are decoded whole and run
+ * through run_pipeline() instead.
+ * @param filename   Input image filename
+ * @param outputname The BMP, PPM or PGM file name to save the result to
+ * @param steps      The steps, in order
+ * @param options    The memory budget and tile size
+ * @return True if successful and false otherwise
+ */
+bool stream_pipeline(const string& filename, const string& outputname, const vector<PipelineStep>& steps,
+                     const StreamOptions& options = stream_options)
+{
+    TRACE_SCOPE("stream_pipeline");
+    BmpInfo info;
+    if (!read_bmp_info(filename, info))
+    {
+        Image image = read_image(filename);
+        return run_pipeline(image, steps) && save_image(outputname, image, chain_palette(steps));
+    }
+    string source = filename;
+    bool ok = true;
+    vector<PipelinePass> passes = plan_pipeline(info.width, info.height, steps);
+    if (passes.empty())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < passes.size() && ok; i++)
+    {
+        string target = outputname + ".part" + to_string(i + 1);
+        ok = stream_pass(passes[i], source, target, options);
+        if (source != filename)
+        {
+            remove(source.c_str());
+        }
+        source = target;
+    }
+    if (is_netpbm_name(outputname))
+    {
+        ok = ok && stream_to_netpbm(source, outputname, options);
+        if (source != filename)
+        {
+            remove(source.c_str());
+        }
+        return ok;
+    }
+    ok = ok && rename(source.c_str(), outputname.c_str()) == 0;
+    if (!ok)
+    {
+        remove(source.c_str());
+    }
+    return ok;
+}
+
+
+/**
+ * Runs a point effect from the input file to the output file
+ * With --stream a 24-bit BMP is never loaded whole (see stream_pipeline).
+ * Otherwise, effects with a known palette save an indexed BMP (see save_image).
+ * @param filename   Input image filename
+ * @param outputname The BMP file name to save the result to
+ * @param effect     The point effect
+ * @return True if successful and false otherwise
+ */
+bool run_point_effect(string filename, string outputname, const PointEffect& effect)
+{
+    if (use_stream)
+    {
+        return stream_pipeline(filename, outputname, {{EFFECT_STEP, effect, 0, 1, 1, NEAREST}});
+    }
+
+    Image image = load_image_for_output(filename, outputname);
+    if (image.empty())
+    {
+        return false;
+    }
+    apply_point_effect(effect, image);
+    return save_image(outputname, image, chain_palette({{EFFECT_STEP, effect, 0, 1, 1, NEAREST}}));
+}
+
+// Bounded queue class
+// A fixed-capacity queue between threads: push() waits while it is full and
+// pop() waits while it is empty. Once closed, pop() drains what is left and
+// then returns false.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(max((size_t)1, capacity)) {}
+
+    void push(T item)
+    {
+        unique_lock<mutex> guard(lock);
+        not_full.wait(guard, [this] { return items.size() < capacity; });
+        items.push_back(move(item));
+        not_empty.notify_one();
+    }
+
+    bool pop(T& item)
+    {
+        unique_lock<mutex> guard(lock);
+        not_empty.wait(guard, [this] { return !items.empty() || closed; });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = move(items.front());
+        items.erase(items.begin());
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    vector<T> items;
+    mutex lock;
+    condition_variable not_full;
+    condition_variable not_empty;
+    bool closed = false;
+};
+
+// Single-producer single-consumer queue class
+// A fixed-capacity ring between exactly two threads. Pushing and popping never
+// take a lock: the producer only moves the tail and the consumer the head.
+// Only a thread that finds the queue full (or empty) and has to wait goes to
+// sleep on a condition variable, and the other side wakes it when it sees a
+// sleeper. Once closed, pops drain what is left and then fail.
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity) : slots(max((size_t)1, capacity) + 1) {}
+
+    // Producer: adds an item, unless the queue is full
+    bool try_push(T& item)
+    {
+        if (!push_now(item))
+        {
+            return false;
+        }
+        wake_sleeper();
+        return true;
+    }
+
+    // Producer: adds an item, waiting while the queue is full
+    void push_wait(T& item)
+    {
+        wait_for([&] { return push_now(item); });
+        wake_sleeper();
+    }
+
+    // Consumer: takes the oldest item, unless the queue is empty
+    bool try_pop(T& item)
+    {
+        if (!pop_now(item))
+        {
+            return false;
+        }
+        wake_sleeper();
+        return true;
+    }
+
+    // Consumer: takes the oldest item, waiting while the queue is empty
+    // @return false once the queue is closed and empty
+    bool pop_wait(T& item)
+    {
+        bool popped = false;
+        wait_for([&] { return (popped = pop_now(item)) || closed.load(); });
+        if (popped)
+        {
+            wake_sleeper();
+        }
+        return popped;
+    }
+
+    // Producer: no more items are coming
+    void close()
+    {
+        closed.store(true);
+        wake_sleeper();
+    }
+
+    // True once the queue is closed and everything in it has been popped
+    bool finished() const
+    {
+        return closed.load() && size() == 0;
+    }
+
+    size_t size() const
+    {
+        size_t head = head_index.load(memory_order_acquire);
+        size_t tail = tail_index.load(memory_order_acquire);
+        return (tail + slots.size() - head) % slots.size();
+    }
+
+    size_t capacity() const
+    {
+        return slots.size() - 1;
+    }
+
+private:
+    bool push_now(T& item)
+    {
+        size_t tail = tail_index.load(memory_order_relaxed);
+        size_t next = (tail + 1) % slots.size();
+        if (next == head_index.load(memory_order_acquire))
+        {
+            return false;
+        }
+        slots[tail] = move(item);
+        tail_index.store(next, memory_order_release);
+        return true;
+    }
+
+    bool pop_now(T& item)
+    {
+        size_t head = head_index.load(memory_order_relaxed);
+        if (head == tail_index.load(memory_order_acquire))
+        {
+            return false;
+        }
+        item = move(slots[head]);
+        head_index.store((head + 1) % slots.size(), memory_order_release);
+        return true;
+    }
+
+    // Spins briefly, then sleeps until ready() holds
+    template <typename Ready>
+    void wait_for(Ready ready)
+    {
+        for (int spin = 0; spin < 64; spin++)
+        {
+            if (ready())
+            {
+                return;
+            }
+            this_thread::yield();
+        }
+        unique_lock<mutex> guard(lock);
+        sleepers.fetch_add(1);
+        while (!ready())
+        {
+            wake.wait(guard);
+        }
+        sleepers.fetch_sub(1);
+    }
+
+    // After a change: the fence orders it before the sleeper check, so either
+    // the sleeper sees the change or this sees the sleeper
+    void wake_sleeper()
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleepers.load(memory_order_relaxed) > 0)
+        {
+            lock_guard<mutex> guard(lock);
+            wake.notify_all();
+        }
+    }
+
+    vector<T> slots;
+    atomic<size_t> head_index{0};
+    atomic<size_t> tail_index{0};
+    atomic<bool> closed{false};
+    atomic<int> sleepers{0};
+    mutex lock;
+    condition_variable wake;
+};
+
+// Asynchronous I/O class
+// Keeps up to `depth` reads and writes in flight for the one thread that calls
+// read(), write() and wait(). Uses io_uring where the kernel allows it, and
+// otherwise `depth` threads doing blocking preadv()/pwritev(). Short transfers
+// are picked up again internally, so a request completes once all its bytes
+// are transferred (or it fails). wake() can be called from any thread to make
+// wait() return early, e.g. when there is new work to submit.
+class AsyncIo
+{
+public:
+    struct Completion
+    {
+        uint64_t tag;        // As given to read() or write()
+        long long result;    // Bytes transferred, or -1 on failure
+    };
+
+    AsyncIo(int depth, bool allow_uring) : slots(max(1, depth)), requests(max(1, depth))
+    {
+        for (int i = (int)slots.size() - 1; i >= 0; i--)
+        {
+            free_slots.push_back(i);
+        }
+#ifdef HAVE_IO_URING
+        if (allow_uring && setup_uring())
+        {
+            return;
+        }
+#else
+        (void)allow_uring;
+#endif
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            workers.emplace_back(&AsyncIo::worker, this);
+        }
+    }
+
+    // Every request must have completed by now
+    ~AsyncIo()
+    {
+#ifdef HAVE_IO_URING
+        if (ring_fd >= 0)
+        {
+            // Let the eventfd read complete rather than leave it pointing at this object
+            stopping = true;
+            wake();
+            vector<Completion> done;
+            while (wake_armed)
+            {
+                enter(1);
+                reap(done);
+            }
+            munmap(sqes, sqe_bytes);
+            if (cq_ring != sq_ring)
+            {
+                munmap(cq_ring, cq_bytes);
+            }
+            munmap(sq_ring, sq_bytes);
+            close(ring_fd);
+            close(wake_fd);
+            return;
+        }
+#endif
+        requests.close();
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    bool uses_uring() const
+    {
+        return ring_fd >= 0;
+    }
+
+    // Requests that can still be started
+    int available() const
+    {
+        return (int)free_slots.size();
+    }
+
+    /**
+     * Starts reading part of a file (available() must be positive)
+     * @param fd     The file descriptor
+     * @param buffer Where the bytes go (must stay valid until completion)
+     * @param length The number of bytes
+     * @param offset The file position
+     * @param tag    Returned with the completion
+     */
+    void read(int fd, void* buffer, size_t length, off_t offset, uint64_t tag)
+    {
+        iovec single = {buffer, length};
+        start(fd, &single, 1, offset, tag, false);
+    }
+
+    /**
+     * Starts writing a list of buffers to a file (available() must be positive)
+     * @param fd      The file descriptor
+     * @param buffers The buffers, at most IOV_MAX (copied; what they point to must stay valid)
+     * @param count   The number of buffers
+     * @param offset  The file position of the first buffer
+     * @param tag     Returned with the completion
+     */
+    void write(int fd, const iovec* buffers, int count, off_t offset, uint64_t tag)
+    {
+        start(fd, buffers, count, offset, tag, true);
+    }
+
+    /**
+     * Submits what was started and waits until at least one request completes or
+     * wake() is called
+     * @param done The completions are appended to this
+     */
+    void wait(vector<Completion>& done)
+    {
+        size_t before = done.size();
+#ifdef HAVE_IO_URING
+        if (ring_fd >= 0)
+        {
+            woken = false;
+            while (true)
+            {
+                reap(done);
+                if (done.size() > before || woken)
+                {
+                    break;
+                }
+                enter(1);
+            }
+            enter(0);  // Whatever was started while reaping
+            return;
+        }
+#endif
+        unique_lock<mutex> guard(completion_lock);
+        completion_ready.wait(guard, [&] { return !completions.empty() || woken; });
+        woken = false;
+        for (const pair<int, long long>& completion : completions)
+        {
+            done.push_back({slots[completion.first].tag, completion.second});
+            free_slots.push_back(completion.first);
+        }
+        completions.clear();
+        (void)before;
+    }
+
+    // Makes the current or next wait() return (from any thread)
+    void wake()
+    {
+#ifdef HAVE_IO_URING
+        if (ring_fd >= 0)
+        {
+            uint64_t one = 1;
+            ssize_t written = ::write(wake_fd, &one, sizeof(one));
+            (void)written;
+            return;
+        }
+#endif
+        lock_guard<mutex> guard(completion_lock);
+        woken = true;
+        completion_ready.notify_one();
+    }
+
+private:
+    struct Slot
+    {
+        uint64_t tag = 0;
+        int fd = -1;
+        off_t offset = 0;        // File position of buffers[first]
+        bool writing = false;
+        vector<iovec> buffers;
+        size_t first = 0;        // First buffer not fully transferred
+        long long done = 0;      // Bytes transferred so far
+    };
+
+    void start(int fd, const iovec* buffers, int count, off_t offset, uint64_t tag, bool writing)
+    {
+        int index = free_slots.back();
+        free_slots.pop_back();
+        Slot& slot = slots[index];
+        slot.tag = tag;
+        slot.fd = fd;
+        slot.offset = offset;
+        slot.writing = writing;
+        slot.buffers.assign(buffers, buffers + count);
+        slot.first = 0;
+        slot.done = 0;
+#ifdef HAVE_IO_URING
+        if (ring_fd >= 0)
+        {
+            queue_slot(index);
+            return;
+        }
+#endif
+        requests.push(index);
+    }
+
+    // Fallback: runs requests with blocking calls
+    void worker()
+    {
+        int index;
+        while (requests.pop(index))
+        {
+            Slot& slot = slots[index];
+            long long total = 0;
+            for (const iovec& buffer : slot.buffers)
+            {
+                total += buffer.iov_len;
+            }
+            bool ok = transfer_buffers_at(slot.fd, slot.buffers.data(), (int)slot.buffers.size(), slot.offset,
+                                          slot.writing);
+            lock_guard<mutex> guard(completion_lock);
+            completions.push_back({index, ok ? total : -1});
+            completion_ready.notify_one();
+        }
+    }
+
+    vector<Slot> slots;
+    vector<int> free_slots;
+    int ring_fd = -1;
+    bool woken = false;
+
+    // Fallback state
+    BoundedQueue<int> requests;
+    vector<thread> workers;
+    mutex completion_lock;
+    condition_variable completion_ready;
+    vector<pair<int, long long>> completions;  // Slot, result
+
+#ifdef HAVE_IO_URING
+    // Tag of the eventfd read that wake() completes
+    static const uint64_t WAKE_REQUEST = UINT64_MAX;
+
+    bool setup_uring()
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = (int)syscall(__NR_io_uring_setup, (unsigned)slots.size() + 1, &params);
+        if (fd < 0)
+        {
+            return false;
+        }
+        sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqe_bytes = params.sq_entries * sizeof(io_uring_sqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+        {
+            sq_bytes = cq_bytes = max(sq_bytes, cq_bytes);
+        }
+        sq_ring = mmap(nullptr, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cq_ring = single_mmap || sq_ring == MAP_FAILED
+                      ? sq_ring
+                      : mmap(nullptr, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void* sqe_memory = mmap(nullptr, sqe_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqe_memory == MAP_FAILED || wake_fd < 0)
+        {
+            if (sqe_memory != MAP_FAILED) munmap(sqe_memory, sqe_bytes);
+            if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_bytes);
+            if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_bytes);
+            if (wake_fd >= 0) close(wake_fd);
+            close(fd);
+            return false;
+        }
+
+        char* sq = (char*)sq_ring;
+        char* cq = (char*)cq_ring;
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        sqes = (io_uring_sqe*)sqe_memory;
+        ring_fd = fd;
+        arm_wake();
+        return true;
+    }
+
+    // Adds a request to the submission queue (submitted by the next enter())
+    void queue_sqe(uint8_t opcode, int fd, const void* address, unsigned length, off_t offset, uint64_t user_data)
+    {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)address;
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        pending++;
+    }
+
+    void queue_slot(int index)
+    {
+        Slot& slot = slots[index];
+        queue_sqe(slot.writing ? IORING_OP_WRITEV : IORING_OP_READV, slot.fd, &slot.buffers[slot.first],
+                  (unsigned)(slot.buffers.size() - slot.first), slot.offset, (uint64_t)index);
+    }
+
+    void arm_wake()
+    {
+        queue_sqe(IORING_OP_READ, wake_fd, &wake_count, sizeof(wake_count), 0, WAKE_REQUEST);
+        wake_armed = true;
+    }
+
+    // Submits what is queued and, if asked, waits for a completion
+    void enter(unsigned wait_for)
+    {
+        while (pending > 0 || wait_for > 0)
+        {
+            int submitted = (int)syscall(__NR_io_uring_enter, ring_fd, pending, wait_for,
+                                         wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                return;
+            }
+            if (submitted > 0)
+            {
+                pending -= submitted;
+            }
+            if (submitted >= 0)
+            {
+                return;
+            }
+        }
+    }
+
+    // Takes every completion off the ring, picking up short transfers again
+    void reap(vector<Completion>& done)
+    {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const io_uring_cqe& cqe = cqes[head & cq_mask];
+            if (cqe.user_data == WAKE_REQUEST)
+            {
+                woken = true;
+                wake_armed = false;
+                if (!stopping)
+                {
+                    arm_wake();
+                }
+                continue;
+            }
+            int index = (int)cqe.user_data;
+            Slot& slot = slots[index];
+            long long result = cqe.res;
+            if (result == -EINTR || result == -EAGAIN)
+            {
+                queue_slot(index);
+                continue;
+            }
+            if (result > 0)
+            {
+                slot.done += result;
+                slot.offset += result;
+                while (slot.first < slot.buffers.size() && (size_t)result >= slot.buffers[slot.first].iov_len)
+                {
+                    result -= slot.buffers[slot.first++].iov_len;
+                }
+                if (slot.first < slot.buffers.size())
+                {
+                    // Short transfer: the rest goes again
+                    iovec& buffer = slot.buffers[slot.first];
+                    buffer.iov_base = (char*)buffer.iov_base + result;
+                    buffer.iov_len -= result;
+                    queue_slot(index);
+                    continue;
+                }
+            }
+            bool ok = slot.first == slot.buffers.size();
+            done.push_back({slot.tag, ok ? slot.done : -1});
+            free_slots.push_back(index);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    void* sq_ring = MAP_FAILED;
+    void* cq_ring = MAP_FAILED;
+    size_t sq_bytes = 0;
+    size_t cq_bytes = 0;
+    size_t sqe_bytes = 0;
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    unsigned pending = 0;       // Queued but not yet submitted
+    int wake_fd = -1;
+    uint64_t wake_count = 0;
+    bool wake_armed = false;
+    bool stopping = false;
+#endif
+};
+
+// Batch mode settings, from --effect, --in, --out, --jobs, --async-io, --io-depth and --no-uring
+struct BatchOptions
+{
+    vector<string> effects;  // Chains in parse_pipeline() syntax, each applied to every image
+    string input;            // A directory of BMPs, one image, or a file listing one path per line
+    string output;           // The directory results are written to (same file names)
+    int jobs = 1;            // Images worked on at once
+    bool async_io = false;   // Read and write through AsyncIo (see run_async_batch)
+    int io_depth = 8;        // Reads and writes in flight with async_io
+    bool uring = true;       // Let AsyncIo use io_uring
+};
+
+/**
+ * Lists the images a batch works through
+ * A BMP, PPM or PGM file is a batch of one. Any other binary file is rejected
+ * rather than split into lines.
+ * @param input A directory (every .bmp in it, sorted), a single image, or a
+ *              text file with one path per line
+ * @param paths The image paths
+ * @return True if successful and false if the input could not be read
+ */
+bool list_batch_inputs(const string& input, vector<string>& paths)
+{
+    struct stat file_info;
+    if (stat(input.c_str(), &file_info) != 0)
+    {
+        return false;
+    }
+
+    if (S_ISDIR(file_info.st_mode))
+    {
+        DIR* dir = opendir(input.c_str());
+        if (!dir)
+        {
+            return false;
+        }
+        while (dirent* entry = readdir(dir))
+        {
+            string name = entry->d_name;
+            string extension = name.size() > 4 ? name.substr(name.size() - 4) : "";
+            transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            if (extension == ".bmp")
+            {
+                paths.push_back(input + "/" + name);
+            }
+        }
+        closedir(dir);
+        sort(paths.begin(), paths.end());
+        return true;
+    }
+
+    ifstream list(input, ios::binary);
+    char start[512];
+    list.read(start, sizeof(start));
+    streamsize length = list.gcount();
+    // BMP headers always hold zero bytes; PNM magic numbers end in whitespace
+    if ((length >= 54 && start[0] == 'B' && start[1] == 'M' && memchr(start, 0, 54)) ||
+        (length >= 3 && start[0] == 'P' && (start[1] == '5' || start[1] == '6') && isspace(start[2])))
+    {
+        paths.push_back(input);
+        return true;
+    }
+    // A list of paths holds no control characters other than line breaks and tabs
+    for (streamsize i = 0; i < length; i++)
+    {
+        unsigned char c = start[i];
+        if (c < 0x20 && c != '\n' && c != '\r' && c != '\t')
+        {
+            return false;
+        }
+    }
+
+    list.clear();
+    list.seekg(0);
+    string line;
+    while (getline(list, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (!line.empty())
+        {
+            paths.push_back(line);
+        }
+    }
+    return true;
+}
+
+/**
+ * Names the result of a batch chain
+ * @param options The batch settings
+ * @param path    The input image path
+ * @param chain   The chain index
+ * @param chains  The number of chains
+ * @return OUTPUT/NAME.bmp, or OUTPUT/NAME_i.bmp with several chains
+ */
+string batch_output_name(const BatchOptions& options, const string& path, int chain, int chains)
+{
+    string name = path.substr(path.find_last_of('/') + 1);
+    if (chains > 1)
+    {
+        size_t dot = name.find_last_of('.');
+        name = name.substr(0, dot) + "_" + to_string(chain + 1) + name.substr(min(dot, name.size()));
+    }
+    return options.output + "/" + name;
+}
+
+// What a batch reports about one result (read_ms and write_ms include waiting for the disk)
+struct BatchResult
+{
+    string outputname;
+    bool ok = false;
+    int width = 0;
+    int height = 0;
+    double read_ms = 0;
+    double effect_ms = 0;
+    double write_ms = 0;
+};
+
+/**
+ * Runs a batch with asynchronous reads and writes (--async-io)
+ * This thread only does I/O: it keeps up to options.io_depth whole-file reads
+ * and writes in flight through AsyncIo and hands each file read to one of the
+ * jobs through its own single-producer single-consumer queue. The jobs decode
+ * (a 24-bit BMP in place, right in the bytes read), apply the chains, encode
+ * the results and queue them back for writing, so the disk and the CPU both
+ * stay busy and no thread ever takes a lock to pass an image along.
+ * @param options  The batch settings
+ * @param paths    The input images
+ * @param chains   The parsed chains
+ * @param palettes The palette of each chain's results (see chain_palette)
+ * @param report   Called on this thread for every result
+ * @return True if the I/O went through io_uring and false if through threads
+ */
+bool run_async_batch(const BatchOptions& options, const vector<string>& paths,
+                     const vector<vector<PipelineStep>>& chains, const vector<Palette>& palettes,
+                     const function<void(const BatchResult&)>& report)
+{
+    typedef chrono::steady_clock Clock;
+    auto milliseconds = [](Clock::time_point start, Clock::time_point end) {
+        return chrono::duration<double, milli>(end - start).count();
+    };
+
+    struct Input
+    {
+        size_t path = 0;
+        shared_ptr<MappedFile> file;   // The whole file, or null if it could not be read
+        double read_ms = 0;
+    };
+    struct Output
+    {
+        size_t path = 0;
+        BatchResult result;
+        EncodedFile file;
+    };
+    int jobs = max(1, options.jobs);
+    int chain_count = (int)chains.size();
+    vector<unique_ptr<SpscQueue<Input>>> inputs;
+    vector<unique_ptr<SpscQueue<Output>>> outputs;
+    for (int i = 0; i < jobs; i++)
+    {
+        inputs.emplace_back(new SpscQueue<Input>(2));
+        outputs.emplace_back(new SpscQueue<Output>(chain_count + 1));
+    }
+    AsyncIo io(options.io_depth, options.uring);
+
+    auto job = [&](int index) {
+        if (jobs > 1)
+        {
+            ThreadPool::run_serially_on_this_thread();
+        }
+        SpscQueue<Input>& input = *inputs[index];
+        SpscQueue<Output>& output = *outputs[index];
+        Input item;
+        while (input.pop_wait(item))
+        {
+            io.wake();  // There is room for another read
+            const string& path = paths[item.path];
+            Image decoded;
+            if (item.file)
+            {
+                decoded = image_in_bmp_bytes(item.file, item.file->contents.data());
+                item.file.reset();
+                if (decoded.empty())
+                {
+                    // Not a 24-bit BMP: read it again the usual way
+                    decoded = read_image(path);
+                }
+            }
+            for (int chain = 0; chain < chain_count; chain++)
+            {
+                Output result;
+                result.path = item.path;
+                result.result.outputname = batch_output_name(options, path, chain, chain_count);
+                result.result.width = decoded.width;
+                result.result.height = decoded.height;
+                result.result.read_ms = item.read_ms;
+                if (!decoded.empty())
+                {
+                    // The last chain takes the decoded image itself
+                    Clock::time_point start = Clock::now();
+                    Image image = chain + 1 < chain_count ? owned_image(decoded) : move(decoded);
+                    result.result.ok = run_pipeline(image, chains[chain]) &&
+                        encode_output_file(result.result.outputname, image, palettes[chain], result.file);
+                    result.file.image = move(image);
+                    result.result.effect_ms = milliseconds(start, Clock::now());
+                }
+                output.push_wait(result);
+                io.wake();
+            }
+        }
+        output.close();
+        io.wake();
+    };
+    vector<thread> workers;
+    for (int i = 0; i < jobs; i++)
+    {
+        workers.emplace_back(job, i);
+    }
+
+    struct Read
+    {
+        size_t path;
+        int job;
+        int fd;
+        shared_ptr<MappedFile> file;
+        Clock::time_point start;
+    };
+    struct Write
+    {
+        Output output;
+        int fd;
+        int chunks_left;
+        bool ok;
+        Clock::time_point start;
+    };
+    map<uint64_t, Read> reads;
+    map<uint64_t, Write> writes;
+    deque<pair<uint64_t, size_t>> write_backlog;  // Write and first buffer of chunks not started
+    vector<int> reads_for(jobs, 0);
+    uint64_t next_tag = 0;
+    size_t next_path = 0;
+    int next_job = 0;
+    vector<AsyncIo::Completion> done;
+
+    auto hand_over = [&](int index, Input& item) {
+        reads_for[index]--;
+        bool queued = inputs[index]->try_push(item);  // Room was kept for it
+        (void)queued;
+    };
+    auto finish_write = [&](Write& write) {
+        write.ok = close(write.fd) == 0 && write.ok;
+        write.output.result.ok = write.ok;
+        write.output.result.write_ms = milliseconds(write.start, Clock::now());
+        report(write.output.result);
+    };
+
+    while (true)
+    {
+        // Start reading the next files for the jobs with room for them
+        for (int tries = 0; tries < jobs && next_path < paths.size() && io.available() > 0;)
+        {
+            int index = next_job;
+            if (reads_for[index] + inputs[index]->size() >= inputs[index]->capacity())
+            {
+                next_job = (next_job + 1) % jobs;
+                tries++;
+                continue;
+            }
+            next_job = (next_job + 1) % jobs;
+            tries = 0;
+
+            Input item;
+            item.path = next_path++;
+            reads_for[index]++;
+            Clock::time_point start = Clock::now();
+            int fd = open(paths[item.path].c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat file_info;
+            if (fd < 0 || fstat(fd, &file_info) != 0 || file_info.st_size <= 0)
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                hand_over(index, item);
+                continue;
+            }
+            shared_ptr<MappedFile> file = make_shared<MappedFile>();
+            file->length = file_info.st_size;
+            file->contents = PixelBuffer(file->length);
+            uint64_t tag = next_tag++;
+            reads[tag] = {item.path, index, fd, file, start};
+            io.read(fd, file->contents.data(), file->length, 0, tag);
+        }
+
+        // Take the jobs' results and start writing them
+        bool jobs_done = true;
+        for (int index = 0; index < jobs; index++)
+        {
+            Output output;
+            while (outputs[index]->try_pop(output))
+            {
+                if (!output.result.ok)
+                {
+                    report(output.result);
+                    continue;
+                }
+                int fd = open(output.result.outputname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (fd < 0)
+                {
+                    output.result.ok = false;
+                    report(output.result);
+                    continue;
+                }
+                // Reserve the space up front (see write_image)
+                reserve_file(fd, output.file.size);
+                uint64_t tag = next_tag++;
+                size_t buffer_count = output.file.buffers.size();
+                Write& write = writes[tag];
+                write = {move(output), fd, (int)((buffer_count + IOV_MAX - 1) / IOV_MAX), true, Clock::now()};
+                for (size_t first = 0; first < buffer_count; first += IOV_MAX)
+                {
+                    write_backlog.push_back({tag, first});
+                }
+                if (buffer_count == 0)
+                {
+                    finish_write(write);
+                    writes.erase(tag);
+                }
+            }
+            jobs_done = jobs_done && outputs[index]->finished();
+        }
+        while (!write_backlog.empty() && io.available() > 0)
+        {
+            uint64_t tag = write_backlog.front().first;
+            size_t first = write_backlog.front().second;
+            write_backlog.pop_front();
+            const EncodedFile& file = writes[tag].output.file;
+            off_t offset = 0;
+            for (size_t i = 0; i < first; i++)
+            {
+                offset += file.buffers[i].iov_len;
+            }
+            int count = (int)min<size_t>(IOV_MAX, file.buffers.size() - first);
+            io.write(writes[tag].fd, &file.buffers[first], count, offset, tag);
+        }
+
+        if (next_path == paths.size())
+        {
+            for (int index = 0; index < jobs; index++)
+            {
+                if (reads_for[index] == 0)
+                {
+                    inputs[index]->close();
+                }
+            }
+        }
+        if (jobs_done && reads.empty() && writes.empty())
+        {
+            break;
+        }
+
+        done.clear();
+        io.wait(done);
+        for (const AsyncIo::Completion& completion : done)
+        {
+            auto read = reads.find(completion.tag);
+            if (read != reads.end())
+            {
+                close(read->second.fd);
+                Input item;
+                item.path = read->second.path;
+                item.read_ms = milliseconds(read->second.start, Clock::now());
+                if (completion.result == (long long)read->second.file->length)
+                {
+                    item.file = read->second.file;
+                }
+                hand_over(read->second.job, item);
+                reads.erase(read);
+                continue;
+            }
+            auto write = writes.find(completion.tag);
+            write->second.ok = write->second.ok && completion.result >= 0;
+            if (--write->second.chunks_left == 0)
+            {
+                finish_write(write->second);
+                writes.erase(write);
+            }
+        }
+    }
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+    return io.uses_uring();
+}
+
+/**
+ * Runs a batch with a loader thread reading ahead of the jobs
+ * Helper function for run_batch()
+ * @param options  The batch settings
+ * @param paths    The input images
+ * @param chains   The parsed chains
+ * @param palettes The palette of each chain's results (see chain_palette)
+ * @param report   Called for every result, from any thread
+ */
+void run_prefetching_batch(const BatchOptions& options, const vector<string>& paths,
+                           const vector<vector<PipelineStep>>& chains, const vector<Palette>& palettes,
+                           const function<void(const BatchResult&)>& report)
+{
+    typedef chrono::steady_clock Clock;
+    auto milliseconds = [](Clock::time_point start, Clock::time_point end) {
+        return chrono::duration<double, milli>(end - start).count();
+    };
+
+    struct Loaded
+    {
+        string path;
+        int chain;
+        Image image;     // Empty when streaming
+        int width;
+        int height;
+        double read_ms;
+    };
+    int jobs = max(1, options.jobs);
+    BoundedQueue<Loaded> prefetch(jobs + 1);
+    // The jobs split the streaming budget between them
+    StreamOptions stream_share = stream_options;
+    stream_share.budget /= jobs;
+
+    thread loader([&]() {
+        for (const string& path : paths)
+        {
+            for (int chain = 0; chain < (int)chains.size(); chain++)
+            {
+                // A single chain reads each image once anyway, so it skips the cache
+                // (streaming reads the image as the chain runs, so only its size is read here,
+                // unless it is not a 24-bit BMP and has to be decoded whole after all)
+                Clock::time_point start = Clock::now();
+                Image image;
+                BmpInfo info;
+                if (!use_stream || !read_bmp_info(path, info))
+                {
+                    image = chains.size() > 1 ? load_image(path) : decode_image(path);
+                    info.width = image.width;
+                    info.height = image.height;
+                }
+                prefetch.push({path, chain, move(image), info.width, info.height, milliseconds(start, Clock::now())});
+            }
+        }
+        prefetch.close();
+    });
+
+    auto job = [&]() {
+        if (jobs > 1)
+        {
+            ThreadPool::run_serially_on_this_thread();
+        }
+        Loaded item;
+        while (prefetch.pop(item))
+        {
+            BatchResult result;
+            result.outputname = batch_output_name(options, item.path, item.chain, (int)chains.size());
+            result.width = item.width;
+            result.height = item.height;
+            result.read_ms = item.read_ms;
+            bool ok = item.width > 0;
+            bool streamed = use_stream && item.image.empty();
+
+            Clock::time_point start = Clock::now();
+            if (ok && streamed)
+            {
+                ok = stream_pipeline(item.path, result.outputname, chains[item.chain], stream_share);
+            }
+            else if (ok)
+            {
+                ok = run_pipeline(item.image, chains[item.chain]);
+            }
+            Clock::time_point applied = Clock::now();
+            ok = ok && (streamed || save_image(result.outputname, item.image, palettes[item.chain]));
+            Clock::time_point written = Clock::now();
+            item.image = Image();
+
+            result.ok = ok;
+            result.effect_ms = milliseconds(start, applied);
+            result.write_ms = milliseconds(applied, written);
+            report(result);
+        }
+    };
+
+    vector<thread> workers;
+    for (int i = 1; i < jobs; i++)
+    {
+        workers.emplace_back(job);
+    }
+    job();
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+    loader.join();
+}
+
+/**
+ * Runs chains of effects over a whole set of images without the menu
+ * A loader thread reads images ahead into a small bounded queue while the jobs
+ * apply the chain and write the results, so reading the next image overlaps
+ * with working on the current one. With one job the chain uses the thread pool
+ * for each image; with more, each job works on its own image.
+ * With several chains each image goes through every one of them (result i of
+ * NAME.bmp is saved as NAME_i.bmp); the image is decoded once and the other
+ * chains get it from the image cache.
+ * With --stream the jobs run the chains from file to file (see stream_pipeline),
+ * so the effect time includes reading and writing.
+ * With --async-io (and not --stream) the batch runs through run_async_batch().
+ * Prints a line per result and the totals.
+ * @param options The batch settings
+ * @return True if every image was processed and false otherwise
+ */
+bool run_batch(const BatchOptions& options)
+{
+    vector<vector<PipelineStep>> chains(options.effects.size());
+    vector<Palette> palettes(options.effects.size());
+    for (size_t i = 0; i < options.effects.size(); i++)
+    {
+        if (!parse_pipeline(options.effects[i], chains[i]))
+        {
+            cout << "Invalid effect: " << options.effects[i] << endl;
+            return false;
+        }
+        palettes[i] = chain_palette(chains[i]);
+    }
+    vector<string> paths;
+    if (!list_batch_inputs(options.input, paths))
+    {
+        cout << "Cannot read input (expected a directory, an image or a list of image paths): "
+             << options.input << endl;
+        return false;
+    }
+    if (mkdir(options.output.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        cout << "Cannot create output directory: " << options.output << endl;
+        return false;
+    }
+
+    cout << fixed << setprecision(2);
+    mutex report_lock;
+    int failed = 0;
+    double pixels = 0;
+    auto report = [&](const BatchResult& result) {
+        lock_guard<mutex> guard(report_lock);
+        string name = result.outputname.substr(result.outputname.find_last_of('/') + 1);
+        if (!result.ok)
+        {
+            failed++;
+            cout << name << ": failed" << endl;
+            return;
+        }
+        pixels += (double)result.width * result.height;
+        double total_ms = result.read_ms + result.effect_ms + result.write_ms;
+        cout << name << ": " << result.width << "x" << result.height
+             << "  read " << result.read_ms << " ms"
+             << "  effect " << result.effect_ms << " ms"
+             << "  write " << result.write_ms << " ms"
+             << "  (" << (double)result.width * result.height * BYTES_PER_PIXEL / 1e3 / max(total_ms, 1e-3)
+             << " MB/s)" << endl;
+    };
+
+    chrono::steady_clock::time_point batch_start = chrono::steady_clock::now();
+    bool async_io = options.async_io && !use_stream;
+    bool uring = false;
+    if (async_io)
+    {
+        uring = run_async_batch(options, paths, chains, palettes, report);
+    }
+    else
+    {
+        run_prefetching_batch(options, paths, chains, palettes, report);
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - batch_start).count();
+    int done = (int)(paths.size() * chains.size()) - failed;
+    cout << done << " images (" << failed << " failed) in " << seconds << " s: "
+         << done / max(seconds, 1e-9) << " images/s, "
+         << pixels / 1e6 / max(seconds, 1e-9) << " MP/s, "
+         << pixels * BYTES_PER_PIXEL / 1e6 / max(seconds, 1e-9) << " MB/s" << endl;
+    cout << "buffer pool: " << buffer_pool().hit_count() << " reused, " << buffer_pool().miss_count()
+         << " allocated" << endl;
+    if (async_io)
+    {
+        cout << "async io: " << (uring ? "io_uring" : "threads") << ", depth " << max(1, options.io_depth) << endl;
+    }
+    else if (chains.size() > 1)
+    {
+        cout << "image cache: " << image_cache().hit_count() << " hits, " << image_cache().miss_count()
+             << " misses" << endl;
+    }
+    return failed == 0;
+}
+
+// JSON value structure
+// Just enough JSON for the service's requests and responses: objects keep their
+// members in order and every number is a double.
+struct JsonValue
+{
+    enum Type { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+    Type type = JSON_NULL;
+    bool boolean = false;
+    double number = 0;
+    string text;
+    vector<JsonValue> items;
+    vector<pair<string, JsonValue>> members;
+
+    // The member called `name`, or null if there is none (or this is not an object)
+    const JsonValue* find(const string& name) const
+    {
+        for (const pair<string, JsonValue>& member : members)
+        {
+            if (member.first == name)
+            {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// JSON parser class
+// A recursive descent parser over one JSON document (one line of the protocol)
+class JsonParser
+{
+public:
+    explicit JsonParser(const string& text) : text(text) {}
+
+    // @return True if the whole text is one valid JSON value and false otherwise
+    bool parse(JsonValue& value)
+    {
+        return parse_value(value, 0) && (skip_space(), position == text.size());
+    }
+
+private:
+    void skip_space()
+    {
+        while (position < text.size() && (text[position] == ' ' || text[position] == '\t' ||
+                                          text[position] == '\n' || text[position] == '\r'))
+        {
+            position++;
+        }
+    }
+
+    bool take(char c)
+    {
+        skip_space();
+        if (position < text.size() && text[position] == c)
+        {
+            position++;
+            return true;
+        }
+        return false;
+    }
+
+    bool take_word(const char* word)
+    {
+        size_t length = strlen(word);
+        if (text.compare(position, length, word) != 0)
+        {
+            return false;
+        }
+        position += length;
+        return true;
+    }
+
+    bool parse_value(JsonValue& value, int depth)
+    {
+        skip_space();
+        if (position >= text.size() || depth > 64)
+        {
+            return false;
+        }
+        char c = text[position];
+        if (c == '{')
+        {
+            position++;
+            value.type = JsonValue::JSON_OBJECT;
+            if (take('}'))
+            {
+                return true;
+            }
+            do
+            {
+                pair<string, JsonValue> member;
+                skip_space();
+                if (!parse_string(member.first) || !take(':') || !parse_value(member.second, depth + 1))
+                {
+                    return false;
+                }
+                value.members.push_back(move(member));
+            } while (take(','));
+            return take('}');
+        }
+        if (c == '[')
+        {
+            position++;
+            value.type = JsonValue::JSON_ARRAY;
+            if (take(']'))
+            {
+                return true;
+            }
+            do
+            {
+                value.items.emplace_back();
+                if (!parse_value(value.items.back(), depth + 1))
+                {
+                    return false;
+                }
+            } while (take(','));
+            return take(']');
+        }
+        if (c == '"')
+        {
+            value.type = JsonValue::JSON_STRING;
+            return parse_string(value.text);
+        }
+        if (take_word("true") || take_word("false"))
+        {
+            value.type = JsonValue::JSON_BOOL;
+            value.boolean = c == 't';
+            return true;
+        }
+        if (take_word("null"))
+        {
+            value.type = JsonValue::JSON_NULL;
+            return true;
+        }
+        if (c == '-' || (c >= '0' && c <= '9'))
+        {
+            const char* start = text.c_str() + position;
+            char* end = nullptr;
+            value.type = JsonValue::JSON_NUMBER;
+            value.number = strtod(start, &end);
+            position += end - start;
+            return end != start;
+        }
+        return false;
+    }
+
+    // Reads a string, turning \uXXXX escapes (and surrogate pairs) into UTF-8
+    bool parse_string(string& result)
+    {
+        if (position >= text.size() || text[position] != '"')
+        {
+            return false;
+        }
+        position++;
+        while (position < text.size())
+        {
+            char c = text[position++];
+            if (c == '"')
+            {
+                return true;
+            }
+            if ((unsigned char)c < 0x20)
+            {
+                return false;
+            }
+            if (c != '\\')
+            {
+                result += c;
+                continue;
+            }
+            if (position >= text.size())
+            {
+                return false;
+            }
+            char escape = text[position++];
+            switch (escape)
+            {
+                case '"': result += '"'; break;
+                case '\\': result += '\\'; break;
+                case '/': result += '/'; break;
+                case 'b': result += '\b'; break;
+                case 'f': result += '\f'; break;
+                case 'n': result += '\n'; break;
+                case 'r': result += '\r'; break;
+                case 't': result += '\t'; break;
+                case 'u':
+                {
+                    unsigned code = 0;
+                    if (!parse_hex(code))
+                    {
+                        return false;
+                    }
+                    if (code >= 0xD800 && code < 0xDC00)
+                    {
+                        unsigned low = 0;
+                        if (!take_word("\\u") || !parse_hex(low) || low < 0xDC00 || low >= 0xE000)
+                        {
+                            return false;
+                        }
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    append_utf8(result, code);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return false;
+    }
+
+    bool parse_hex(unsigned& code)
+    {
+        if (position + 4 > text.size())
+        {
+            return false;
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            char c = text[position++];
+            int digit = c >= '0' && c <= '9' ? c - '0'
+                      : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                      : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0)
+            {
+                return false;
+            }
+            code = code * 16 + digit;
+        }
+        return true;
+    }
+
+    static void append_utf8(string& result, unsigned code)
+    {
+        if (code < 0x80)
+        {
+            result += (char)code;
+        }
+        else if (code < 0x800)
+        {
+            result += (char)(0xC0 | (code >> 6));
+            result += (char)(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000)
+        {
+            result += (char)(0xE0 | (code >> 12));
+            result += (char)(0x80 | ((code >> 6) & 0x3F));
+            result += (char)(0x80 | (code & 0x3F));
+        }
+        else
+        {
+            result += (char)(0xF0 | (code >> 18));
+            result += (char)(0x80 | ((code >> 12) & 0x3F));
+            result += (char)(0x80 | ((code >> 6) & 0x3F));
+            result += (char)(0x80 | (code & 0x3F));
+        }
+    }
+
+    const string& text;
+    size_t position = 0;
+};
+
+/**
+ * Writes a JSON value back out as text
+ * @param value The value
+ * @return the JSON text, all on one line
+ */
+string json_text(const JsonValue& value)
+{
+    switch (value.type)
+    {
+        case JsonValue::JSON_BOOL:
+            return value.boolean ? "true" : "false";
+        case JsonValue::JSON_NUMBER:
+        {
+            if (!isfinite(value.number))
+            {
+                return "null";
+            }
+            char number[32];
+            snprintf(number, sizeof(number), "%.17g", value.number);
+            return number;
+        }
+        case JsonValue::JSON_STRING:
+        {
+            string quoted = "\"";
+            for (char c : value.text)
+            {
+                if (c == '"' || c == '\\')
+                {
+                    quoted += '\\';
+                    quoted += c;
+                }
+                else if ((unsigned char)c < 0x20)
+                {
+                    char escape[8];
+                    snprintf(escape, sizeof(escape), "\\u%04x", c);
+                    quoted += escape;
+                }
+                else
+                {
+                    quoted += c;
+                }
+            }
+            return quoted + "\"";
+        }
+        case JsonValue::JSON_ARRAY:
+        {
+            string list = "[";
+            for (size_t i = 0; i < value.items.size(); i++)
+            {
+                list += (i ? "," : "") + json_text(value.items[i]);
+            }
+            return list + "]";
+        }
+        case JsonValue::JSON_OBJECT:
+        {
+            string object = "{";
+            for (size_t i = 0; i < value.members.size(); i++)
+            {
+                JsonValue name;
+                name.type = JsonValue::JSON_STRING;
+                name.text = value.members[i].first;
+                object += (i ? "," : "") + json_text(name) + ":" + json_text(value.members[i].second);
+            }
+            return object + "}";
+        }
+        default:
+            return "null";
+    }
+}
+
+/**
+ * Quotes a string for JSON
+ * @param text The string
+ * @return the JSON string
+ */
+string json_string(const string& text)
+{
+    JsonValue value;
+    value.type = JsonValue::JSON_STRING;
+    value.text = text;
+    return json_text(value);
+}
+
+/**
+ * Turns a request's effect chain into parse_pipeline() text
+ * The chain can be that text itself ("grayscale,lighten:0.5"), or a list of
+ * steps, each either a string ("rotate:1") or an object naming the effect and
+ * its parameters ({"effect": "resize", "params": [0.5, 0.5, "box"]}).
+ * @param effects The "effects" member of the request
+ * @param chain   The chain's text
+ * @return True if successful and false if the chain is not in one of those forms
+ */
+bool chain_from_json(const JsonValue& effects, string& chain)
+{
+    if (effects.type == JsonValue::JSON_STRING)
+    {
+        chain = effects.text;
+        return true;
+    }
+    if (effects.type != JsonValue::JSON_ARRAY || effects.items.empty())
+    {
+        return false;
+    }
+    chain.clear();
+    for (const JsonValue& step : effects.items)
+    {
+        chain += chain.empty() ? "" : ",";
+        if (step.type == JsonValue::JSON_STRING)
+        {
+            chain += step.text;
+            continue;
+        }
+        const JsonValue* name = step.find("effect");
+        const JsonValue* params = step.find("params");
+        if (!name || name->type != JsonValue::JSON_STRING || (params && params->type != JsonValue::JSON_ARRAY))
+        {
+            return false;
+        }
+        chain += name->text;
+        for (size_t i = 0; params && i < params->items.size(); i++)
+        {
+            const JsonValue& param = params->items[i];
+            if (param.type == JsonValue::JSON_STRING)
+            {
+                chain += ":" + param.text;
+            }
+            else if (param.type == JsonValue::JSON_NUMBER)
+            {
+                chain += ":" + json_text(param);
+            }
+            else
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Service settings, from --serve and --jobs
+struct ServiceOptions
 {
-    // Red, green, blue color values
-    int red;
-    int green;
-    int blue;
+    string socket;   // Path of the Unix domain socket to listen on
+    int jobs = 1;    // Requests worked on at once
 };
 
-/**
- * Gets an integer from a binary stream.
- * Helper function for read_image()
- * @param stream the stream
- * @param offset the offset at which to read the integer
- * @param bytes  the number of bytes to read
- * @return the integer starting at the given offset
- */ 
-int get_int(fstream& stream, int offset, int bytes)
+// Service connection structure
+// One client of the service. Its requests are read by a thread of its own and
+// the workers send each response back as soon as it is ready, one JSON line
+// each (so they can come back out of order: requests carry an "id" to match
+// them up). The socket closes once the client has stopped sending and the last
+// response is out.
+struct ServiceConnection
 {
-    stream.seekg(offset);
-    int result = 0;
-    int base = 1;
-    for (int i = 0; i < bytes; i++)
-    {   
-        result = result + stream.get() * base;
-        base = base * 256;
+    int fd;
+
+    explicit ServiceConnection(int fd) : fd(fd) {}
+
+    ~ServiceConnection()
+    {
+        close(fd);
+    }
+
+    // Sends one response line (a client that went away just misses it)
+    void send_line(const string& line)
+    {
+        string message = line + "\n";
+        lock_guard<mutex> guard(send_lock);
+        size_t sent = 0;
+        while (sent < message.size())
+        {
+            ssize_t count = send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                return;
+            }
+            sent += count;
+        }
     }
-    return result;
+
+private:
+    mutex send_lock;
+};
+
+// Service request structure
+struct ServiceRequest
+{
+    shared_ptr<ServiceConnection> connection;
+    string id;                       // The request's "id" as JSON, echoed in the response
+    string input;
+    string output;
+    string chain;
+    vector<PipelineStep> steps;
+    chrono::steady_clock::time_point received;
+};
+
+// Written to by the signal handler and the shutdown command to stop run_service()
+int service_wake_fd = -1;
+
+void stop_service(int)
+{
+    char stop = 1;
+    ssize_t written = write(service_wake_fd, &stop, 1);
+    (void)written;
 }
 
 /**
- * Reads the BMP image specified and returns the resulting image as a vector
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Runs one request: read, apply the chain and save
+ * The workers share everything that stays warm between requests: the buffer
+ * pool, the image cache, the vignette tables and the chain plans (see
+ * pipeline_plan), so a request for a chain and size seen before allocates
+ * and precomputes nothing.
+ * @param request The request
+ * @return the response line
  */
-vector<vector<Pixel>> read_image(string filename)
+string serve_request(const ServiceRequest& request)
 {
-    // Open the binary file
-    fstream stream;
-    stream.open(filename, ios::in | ios::binary);
-
-    // Get the image properties
-    int file_size = get_int(stream, 2, 4);
-    int start = get_int(stream, 10, 4);
-    int width = get_int(stream, 18, 4);
-    int height = get_int(stream, 22, 4);
-    int bits_per_pixel = get_int(stream, 28, 2);
+    typedef chrono::steady_clock Clock;
+    auto milliseconds = [](Clock::time_point start, Clock::time_point end) {
+        return chrono::duration<double, milli>(end - start).count();
+    };
+    Clock::time_point start = Clock::now();
+    ostringstream response;
+    response << fixed << setprecision(3) << "{\"id\":" << request.id;
 
-    // Scan lines must occupy multiples of four bytes
-    int scanline_size = width * (bits_per_pixel / 8);
-    int padding = 0;
-    if (scanline_size % 4 != 0)
+    Image image = load_image(request.input);
+    Clock::time_point read = Clock::now();
+    if (image.empty())
+    {
+        response << ",\"status\":\"error\",\"error\":" << json_string("Cannot read input: " + request.input) << "}";
+        return response.str();
+    }
+    int width = image.width, height = image.height;
+    shared_ptr<const vector<PipelinePass>> passes = pipeline_plan(request.chain, width, height, request.steps);
+    if (passes->empty())
     {
-        padding = 4 - scanline_size % 4;
+        response << ",\"status\":\"error\",\"error\":\"The result would be too big\"}";
+        return response.str();
     }
+    for (const PipelinePass& pass : *passes)
+    {
+        run_pipeline_pass(pass, image);
+    }
+    Clock::time_point applied = Clock::now();
+    bool saved = save_image(request.output, image, chain_palette(request.steps));
+    Clock::time_point written = Clock::now();
+    if (!saved)
+    {
+        response << ",\"status\":\"error\",\"error\":" << json_string("Cannot write output: " + request.output)
+                 << "}";
+        return response.str();
+    }
+    response << ",\"status\":\"ok\",\"width\":" << width << ",\"height\":" << height
+             << ",\"output_width\":" << image.width << ",\"output_height\":" << image.height
+             << ",\"queue_ms\":" << milliseconds(request.received, start)
+             << ",\"read_ms\":" << milliseconds(start, read)
+             << ",\"effect_ms\":" << milliseconds(read, applied)
+             << ",\"write_ms\":" << milliseconds(applied, written)
+             << ",\"total_ms\":" << milliseconds(request.received, written) << "}";
+    return response.str();
+}
 
-    // Return empty vector if this is not a valid image
-    if (file_size != start + (scanline_size + padding) * height)
+/**
+ * Runs the image processing service (--serve)
+ * Listens on a Unix domain socket for requests, one JSON object per line:
+ *     {"id": 1, "input": "in.bmp", "output": "out.bmp", "effects": "grayscale,vignette"}
+ * ("effects" can also be a list, see chain_from_json) and answers each with a
+ * line giving its status and timing:
+ *     {"id": 1, "status": "ok", "width": 512, "height": 384, "queue_ms": 0.012, ...}
+ *     {"id": 2, "status": "error", "error": "Cannot read input: missing.bmp"}
+ * {"command": "ping"}, {"command": "stats"} and {"command": "shutdown"} check on
+ * it, report what it has done and how warm its caches are, and stop it
+ * (SIGINT and SIGTERM stop it too). Paths are relative to where it runs.
+ * Requests from every connection share one queue and options.jobs workers;
+ * with one worker each image uses the thread pool, with more each worker
+ * works on its own image.
+ * @param options The service settings
+ * @return True if the service ran and stopped cleanly and false if it could not start
+ */
+bool run_service(const ServiceOptions& options)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (options.socket.empty() || options.socket.size() >= sizeof(address.sun_path))
     {
-        return {};
+        cout << "Invalid socket path: " << options.socket << endl;
+        return false;
     }
+    strcpy(address.sun_path, options.socket.c_str());
 
-    // Create a vector the size of the input image
-    vector<vector<Pixel>> image(height, vector<Pixel> (width));
+    // A socket left behind by a service that is gone can be replaced
+    struct stat file_info;
+    if (stat(options.socket.c_str(), &file_info) == 0 && S_ISSOCK(file_info.st_mode))
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool running = connect(probe, (sockaddr*)&address, sizeof(address)) == 0;
+        close(probe);
+        if (running)
+        {
+            cout << "A service is already listening on " << options.socket << endl;
+            return false;
+        }
+        unlink(options.socket.c_str());
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int wake_pipe[2];
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, 64) != 0 ||
+        pipe2(wake_pipe, O_CLOEXEC) != 0)
+    {
+        cout << "Cannot listen on " << options.socket << ": " << strerror(errno) << endl;
+        if (listen_fd >= 0)
+        {
+            close(listen_fd);
+        }
+        return false;
+    }
+    service_wake_fd = wake_pipe[1];
+    signal(SIGINT, stop_service);
+    signal(SIGTERM, stop_service);
+    signal(SIGPIPE, SIG_IGN);
 
-    int pos = start;
-    // For each row, starting from the last row to the first
-    // Note: BMP files store pixels from bottom to top
-    for (int i = height - 1; i >= 0; i--)
+    int jobs = max(1, options.jobs);
+    BoundedQueue<ServiceRequest> requests(jobs * 4);
+    atomic<long long> served{0};
+    atomic<long long> failed{0};
+    vector<thread> workers;
+    for (int i = 0; i < jobs; i++)
     {
-        // For each column
-        for (int j = 0; j < width; j++)
+        workers.emplace_back([&]() {
+            if (jobs > 1)
+            {
+                ThreadPool::run_serially_on_this_thread();
+            }
+            ServiceRequest request;
+            while (requests.pop(request))
+            {
+                // One request running out of memory must not take the service down
+                string response;
+                try
+                {
+                    response = serve_request(request);
+                }
+                catch (const exception& error)
+                {
+                    response = "{\"id\":" + request.id + ",\"status\":\"error\",\"error\":" +
+                               json_string(string("Request failed: ") + error.what()) + "}";
+                }
+                bool ok = response.find("\"status\":\"ok\"") != string::npos;
+                (ok ? served : failed)++;
+                request.connection->send_line(response);
+                request = ServiceRequest();  // Lets the connection close before the next one comes in
+            }
+        });
+    }
+
+    // Handles one line from a client: a command, or a request for the workers
+    auto handle_line = [&](const shared_ptr<ServiceConnection>& connection, const string& line) {
+        JsonValue message;
+        if (!JsonParser(line).parse(message) || message.type != JsonValue::JSON_OBJECT)
         {
-            // Go to the pixel position
-            stream.seekg(pos);
+            connection->send_line("{\"id\":null,\"status\":\"error\",\"error\":\"Invalid JSON\"}");
+            failed++;
+            return;
+        }
+        const JsonValue* id = message.find("id");
+        string id_text = id ? json_text(*id) : "null";
+        auto reply_error = [&](const string& error) {
+            connection->send_line("{\"id\":" + id_text + ",\"status\":\"error\",\"error\":" + json_string(error) + "}");
+            failed++;
+        };
 
-            // Save the pixel values to the image vector
-            // Note: BMP files store pixels in blue, green, red order
-            image[i][j].blue = stream.get();
-            image[i][j].green = stream.get();
-            image[i][j].red = stream.get();
+        const JsonValue* command = message.find("command");
+        string name = command && command->type == JsonValue::JSON_STRING ? command->text : "process";
+        if (name == "ping")
+        {
+            connection->send_line("{\"id\":" + id_text + ",\"status\":\"ok\"}");
+            return;
+        }
+        if (name == "stats")
+        {
+            ostringstream stats;
+            stats << "{\"id\":" << id_text << ",\"status\":\"ok\",\"served\":" << served.load()
+                  << ",\"failed\":" << failed.load() << ",\"workers\":" << jobs
+                  << ",\"buffer_pool\":{\"reused\":" << buffer_pool().hit_count()
+                  << ",\"allocated\":" << buffer_pool().miss_count() << "}"
+                  << ",\"image_cache\":{\"hits\":" << image_cache().hit_count()
+                  << ",\"misses\":" << image_cache().miss_count() << "}}";
+            connection->send_line(stats.str());
+            return;
+        }
+        if (name == "shutdown")
+        {
+            connection->send_line("{\"id\":" + id_text + ",\"status\":\"ok\"}");
+            stop_service(0);
+            return;
+        }
+        if (name != "process")
+        {
+            reply_error("Unknown command: " + name);
+            return;
+        }
 
-            // We are ignoring the alpha channel if there is one
+        ServiceRequest request;
+        const JsonValue* input = message.find("input");
+        const JsonValue* output = message.find("output");
+        const JsonValue* effects = message.find("effects");
+        if (!input || input->type != JsonValue::JSON_STRING || !output || output->type != JsonValue::JSON_STRING)
+        {
+            reply_error("A request needs \"input\" and \"output\" paths");
+            return;
+        }
+        if (!effects || !chain_from_json(*effects, request.chain) || !parse_pipeline(request.chain, request.steps))
+        {
+            reply_error("Invalid effects: " + (effects ? json_text(*effects) : string("(none)")));
+            return;
+        }
+        request.connection = connection;
+        request.id = id_text;
+        request.input = input->text;
+        request.output = output->text;
+        request.received = chrono::steady_clock::now();
+        requests.push(move(request));
+    };
 
-            // Advance the position to the next pixel
-            pos = pos + (bits_per_pixel / 8);
+    // Readers of open connections; finished ones are joined as new clients come in
+    struct Reader
+    {
+        thread reader;
+        weak_ptr<ServiceConnection> connection;
+        shared_ptr<atomic<bool>> done;
+    };
+    vector<Reader> readers;
+    auto join_finished = [&](bool all) {
+        for (size_t i = 0; i < readers.size();)
+        {
+            if (all || readers[i].done->load())
+            {
+                readers[i].reader.join();
+                readers.erase(readers.begin() + i);
+            }
+            else
+            {
+                i++;
+            }
         }
+    };
 
-        // Skip the padding at the end of each row
-        stream.seekg(padding, ios::cur);
-        pos = pos + padding;
+    cout << "Serving on " << options.socket << " with " << jobs << " worker" << (jobs > 1 ? "s" : "") << endl;
+    while (true)
+    {
+        pollfd waiting[2] = {{listen_fd, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+        if (poll(waiting, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (waiting[1].revents)
+        {
+            break;
+        }
+        int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+        {
+            continue;
+        }
+        join_finished(false);
+        shared_ptr<ServiceConnection> connection = make_shared<ServiceConnection>(client);
+        shared_ptr<atomic<bool>> done = make_shared<atomic<bool>>(false);
+        readers.push_back({thread([&handle_line, connection, done]() {
+                               string pending;
+                               char buffer[65536];
+                               while (true)
+                               {
+                                   ssize_t count = recv(connection->fd, buffer, sizeof(buffer), 0);
+                                   if (count < 0 && errno == EINTR)
+                                   {
+                                       continue;
+                                   }
+                                   if (count <= 0)
+                                   {
+                                       break;
+                                   }
+                                   pending.append(buffer, count);
+                                   size_t start = 0, end;
+                                   while ((end = pending.find('\n', start)) != string::npos)
+                                   {
+                                       string line = pending.substr(start, end - start);
+                                       if (!line.empty() && line.back() == '\r')
+                                       {
+                                           line.pop_back();
+                                       }
+                                       if (line.find_first_not_of(" \t") != string::npos)
+                                       {
+                                           handle_line(connection, line);
+                                       }
+                                       start = end + 1;
+                                   }
+                                   pending.erase(0, start);
+                                   if (pending.size() > (1 << 20))
+                                   {
+                                       connection->send_line(
+                                           "{\"id\":null,\"status\":\"error\",\"error\":\"Request too long\"}");
+                                       break;
+                                   }
+                               }
+                               done->store(true);
+                           }),
+                           connection, done});
     }
 
-    // Close the stream and return the image vector
-    stream.close();
-    return image;
+    // Stop taking requests, finish the ones already taken, then go
+    close(listen_fd);
+    unlink(options.socket.c_str());
+    for (Reader& reader : readers)
+    {
+        if (shared_ptr<ServiceConnection> connection = reader.connection.lock())
+        {
+            shutdown(connection->fd, SHUT_RD);
+        }
+    }
+    join_finished(true);
+    requests.close();
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    service_wake_fd = -1;
+    cout << "Stopped after " << served.load() << " requests (" << failed.load() << " failed)" << endl;
+    return true;
 }
 
 /**
- * Sets a value to the char array starting at the offset using the size
- * specified by the bytes.
- * This is a helper function for write_image()
- * @param arr    Array to set values for
- * @param offset Starting index offset
- * @param bytes  Number of bytes to set
- * @param value  Value to set
- * @return nothing
+ * Sends requests to a running service and prints its responses (--client)
+ * With --effect, --in and --out it sends a request for every image and chain,
+ * named like run_batch() names them, and prints the totals once every response
+ * is in. Otherwise it sends the request lines it reads from standard input.
+ * Requests go out on one thread while responses are read on another, so a
+ * long batch never waits on a full socket.
+ * @param socket_path The service's socket
+ * @param batch       The batch settings, if any
+ * @return True if every request succeeded and false otherwise
  */
-void set_bytes(unsigned char arr[], int offset, int bytes, int value)
+bool run_client(const string& socket_path, const BatchOptions& batch)
 {
-    for (int i = 0; i < bytes; i++)
+    typedef chrono::steady_clock Clock;
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_path.size() >= sizeof(address.sun_path) ||
+        (strcpy(address.sun_path, socket_path.c_str()), connect(fd, (sockaddr*)&address, sizeof(address)) != 0))
     {
-        arr[offset+i] = (unsigned char)(value>>(i*8));
+        cout << "Cannot connect to " << socket_path << endl;
+        close(fd);
+        return false;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // The service may run elsewhere, so batch paths are made absolute
+    vector<string> lines;
+    bool batch_mode = !batch.effects.empty();
+    if (batch_mode)
+    {
+        vector<string> paths;
+        if (!list_batch_inputs(batch.input, paths))
+        {
+            cout << "Cannot read input: " << batch.input << endl;
+            close(fd);
+            return false;
+        }
+        if (mkdir(batch.output.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            cout << "Cannot create output directory: " << batch.output << endl;
+            close(fd);
+            return false;
+        }
+        char directory[PATH_MAX];
+        string here = getcwd(directory, sizeof(directory)) ? string(directory) + "/" : "";
+        auto absolute = [&](const string& path) { return path.empty() || path[0] == '/' ? path : here + path; };
+        for (const string& path : paths)
+        {
+            for (int chain = 0; chain < (int)batch.effects.size(); chain++)
+            {
+                lines.push_back("{\"id\":" + to_string(lines.size() + 1) + ",\"input\":" + json_string(absolute(path)) +
+                                ",\"output\":" +
+                                json_string(absolute(batch_output_name(batch, path, chain, (int)batch.effects.size()))) +
+                                ",\"effects\":" + json_string(batch.effects[chain]) + "}");
+            }
+        }
+    }
+    else
+    {
+        string line;
+        while (getline(cin, line))
+        {
+            if (line.find_first_not_of(" \t\r") != string::npos)
+            {
+                lines.push_back(line);
+            }
+        }
+    }
+
+    Clock::time_point start = Clock::now();
+    thread sender([&]() {
+        for (const string& line : lines)
+        {
+            string message = line + "\n";
+            size_t sent = 0;
+            while (sent < message.size())
+            {
+                ssize_t count = send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+                if (count < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (count <= 0)
+                {
+                    return;
+                }
+                sent += count;
+            }
+        }
+        shutdown(fd, SHUT_WR);
+    });
+
+    int ok = 0, failed = 0;
+    string pending;
+    char buffer[65536];
+    while (true)
+    {
+        ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            break;
+        }
+        pending.append(buffer, count);
+        size_t line_start = 0, end;
+        while ((end = pending.find('\n', line_start)) != string::npos)
+        {
+            string line = pending.substr(line_start, end - line_start);
+            line_start = end + 1;
+            JsonValue response;
+            const JsonValue* status = nullptr;
+            bool succeeded = JsonParser(line).parse(response) && (status = response.find("status")) &&
+                             status->type == JsonValue::JSON_STRING && status->text == "ok";
+            (succeeded ? ok : failed)++;
+            cout << line << endl;
+        }
+        pending.erase(0, line_start);
     }
+    sender.join();
+    close(fd);
+
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+    failed = max(failed, (int)lines.size() - ok);  // Requests left unanswered count as failed
+    if (batch_mode)
+    {
+        cout << fixed << setprecision(2) << ok << " images (" << failed << " failed) in " << seconds << " s: "
+             << ok / max(seconds, 1e-9) << " images/s" << endl;
+    }
+    return failed == 0;
 }
 
+// Benchmark settings, from --bench, --bench-sizes and --bench-out
+struct BenchOptions
+{
+    bool enabled = false;
+    vector<pair<int, int>> sizes;   // Width x height of each synthetic image
+    string output;                  // JSON file (stdout when empty)
+};
+
 /**
- * Write the input image to a BMP file name specified
- * @param filename The BMP file name to save the image to
- * @param image    The input image to save
+ * Parses a list of image sizes such as "256x256,4096x1024"
+ * @param text  The list
+ * @param sizes The parsed sizes
  * @return True if successful and false otherwise
  */
-bool write_image(string filename, const vector<vector<Pixel>>& image)
+bool parse_bench_sizes(const string& text, vector<pair<int, int>>& sizes)
 {
-    // Get the image width and height in pixels
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
-
-    // Calculate the width in bytes incorporating padding (4 byte alignment)
-    int width_bytes = width_pixels * 3;
-    int padding_bytes = 0;
-    padding_bytes = (4 - width_bytes % 4) % 4;
-    width_bytes = width_bytes + padding_bytes;
+    sizes.clear();
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == string::npos)
+        {
+            end = text.size();
+        }
+        int width = 0, height = 0;
+        char separator = 0, extra = 0;
+        string item = text.substr(start, end - start);
+        if (sscanf(item.c_str(), "%d%c%d%c", &width, &separator, &height, &extra) != 3 || separator != 'x' ||
+            width <= 0 || height <= 0)
+        {
+            return false;
+        }
+        sizes.push_back({width, height});
+        start = end + 1;
+    }
+    return !sizes.empty();
+}
 
-    // Pixel array size in bytes, including padding
-    int array_bytes = width_bytes * height_pixels;
+/**
+ * Resets the peak resident set size the kernel reports (VmHWM)
+ */
+void reset_peak_rss()
+{
+    int file = open("/proc/self/clear_refs", O_WRONLY);
+    if (file >= 0)
+    {
+        ssize_t written = write(file, "5", 1);
+        (void)written;
+        close(file);
+    }
+}
 
-    // Open a file stream for writing to a binary file
-    fstream stream;
-    stream.open(filename, ios::out | ios::binary);
+/**
+ * Gets the peak resident set size since the last reset_peak_rss()
+ * @return the peak in MB, or 0 if it is not available
+ */
+double peak_rss_mb()
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            return atof(line.c_str() + 6) / 1024;
+        }
+    }
+    return 0;
+}
 
-    // If there was a problem opening the file, return false
-    if (!stream.is_open())
+/**
+ * Makes a synthetic image of random pixels (the same for every run)
+ * @param width  The image width
+ * @param height The image height
+ * @return the image
+ */
+Image make_bench_image(int width, int height)
+{
+    Image image = make_image(width, height);
+    uint32_t state = 2463534242u;
+    for (int row = 0; row < height; ++row)
     {
-        return false;
+        uint8_t* px = image.row(row);
+        for (int i = 0; i < width * BYTES_PER_PIXEL; i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            px[i] = state >> 24;
+        }
     }
+    return image;
+}
 
-    // Create the BMP and DIB Headers
-    const int BMP_HEADER_SIZE = 14;
-    const int DIB_HEADER_SIZE = 40;
-    unsigned char bmp_header[BMP_HEADER_SIZE] = {0};
-    unsigned char dib_header[DIB_HEADER_SIZE] = {0};
+/**
+ * Times read_image (from the file and from the image cache), write_image (24-bit,
+ * 1-bit and PPM) and all ten effects over synthetic images and writes the
+ * results as JSON
+ * Each case runs until it has taken a quarter of a second (at least once, at
+ * most five times) and reports its median time. Effects that change the image
+ * in place get a fresh copy each run, made outside the timing. Allocations and
+ * peak RSS are counted over the timed runs. Allocations only include pixel
+ * buffers unless the program was built with -DENABLE_ALLOC_COUNT.
+ * @param options The benchmark settings
+ * @return True if successful and false otherwise
+ */
+bool run_benchmarks(const BenchOptions& options)
+{
+    typedef chrono::steady_clock Clock;
+    const char* simd_names[] = {"none", "sse4.1", "avx2"};
+    string scratch = "bench_" + to_string(getpid()) + ".bmp";
 
-    // BMP Header
-    set_bytes(bmp_header,  0, 1, 'B');              // ID field
-    set_bytes(bmp_header,  1, 1, 'M');              // ID field
-    set_bytes(bmp_header,  2, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes); // Size of BMP file
-    set_bytes(bmp_header,  6, 2, 0);                // Reserved
-    set_bytes(bmp_header,  8, 2, 0);                // Reserved
-    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
+    ostringstream json;
+    json << setprecision(6);
+    json << "{\n  \"threads\": " << thread_pool().size() << ",\n  \"simd\": \"" << simd_names[simd_level]
+         << "\",\n  \"mmap\": " << (use_mmap ? "true" : "false") << ",\n  \"heap_allocations_counted\": "
+#ifdef COUNT_HEAP_ALLOCATIONS
+         << "true"
+#else
+         << "false"
+#endif
+         << ",\n  \"results\": [";
+    bool first_result = true;
+    bool ok = true;
 
-    // DIB Header
-    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
-    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
-    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
-    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
-    set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
-    set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
-    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)                     
-    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
-    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+    for (const pair<int, int>& size : options.sizes)
+    {
+        int width = size.first, height = size.second;
+        Image source = make_bench_image(width, height);
+        double pixels = (double)width * height;
 
-    // Write the BMP and DIB Headers to the file
-    stream.write((char*)bmp_header, sizeof(bmp_header));
-    stream.write((char*)dib_header, sizeof(dib_header));
+        // name, setup run before each timed run (untimed), timed run
+        auto bench = [&](const string& name, const function<void()>& setup, const function<bool()>& timed) {
+            vector<double> times;
+            long long allocations = 0, bytes = 0, hits = 0, misses = 0;
+            double peak = 0;
+            double total = 0;
+            while (times.empty() || (total < 0.25 && times.size() < 5))
+            {
+                setup();
+                reset_peak_rss();
+                long long count_before = allocation_count, bytes_before = allocated_bytes;
+                long long hits_before = buffer_pool().hit_count(), misses_before = buffer_pool().miss_count();
+                Clock::time_point start = Clock::now();
+                ok = timed() && ok;
+                double seconds = chrono::duration<double>(Clock::now() - start).count();
+                allocations = allocation_count - count_before;
+                bytes = allocated_bytes - bytes_before;
+                hits = buffer_pool().hit_count() - hits_before;
+                misses = buffer_pool().miss_count() - misses_before;
+                peak = max(peak, peak_rss_mb());
+                times.push_back(seconds);
+                total += seconds;
+            }
+            sort(times.begin(), times.end());
+            double median = times[times.size() / 2];
+            cerr << name << " " << width << "x" << height << ": " << median * 1e9 / pixels << " ns/px" << endl;
+            json << (first_result ? "\n" : ",\n") << "    {\"name\": \"" << name << "\", \"width\": " << width
+                 << ", \"height\": " << height << ", \"runs\": " << times.size() << ", \"seconds\": " << median
+                 << ", \"ns_per_pixel\": " << median * 1e9 / pixels
+                 << ", \"mb_per_s\": " << pixels * BYTES_PER_PIXEL / 1e6 / median
+                 << ", \"allocations\": " << allocations << ", \"allocated_mb\": " << bytes / 1e6
+                 << ", \"pool_hits\": " << hits << ", \"pool_misses\": " << misses
+                 << ", \"peak_rss_mb\": " << peak << "}";
+            first_result = false;
+        };
 
-    // Initialize pixel and padding
-    unsigned char pixel[3] = {0};
-    unsigned char padding[3] = {0};
+        Image image;
+        Image result;
+        // A copy shares the source's pixels until it is written to, so write to it here, before the timing
+        auto fresh = [&]() { result = Image(); image = source; image.row(0); };
+        auto nothing = [&]() { result = Image(); image = Image(); };
 
-    // Pixel Array (Left to right, bottom to top, with padding)
-    for (int h = height_pixels - 1; h >= 0; h--)
-    {
-        for (int w = 0; w < width_pixels; w++)
-        {
-            // Write the pixel (Blue, Green, Red)
-            pixel[0] = image[h][w].blue;
-            pixel[1] = image[h][w].green;
-            pixel[2] = image[h][w].red;
-            stream.write((char*)pixel, 3);
-        }
-        // Write the padding bytes
-        stream.write((char *)padding, padding_bytes);
+        bench("write_image", nothing, [&]() { return save_image(scratch, source); });
+        bench("read_image", nothing, [&]() { result = decode_image(scratch); return !result.empty(); });
+        // The cache leaves out files written within the last second, so date this one back
+        timespec times[2] = {{0, UTIME_OMIT}, {time(nullptr) - 60, 0}};
+        utimensat(AT_FDCWD, scratch.c_str(), times, 0);
+        load_image(scratch);
+        bench("read_image_cached", nothing, [&]() { result = load_image(scratch); return !result.empty(); });
+        // Indexed and PPM output
+        Image contrast = source;
+        apply_point_effect({HIGH_CONTRAST, 0}, contrast);
+        Palette black_white = chain_palette({{EFFECT_STEP, {HIGH_CONTRAST, 0}, 0, 1, 1, NEAREST}});
+        bench("write_image_1bit", nothing, [&]() { return save_image(scratch, contrast, black_white); });
+        bench("read_image_1bit", nothing, [&]() { result = decode_image(scratch); return !result.empty(); });
+        remove(scratch.c_str());
+        string scratch_ppm = scratch.substr(0, scratch.size() - 4) + ".ppm";
+        bench("write_ppm", nothing, [&]() { return save_image(scratch_ppm, source); });
+        remove(scratch_ppm.c_str());
+        bench("vignette", fresh, [&]() { applyVignetteEffect(image); return true; });
+        bench("clarendon", fresh, [&]() { apply_point_effect({CLARENDON, 0.5}, image); return true; });
+        bench("grayscale", fresh, [&]() { apply_point_effect({GRAYSCALE, 0}, image); return true; });
+        bench("rotate_90", fresh, [&]() { rotate_image(image, 1); return true; });
+        bench("rotate_180", fresh, [&]() { rotate_image(image, 2); return true; });
+        bench("enlarge_2x2", nothing, [&]() { result = process_6(source, 2, 2); return !result.empty(); });
+        bench("high_contrast", fresh, [&]() { apply_point_effect({HIGH_CONTRAST, 0}, image); return true; });
+        bench("lighten", fresh, [&]() { apply_point_effect({LIGHTEN, 0.5}, image); return true; });
+        bench("darken", fresh, [&]() { apply_point_effect({DARKEN, 0.5}, image); return true; });
+        bench("five_color", fresh, [&]() { apply_point_effect({FIVE_COLOR, 0}, image); return true; });
     }
+    json << "\n  ]\n}\n";
 
-    // Close the stream and return true
-    stream.close();
-    return true;
+    if (options.output.empty())
+    {
+        cout << json.str();
+        return ok;
+    }
+    ofstream file(options.output);
+    file << json.str();
+    return ok && file.good();
 }
 
-//***************************************************************************************************//
-//                                DO NOT MODIFY THE SECTION ABOVE                                    //
-//***************************************************************************************************//
+// Verification settings, from --verify and --verify-dir
+struct VerifyOptions
+{
+    bool enabled = false;
+    string directory = "sample_images";  // BMP files checked besides the random images
+};
 
+// Differences between an image and its reference
+struct ImageDifference
+{
+    long long pixels = 0;       // Pixels with any channel off
+    int max_error = 0;          // Largest difference in a channel
+    bool size_mismatch = false;
+};
 
-// Quick terminal command
-// g++ -std=c++11 -o test main.cpp (change test to whatever you wanna call it)
+/**
+ * Compares an image with its reference pixel by pixel
+ * @param image     The image
+ * @param reference The reference image
+ * @return the differences
+ */
+ImageDifference compare_images(const Image& image, const Image& reference)
+{
+    ImageDifference difference;
+    if (image.width != reference.width || image.height != reference.height)
+    {
+        difference.size_mismatch = true;
+        return difference;
+    }
+    for (int row = 0; row < image.height; ++row)
+    {
+        const uint8_t* a = image.row(row);
+        const uint8_t* b = reference.row(row);
+        for (int col = 0; col < image.width; ++col, a += BYTES_PER_PIXEL, b += BYTES_PER_PIXEL)
+        {
+            int error = 0;
+            for (int c = 0; c < BYTES_PER_PIXEL; ++c)
+            {
+                error = max(error, abs(a[c] - b[c]));
+            }
+            difference.pixels += error != 0;
+            difference.max_error = max(difference.max_error, error);
+        }
+    }
+    return difference;
+}
 
 /**
- * Process 1: Applies a vignette effect to the specified image
- * @param image The Vector Image
+ * Reference for process 1: the vignette worked out for every pixel in double,
+ * the way the effect was first written
+ * @param image The Image
  */
-void applyVignetteEffect(vector<vector<Pixel>>& image) {
-    int height = image.size();
-    int width = image[0].size();
+void reference_vignette(Image& image) {
+    int height = image.height;
+    int width = image.width;
     double centerX = width / 2.0;
     double centerY = height / 2.0;
 
     for (int row = 0; row < height; ++row) {
-        for (int col = 0; col < width; ++col) {
+        uint8_t* px = image.row(row);
+        for (int col = 0; col < width; ++col, px += BYTES_PER_PIXEL) {
             double distance = sqrt(pow(col - centerX, 2) + pow(row - centerY, 2));
             double scaling_factor = (height - distance) / height;
-            image[row][col].red = image[row][col].red * scaling_factor;
-            image[row][col].green = image[row][col].green * scaling_factor;
-            image[row][col].blue =image[row][col].blue * scaling_factor;
+            px[RED] = saturate_channel(px[RED] * scaling_factor);
+            px[GREEN] = saturate_channel(px[GREEN] * scaling_factor);
+            px[BLUE] = saturate_channel(px[BLUE] * scaling_factor);
         }
     }
 }
-/**
- * Process 2: Applies a clarendon effect to the specified image
- * @param image The Vector Image
- * @param scaling_factor a double value you'd like to apply to the effect
- */
-void applyClarendonEffect(vector<vector<Pixel>>& image, double scaling_factor) {
-    int height = image.size();
-    int width = image[0].size();
-
-    for (int row = 0; row < height; ++row) {
-        for (int col = 0; col < width; ++col) {
-            double average = (image[row][col].red + image[row][col].green + image[row][col].blue)/3;
-//             If cell is light, make it lighter
-            if(average >= 170)
-            {
-                image[row][col].red = (225 - (225 - image[row][col].red) * scaling_factor);
-                image[row][col].green = (225 - (225 - image[row][col].green) * scaling_factor);
-                image[row][col].blue = (225 - (225 - image[row][col].blue) * scaling_factor);
-            
-            } else if(average < 90)
-            {
-                image[row][col].red = image[row][col].red * scaling_factor;
-                image[row][col].green = image[row][col].green* scaling_factor;
-                image[row][col].blue = image[row][col].blue * scaling_factor;
-            } else {
-                image[row][col].red = image[row][col].red;
-                image[row][col].green = image[row][col].green;
-                image[row][col].blue = image[row][col].blue;
-            }
 
-    }
-}
-}
 /**
- * Process 3: Applies a grayscale effect to the specified image
- * @param image The Vector Image
+ * Reference for processes 4 and 5: one quarter turn at a time, pixel by pixel
+ * @param image     The Image
+ * @param rotations The number of 90 degree rotations (negative turns counterclockwise)
+ * @return the rotated image
  */
-void applyGrayscaleEffect(vector<vector<Pixel>>& image) {
-    int height = image.size();
-    int width = image[0].size();
-
-        for (int row = 0; row < height; ++row) {
-            for (int col = 0; col < width; ++col) {
-                double average = (image[row][col].red + image[row][col].green + image[row][col].blue)/3;
-                image[row][col].red = average;
-                image[row][col].green = average;
-                image[row][col].blue = average;
+Image reference_rotation(const Image& image, int rotations) {
+    Image rotated = image;
+    for (int i = 0; i < quarter_turns(rotations); ++i) {
+        Image turned = make_image(rotated.height, rotated.width);
+        for (int row = 0; row < rotated.height; ++row) {
+            for (int col = 0; col < rotated.width; ++col) {
+                const uint8_t* src = rotated.row(row) + col * BYTES_PER_PIXEL;
+                uint8_t* dst = turned.row(col) + (rotated.height - 1 - row) * BYTES_PER_PIXEL;
+                memcpy(dst, src, BYTES_PER_PIXEL);
             }
         }
+        rotated = turned;
+    }
+    return rotated;
 }
+
 /**
- * Process 4: Rotates the specified image 90 degrees
- * @param image The Vector Image
- * @param rotations The number of rotations
+ * Reference for process 6: every output pixel looked up on its own
+ * @param image   The Image
+ * @param x_scale The x scale
+ * @param y_scale The y scale
+ * @return the enlarged image
  */
-vector<vector<Pixel>> apply90Rotation(vector<vector<Pixel>>& image, int rotations) {
-    int actual_rotations = rotations % 4;
-    vector<vector<Pixel>> rotatedImage = image; // Start with the original image
-
-    for (int i = 0; i < actual_rotations; ++i) {
-        int height = rotatedImage.size();
-        int width = rotatedImage[0].size();
-        vector<vector<Pixel>> tempImage(width, vector<Pixel>(height));
-
-        for (int row = 0; row < height; ++row) {
-            for (int col = 0; col < width; ++col) {
-                int newRow = col;
-                int newCol = height - 1 - row;
-                tempImage[newRow][newCol] = rotatedImage[row][col];
-            }
+Image reference_enlarge(const Image& image, int x_scale, int y_scale) {
+    Image enlarged = make_image(image.width * x_scale, image.height * y_scale);
+    for (int row = 0; row < enlarged.height; ++row) {
+        for (int col = 0; col < enlarged.width; ++col) {
+            memcpy(enlarged.row(row) + col * BYTES_PER_PIXEL,
+                   image.row(row / y_scale) + (col / x_scale) * BYTES_PER_PIXEL, BYTES_PER_PIXEL);
         }
-        
-        rotatedImage = tempImage;
     }
-
-    return rotatedImage;
+    return enlarged;
 }
+
 /**
- * Process 6: Enlarges the image in the x and y direction
- * @param x_scale The x scale direction
- * @param y_scale The y scale direction
+ * Runs a chain of effects with the reference implementations, one step and
+ * one row at a time, with no tables, SIMD or threads
+ * Only whole-number nearest neighbor resizes have a reference.
+ * @param image The Image, replaced by the result
+ * @param steps The steps, in order
+ * @return True if successful and false if a step has no reference
  */
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale){
-    int height = image.size();
-    int width = image[0].size();
-    int newHeight = height * y_scale;
-    int newWidth = width * x_scale;
-
-    vector<vector<Pixel>> newImage(newHeight, vector<Pixel>(newWidth));
-
-    for (int row = 0; row < newHeight; ++row) {
-        for (int col = 0; col < newWidth; ++col) {
-            int origRow = row / y_scale;
-            int origCol = col / x_scale;
-            newImage[row][col] = image[origRow][origCol];
+bool reference_pipeline(Image& image, const vector<PipelineStep>& steps)
+{
+    for (const PipelineStep& step : steps)
+    {
+        switch (step.type)
+        {
+        case EFFECT_STEP:
+            for (int row = 0; row < image.height; ++row)
+            {
+                apply_point_effect_row(step.effect, image.row(row), image.width);
+            }
+            break;
+        case VIGNETTE_STEP:
+            reference_vignette(image);
+            break;
+        case ROTATE_STEP:
+            image = reference_rotation(image, step.rotations);
+            break;
+        case RESIZE_STEP:
+            if (step.filter != NEAREST || step.x_scale != (int)step.x_scale || step.y_scale != (int)step.y_scale ||
+                step.x_scale < 1 || step.y_scale < 1)
+            {
+                return false;
+            }
+            image = reference_enlarge(image, (int)step.x_scale, (int)step.y_scale);
+            break;
         }
     }
-    return newImage;
-
+    return true;
 }
+
 /**
- * Process 7: Convert image to high contrast (black and white only)
- * @param image The Vector Image
+ * Checks every fast path (SIMD kernels, tone tables, vignette tables, threads,
+ * streaming, the fused pipeline, BMP reading and writing) against the
+ * reference implementations, pixel by pixel
+ * Runs over the BMP files in options.directory and random images of awkward
+ * sizes, and prints the differing pixels and largest channel error per check.
+ * @param options The verification settings
+ * @return True if everything matched and false otherwise
  */
-void process_7(vector<vector<Pixel>>& image){
-    int height = image.size();
-    int width = image[0].size();
-
-    for (int row = 0; row < height; ++row) {
-        for (int col = 0; col < width; ++col) {
-            // Grey value
-            double average = (image[row][col].red + image[row][col].green + image[row][col].blue)/3;
+bool run_verification(const VerifyOptions& options)
+{
+    // Each effect on its own, then chains that exercise fusing and remapping
+    const char* specs[] = {
+        "vignette", "clarendon:0.5", "clarendon:0.3", "clarendon:1.5", "grayscale",
+        "rotate:1", "rotate:2", "rotate:3", "rotate:-1", "enlarge:2:3", "enlarge:3:3", "enlarge:4:1", "enlarge:5:2",
+        "high_contrast", "lighten:0.5", "lighten:0.37", "darken:0.5", "darken:0.37", "five_color",
+        "grayscale,lighten:0.5,vignette", "clarendon:0.5,rotate:1,darken:0.25",
+        "enlarge:2:2,vignette,five_color", "rotate:3,high_contrast,enlarge:3:1,lighten:0.2",
+        "vignette,rotate:2,vignette", "darken:0.8,clarendon:0.7,high_contrast,rotate:1,enlarge:1:2",
+        "vignette,rotate:3", "rotate:1,rotate:3", "enlarge:2:1,enlarge:1:2", "rotate:1,enlarge:2:2"};
+    const char* resize_specs[] = {
+        "resize:0.37:0.61:bilinear", "resize:2.5:1.3:bilinear", "resize:0.3:0.45:box", "resize:1.6:0.7:nearest",
+        "rotate:1,resize:1.7:0.45:bilinear,vignette,resize:0.5:0.5:box,rotate:3"};
+    const char* simd_names[] = {"none", "sse4.1", "avx2"};
 
-            if(average >= 255/2){
-                image[row][col].red = 255;
-                image[row][col].green = 255;
-                image[row][col].blue = 255;
-            } else{
-                image[row][col].red = 0;
-                image[row][col].green = 0;
-                image[row][col].blue = 0;
+    vector<pair<string, Image>> images;
+    vector<string> paths;
+    if (list_batch_inputs(options.directory, paths))
+    {
+        for (const string& path : paths)
+        {
+            Image image = read_image(path);
+            if (!image.empty())
+            {
+                images.push_back({path, image});
             }
         }
     }
-}
-/**
- * Process 8: Lightens image by a scaling factor
- * @param image The Vector Image
- * @param scaling_factor The scaling factor
- */
-void process_8(vector<vector<Pixel>>& image, double scaling_factor){
-    int height = image.size();
-    int width = image[0].size();
+    // Odd widths leave row padding, and very wide images drive the vignette negative
+    const pair<int, int> sizes[] = {{1, 1}, {2, 3}, {7, 5}, {33, 17}, {301, 17}, {17, 301}, {1500, 40}, {640, 480}};
+    for (const pair<int, int>& size : sizes)
+    {
+        images.push_back({"random " + to_string(size.first) + "x" + to_string(size.second),
+                          make_bench_image(size.first, size.second)});
+    }
 
-    for (int row = 0; row < height; ++row) {
-        for (int col = 0; col < width; ++col) {
+    // Totals per check, in the order they were first seen
+    vector<pair<string, ImageDifference>> totals;
+    vector<string> failures;
+    auto record = [&](const string& check, const string& image_name, const Image& image, const Image& reference) {
+        ImageDifference difference = compare_images(image, reference);
+        size_t i = 0;
+        while (i < totals.size() && totals[i].first != check)
+        {
+            i++;
+        }
+        if (i == totals.size())
+        {
+            totals.push_back({check, ImageDifference()});
+        }
+        ImageDifference& total = totals[i].second;
+        total.pixels += difference.pixels;
+        total.max_error = max(total.max_error, difference.max_error);
+        total.size_mismatch = total.size_mismatch || difference.size_mismatch;
+        if (difference.pixels != 0 || difference.size_mismatch)
+        {
+            failures.push_back(check + " on " + image_name);
+        }
+    };
+
+    string scratch = "verify_" + to_string(getpid()) + ".bmp";
+    string scratch_out = "verify_" + to_string(getpid()) + "_out.bmp";
+    string scratch_indexed = "verify_" + to_string(getpid()) + "_indexed.bmp";
+    string scratch_ppm = "verify_" + to_string(getpid()) + ".ppm";
+    string scratch_pgm = "verify_" + to_string(getpid()) + ".pgm";
+    SimdLevel saved_level = simd_level;
+    bool ok = true;
 
-            image[row][col].red = (255 - (255 - image[row][col].red) * scaling_factor);
-            image[row][col].green = (255 - (255 - image[row][col].green) * scaling_factor);
-            image[row][col].blue = (255 - (255 - image[row][col].blue) * scaling_factor);
+    for (const pair<string, Image>& named : images)
+    {
+        const string& name = named.first;
+        const Image& source = named.second;
+
+        // Reading and writing, through streams and mapped files
+        if (save_image(scratch, source))
+        {
+            record("write + read_image", name, read_image(scratch), source);
+            record("write + map_image", name, map_image(scratch), source);
+        }
+        else
+        {
+            ok = false;
+        }
+        if (write_netpbm_image(scratch_ppm, source))
+        {
+            record("write + read PPM", name, read_image(scratch_ppm), source);
+        }
+        else
+        {
+            ok = false;
         }
-    }
-}
-/**
- * Process 9: Darkens image by a scaling factor
- * @param image The Vector Image
- * @param scaling_factor The scaling factor
- */
-void process_9(vector<vector<Pixel>>& image, double scaling_factor){
-    int height = image.size();
-    int width = image[0].size();
 
-    for (int row = 0; row < height; ++row) {
-        for (int col = 0; col < width; ++col) {
+        // Indexed BMPs at every depth and compression the effect's colors fit in
+        const char* indexed_specs[] = {"high_contrast", "five_color", "grayscale"};
+        for (const char* spec : indexed_specs)
+        {
+            vector<PipelineStep> steps;
+            parse_pipeline(spec, steps);
+            Image quantized = source;
+            run_pipeline(quantized, steps);
+            Palette palette = chain_palette(steps);
+            for (int bits = 1; bits <= 8; bits *= 2)
+            {
+                for (int rle = RLE_NEVER; rle <= RLE_ALWAYS; rle += RLE_ALWAYS)
+                {
+                    if (bits == 2 || palette.size() > (1u << bits) || (bits == 1 && rle == RLE_ALWAYS))
+                    {
+                        continue;
+                    }
+                    string check = string(spec) + " [" + to_string(bits) + "-bit" + (rle ? " RLE" : "") + "]";
+                    if (write_indexed_image(scratch_indexed, quantized, palette, bits, (RleMode)rle))
+                    {
+                        record(check, name, read_image(scratch_indexed), quantized);
+                    }
+                    else
+                    {
+                        failures.push_back(check + " on " + name + ": not written");
+                    }
+                }
+            }
+            if (string(spec) == "grayscale" && write_netpbm_image(scratch_pgm, quantized))
+            {
+                record("grayscale [PGM]", name, read_image(scratch_pgm), quantized);
+            }
+        }
 
-            image[row][col].red *= scaling_factor;
-            image[row][col].green *= scaling_factor;
-            image[row][col].blue *= scaling_factor;
+        // Streamed with tiny tiles and budget, so images span many tiles and bands and get evicted
+        StreamOptions tiny;
+        tiny.budget = 16 << 10;
+        tiny.tile_size = 7;
+        auto check_stream = [&](const string& spec, const vector<PipelineStep>& steps, const Image& expected) {
+            if (stream_pipeline(scratch, scratch_out, steps, tiny))
+            {
+                record(spec + " [stream]", name, read_image(scratch_out), expected);
+            }
+            else
+            {
+                ok = false;
+            }
+        };
+        // Filtered and fractional resizes have no reference, so streaming is checked against run_pipeline
+        for (const char* spec : resize_specs)
+        {
+            vector<PipelineStep> steps;
+            parse_pipeline(spec, steps);
+            Image expected = source;
+            run_pipeline(expected, steps);
+            check_stream(spec, steps, expected);
         }
-    }
-}
-/**
- * Process 10: Converts image to only black, white, red, blue, and green
- * @param image The Vector Image
- */
-void process_10(vector<vector<Pixel>>& image){
-    int height = image.size();
-    int width = image[0].size();
 
-    for (int row = 0; row < height; ++row) {
-        for (int col = 0; col < width; ++col) {
-            double maximum = image[row][col].red;
+        for (const char* spec : specs)
+        {
+            vector<PipelineStep> steps;
+            Image reference = source;
+            if (!parse_pipeline(spec, steps) || !reference_pipeline(reference, steps))
+            {
+                cout << "No reference for " << spec << endl;
+                ok = false;
+                continue;
+            }
 
-            if(image[row][col].blue > maximum){
-                maximum = image[row][col].blue;
+            Image image = source;
+            run_pipeline(image, steps);
+            record(string(spec) + " [pipeline]", name, image, reference);
+            // Every color the chain leaves must be in its palette
+            Palette palette = chain_palette(steps);
+            if (!palette.empty() && write_indexed_image(scratch_indexed, image, palette))
+            {
+                record(string(spec) + " [indexed]", name, read_image(scratch_indexed), reference);
+            }
+            else if (!palette.empty())
+            {
+                failures.push_back(string(spec) + " [indexed] on " + name + ": color outside the palette");
             }
-            if(image[row][col].green > maximum){
-                maximum = image[row][col].green;
+            check_stream(spec, steps, reference);
+            if (steps.size() != 1)
+            {
+                continue;
             }
 
-            if(image[row][col].red + image[row][col].blue + image[row][col].green >= 550){
-                image[row][col].red = 255;
-                image[row][col].blue = 255;
-                image[row][col].green = 255;
-            } else if(image[row][col].red + image[row][col].blue + image[row][col].green <= 150) {
-                image[row][col].red = 0;
-                image[row][col].blue = 0;
-                image[row][col].green = 0;
-            } else if(maximum == image[row][col].red){
-                image[row][col].red = 255;
-                image[row][col].blue = 0;
-                image[row][col].green = 0;
-            } else if(maximum == image[row][col].green){
-                image[row][col].red = 0;
-                image[row][col].blue = 0;
-                image[row][col].green = 255;
-            } else {
-                image[row][col].red = 0;
-                image[row][col].blue = 255;
-                image[row][col].green = 0;
+            const PipelineStep& step = steps[0];
+            switch (step.type)
+            {
+            case EFFECT_STEP:
+                for (int level = SIMD_NONE; level <= detect_simd_level(); level++)
+                {
+                    simd_level = (SimdLevel)level;
+                    image = source;
+                    apply_point_effect(step.effect, image);
+                    record(string(spec) + " [" + simd_names[level] + "]", name, image, reference);
+                }
+                simd_level = saved_level;
+                break;
+            case VIGNETTE_STEP:
+                image = source;
+                applyVignetteEffect(image);
+                record(spec, name, image, reference);
+                break;
+            case ROTATE_STEP:
+                image = source;
+                rotate_image(image, step.rotations);
+                record(string(spec) + " [in place]", name, image, reference);
+                record(string(spec) + " [copy]", name, apply90Rotation(source, step.rotations), reference);
+                break;
+            case RESIZE_STEP:
+            {
+                int x_scale = (int)step.x_scale, y_scale = (int)step.y_scale;
+                record(spec, name, process_6(source, x_scale, y_scale), reference);
+                break;
+            }
             }
         }
     }
-}
+    remove(scratch.c_str());
+    remove(scratch_out.c_str());
+    remove(scratch_indexed.c_str());
+    remove(scratch_ppm.c_str());
+    remove(scratch_pgm.c_str());
 
+    size_t name_width = 0;
+    for (const pair<string, ImageDifference>& total : totals)
+    {
+        name_width = max(name_width, total.first.size());
+    }
+    cout << images.size() << " images (" << images.size() - sizeof(sizes) / sizeof(sizes[0]) << " from "
+         << options.directory << ")" << endl;
+    for (const pair<string, ImageDifference>& total : totals)
+    {
+        cout << left << setw(name_width) << total.first << right;
+        if (total.second.size_mismatch)
+        {
+            cout << " wrong size" << endl;
+            continue;
+        }
+        cout << setw(10) << total.second.pixels << " differing pixels, max error " << total.second.max_error << endl;
+    }
+    for (const string& failure : failures)
+    {
+        cout << "FAILED: " << failure << endl;
+    }
+    cout << (ok && failures.empty() ? "All checks match the reference" : "Some checks failed") << endl;
+    return ok && failures.empty();
+}
 
-int main()
+int main(int argc, char* argv[])
 {
+    BatchOptions batch;
+    BenchOptions bench;
+    VerifyOptions verify;
+    ServiceOptions service;
+    string client_socket;
+    bench.sizes = {{256, 256}, {1024, 1024}, {4096, 4096}, {4096, 1024}, {1024, 4096}, {16384, 16384}};
+    for (int i = 1; i < argc; i++)
+    {
+        if (string(argv[i]) == "--mmap")
+        {
+            use_mmap = true;
+        }
+        else if (string(argv[i]) == "--stream")
+        {
+            use_stream = true;
+        }
+        else if (string(argv[i]) == "--bmp24")
+        {
+            use_bmp24 = true;
+        }
+        else if (string(argv[i]) == "--no-simd")
+        {
+            simd_level = SIMD_NONE;
+        }
+        else if (string(argv[i]) == "--threads" && i + 1 < argc)
+        {
+            thread_count = atoi(argv[++i]);
+        }
+        else if (string(argv[i]) == "--effect" && i + 1 < argc)
+        {
+            batch.effects.push_back(argv[++i]);
+        }
+        else if (string(argv[i]) == "--in" && i + 1 < argc)
+        {
+            batch.input = argv[++i];
+        }
+        else if (string(argv[i]) == "--out" && i + 1 < argc)
+        {
+            batch.output = argv[++i];
+        }
+        else if (string(argv[i]) == "--jobs" && i + 1 < argc)
+        {
+            batch.jobs = atoi(argv[++i]);
+        }
+        else if (string(argv[i]) == "--async-io")
+        {
+            batch.async_io = true;
+        }
+        else if (string(argv[i]) == "--io-depth" && i + 1 < argc)
+        {
+            batch.async_io = true;
+            batch.io_depth = atoi(argv[++i]);
+        }
+        else if (string(argv[i]) == "--no-uring")
+        {
+            batch.uring = false;
+        }
+        else if (string(argv[i]) == "--cache-mb" && i + 1 < argc)
+        {
+            image_cache().set_budget((size_t)max(0, atoi(argv[++i])) << 20);
+        }
+        else if (string(argv[i]) == "--stream-mb" && i + 1 < argc)
+        {
+            stream_options.budget = (size_t)max(1, atoi(argv[++i])) << 20;
+        }
+        else if (string(argv[i]) == "--bench")
+        {
+            bench.enabled = true;
+        }
+        else if (string(argv[i]) == "--bench-sizes" && i + 1 < argc)
+        {
+            bench.enabled = true;
+            if (!parse_bench_sizes(argv[++i], bench.sizes))
+            {
+                cout << "Invalid sizes: " << argv[i] << " (expected e.g. 256x256,4096x1024)" << endl;
+                return 1;
+            }
+        }
+        else if (string(argv[i]) == "--bench-out" && i + 1 < argc)
+        {
+            bench.enabled = true;
+            bench.output = argv[++i];
+        }
+        else if (string(argv[i]) == "--trace" && i + 1 < argc)
+        {
+#ifdef ENABLE_TRACE
+            start_trace(argv[++i]);
+#else
+            cerr << "Ignoring --trace " << argv[++i] << ": built without -DENABLE_TRACE" << endl;
+#endif
+        }
+        else if (string(argv[i]) == "--verify")
+        {
+            verify.enabled = true;
+        }
+        else if (string(argv[i]) == "--verify-dir" && i + 1 < argc)
+        {
+            verify.enabled = true;
+            verify.directory = argv[++i];
+        }
+        else if (string(argv[i]) == "--serve" && i + 1 < argc)
+        {
+            service.socket = argv[++i];
+        }
+        else if (string(argv[i]) == "--client" && i + 1 < argc)
+        {
+            client_socket = argv[++i];
+        }
+    }
+
+    if (bench.enabled)
+    {
+        return run_benchmarks(bench) ? 0 : 1;
+    }
+    if (verify.enabled)
+    {
+        return run_verification(verify) ? 0 : 1;
+    }
+
+    if (!service.socket.empty())
+    {
+        service.jobs = batch.jobs;
+        return run_service(service) ? 0 : 1;
+    }
+    if (!client_socket.empty())
+    {
+        if (!batch.effects.empty() && (batch.input.empty() || batch.output.empty()))
+        {
+            cout << "A batch through the service needs --effect, --in and --out" << endl;
+            return 1;
+        }
+        return run_client(client_socket, batch) ? 0 : 1;
+    }
+
+    // Batch mode skips the menu
+    if (!batch.effects.empty() || !batch.input.empty() || !batch.output.empty())
+    {
+        if (batch.effects.empty() || batch.input.empty() || batch.output.empty())
+        {
+            cout << "Batch mode needs --effect, --in and --out" << endl;
+            return 1;
+        }
+        return run_batch(batch) ? 0 : 1;
+    }
 
     string filename;
     cout << "**********************************************" << endl;
@@ -491,6 +9375,8 @@ int main()
         cout << "8) Lighten" << endl;
         cout << "9) Darken" << endl;
         cout << "10) Black, white, red, green, blue" << endl;
+        cout << "11) Resize" << endl;
+        cout << "12) Chain effects" << endl;
         cout << endl;
         cout << "Enter menu selection (Q to quit): ";
         cin >> input;
@@ -520,12 +9406,25 @@ int main()
             string outputname;
             cout << "Enter output BMP filename: ";
             cin >> outputname;
-            // Get image
-            vector<vector<Pixel>> image = read_image(filename);
-            // Apply effect
-            applyVignetteEffect(image);
-             // Save
-            write_image(outputname, image);
+            bool ok;
+            if (use_stream)
+            {
+                ok = stream_pipeline(filename, outputname, {{VIGNETTE_STEP, {GRAYSCALE, 0}, 0, 1, 1, NEAREST}});
+            }
+            else
+            {
+                // Get image
+                Image image = load_image_for_output(filename, outputname);
+                // Apply effect
+                applyVignetteEffect(image);
+                 // Save
+                ok = save_image(outputname, image);
+            }
+            if (!ok)
+            {
+                cout << endl << "Could not apply vignette!" << endl << endl;
+                break;
+            }
             cout << endl;
             cout << "Successfully applied vignette!" << endl << endl;
             break;
@@ -540,11 +9439,13 @@ int main()
             cin >> outputname;
             cout << "Enter scaling factor: ";
             cin >> scaling;
-            // Get image 
-            vector<vector<Pixel>> image = read_image(filename);
-            applyClarendonEffect(image, scaling);
-            // Save
-            write_image(outputname, image);
+            // Apply effect and save
+            bool ok = run_point_effect(filename, outputname, {CLARENDON, scaling});
+            if (!ok)
+            {
+                cout << endl << "Could not apply Clarendon!" << endl << endl;
+                break;
+            }
             cout << endl;
             cout << "Successfully applied Clarendon!" << endl << endl;
             break;
@@ -556,12 +9457,13 @@ int main()
             string outputname;
             cout << "Enter output BMP filename: ";
             cin >> outputname;
-            // Get image
-            vector<vector<Pixel>> image = read_image(filename);
-            // Apply effect
-            applyGrayscaleEffect(image);
-             // Save
-            write_image(outputname, image);
+            // Apply effect and save
+            bool ok = run_point_effect(filename, outputname, {GRAYSCALE, 0});
+            if (!ok)
+            {
+                cout << endl << "Could not apply grayscale!" << endl << endl;
+                break;
+            }
             cout << endl;
             cout << "Successfully applied grayscale!" << endl << endl;
             }
@@ -573,10 +9475,24 @@ int main()
             string outputname;
             cout << "Enter output BMP filename: ";
             cin >> outputname;
-            // Get image
-            vector<vector<Pixel>> image = read_image(filename);
-            // Apply effect
-            write_image(outputname, apply90Rotation(image,1));
+            bool ok;
+            if (use_stream)
+            {
+                ok = stream_pipeline(filename, outputname, {{ROTATE_STEP, {GRAYSCALE, 0}, 1, 1, 1, NEAREST}});
+            }
+            else
+            {
+                // Get image
+                Image image = load_image(filename);
+                // Apply effect
+                rotate_image(image, 1);
+                ok = save_image(outputname, image);
+            }
+            if (!ok)
+            {
+                cout << endl << "Could not apply 90 degree rotation!" << endl << endl;
+                break;
+            }
             cout << "Successfully applied 90 degree rotation!" << endl << endl;
             break;
             }
@@ -592,10 +9508,24 @@ int main()
             cout << endl;
             cout << "Enter number of 90 degree rotations: ";
             cin >> rotation_num;
-            // Get image
-            vector<vector<Pixel>> image = read_image(filename);
-            // Apply effect
-            write_image(outputname, apply90Rotation(image,rotation_num));
+            bool ok;
+            if (use_stream)
+            {
+                ok = stream_pipeline(filename, outputname, {{ROTATE_STEP, {GRAYSCALE, 0}, rotation_num, 1, 1, NEAREST}});
+            }
+            else
+            {
+                // Get image
+                Image image = load_image(filename);
+                // Apply effect (180 degrees is done in place)
+                rotate_image(image, rotation_num);
+                ok = save_image(outputname, image);
+            }
+            if (!ok)
+            {
+                cout << endl << "Could not apply multiple 90 degree rotations!" << endl << endl;
+                break;
+            }
             cout << endl;
             cout << "Successfully applied multiple 90 degree rotations!";
             break;
@@ -616,10 +9546,30 @@ int main()
             cout << endl;
             cout << "Enter Y scale: ";
             cin >> y_val;
-            // Get image
-            vector<vector<Pixel>> image = read_image(filename);
-            // Run effect
-            write_image(outputname, process_6(image,x_val,y_val));
+            bool ok;
+            if (use_stream)
+            {
+                ok = x_val > 0 && y_val > 0 &&
+                     stream_pipeline(filename, outputname, {{RESIZE_STEP, {GRAYSCALE, 0}, 0, (double)x_val, (double)y_val, NEAREST}});
+            }
+            else
+            {
+                // Get image (only read, so the cached copy is used as is)
+                shared_ptr<const Image> image = load_source_image(filename);
+                // Run effect
+                Image enlarged = process_6(*image,x_val,y_val);
+                if (enlarged.empty() && !image->empty())
+                {
+                    cout << endl << "Invalid scale: the enlarged image would be empty or too big!" << endl << endl;
+                    break;
+                }
+                ok = save_image(outputname, enlarged);
+            }
+            if (!ok)
+            {
+                cout << endl << "Could not apply enlarge!" << endl << endl;
+                break;
+            }
             cout << endl;
             cout << "Enlarge successfully applied!";
             break;
@@ -631,12 +9581,13 @@ int main()
             string outputname;
             cout << "Enter output BMP filename: ";
             cin >> outputname;
-            // Get image
-            vector<vector<Pixel>> image = read_image(filename);
-            // Apply effect
-            process_7(image);
-             // Save
-            write_image(outputname, image);
+            // Apply effect and save
+            bool ok = run_point_effect(filename, outputname, {HIGH_CONTRAST, 0});
+            if (!ok)
+            {
+                cout << endl << "Could not apply high contrast!" << endl << endl;
+                break;
+            }
             cout << endl;
             cout << "Successfully applied vignette!" << endl << endl;
             break;
@@ -651,11 +9602,13 @@ int main()
             cin >> outputname;
             cout << "Enter scaling factor: ";
             cin >> scaling;
-            // Get image 
-            vector<vector<Pixel>> image = read_image(filename);
-            // Apply effect
-            process_8(image, scaling);
-            write_image(outputname, image);
+            // Apply effect and save
+            bool ok = run_point_effect(filename, outputname, {LIGHTEN, scaling});
+            if (!ok)
+            {
+                cout << endl << "Could not apply lighten!" << endl << endl;
+                break;
+            }
             cout << endl;
             cout << "Successfully applied lighten!" << endl << endl;
             break;
@@ -670,11 +9623,13 @@ int main()
             cin >> outputname;
             cout << "Enter scaling factor: ";
             cin >> scaling;
-            // Get image 
-            vector<vector<Pixel>> image = read_image(filename);
-            // Apply effect
-            process_9(image, scaling);
-            write_image(outputname, image);
+            // Apply effect and save
+            bool ok = run_point_effect(filename, outputname, {DARKEN, scaling});
+            if (!ok)
+            {
+                cout << endl << "Could not apply darken!" << endl << endl;
+                break;
+            }
             cout << endl;
             cout << "Successfully applied darken!" << endl << endl;
             break;
@@ -685,15 +9640,111 @@ int main()
             string outputname;
             cout << "Enter output BMP filename: ";
             cin >> outputname;
-            // Get image 
-            vector<vector<Pixel>> image = read_image(filename);
-            // Apply effect
-            process_10(image);
-            write_image(outputname, image);
+            // Apply effect and save
+            bool ok = run_point_effect(filename, outputname, {FIVE_COLOR, 0});
+            if (!ok)
+            {
+                cout << endl << "Could not apply black, white, red, green, blue filter!" << endl << endl;
+                break;
+            }
             cout << endl;
             cout << "Successfully applied black, white, red, green, blue filter!" << endl << endl;
             break;
             }
+        case 11:
+        {
+            cout << "Resize selected" << endl;
+             // Get output name
+            string outputname;
+            cout << "Enter output BMP filename: ";
+            cin >> outputname;
+            // Get X and Y (fractions allowed, below 1 shrinks)
+            double x_scale;
+            double y_scale;
+            int filter;
+            cout << endl;
+            cout << "Enter X scale: ";
+            cin >> x_scale;
+            cout << endl;
+            cout << "Enter Y scale: ";
+            cin >> y_scale;
+            cout << endl;
+            cout << "Enter filter (0 nearest, 1 bilinear, 2 box): ";
+            cin >> filter;
+            if (filter < NEAREST || filter > BOX)
+            {
+                cout << "Invalid filter!" << endl << endl;
+                break;
+            }
+            bool ok;
+            if (use_stream)
+            {
+                ok = x_scale > 0 && y_scale > 0 &&
+                     stream_pipeline(filename, outputname, {{RESIZE_STEP, {GRAYSCALE, 0}, 0, x_scale, y_scale, (ResampleFilter)filter}});
+            }
+            else
+            {
+                // Get image (only read, so the cached copy is used as is)
+                shared_ptr<const Image> image = load_source_image(filename);
+                // Run effect
+                Image resized = scale_image(*image, x_scale, y_scale, (ResampleFilter)filter);
+                if (resized.empty() && !image->empty())
+                {
+                    cout << endl << "Invalid scale: the resized image would be empty or too big!" << endl << endl;
+                    break;
+                }
+                ok = save_image(outputname, resized);
+            }
+            if (!ok)
+            {
+                cout << endl << "Could not apply resize!" << endl << endl;
+                break;
+            }
+            cout << endl;
+            cout << "Resize successfully applied!" << endl << endl;
+            break;
+        }
+        case 12:
+        {
+            cout << "Chain effects selected" << endl;
+             // Get output name
+            string outputname;
+            cout << "Enter output BMP filename: ";
+            cin >> outputname;
+            // Get the chain
+            string chain;
+            vector<PipelineStep> steps;
+            cout << endl;
+            cout << "Enter effects separated by commas (e.g. grayscale,lighten:0.5,rotate:1,vignette)" << endl;
+            cout << "  vignette, clarendon:F, grayscale, rotate:N, enlarge:X:Y, high_contrast," << endl;
+            cout << "  lighten:F, darken:F, five_color, resize:X:Y[:nearest|bilinear|box]: ";
+            cin >> chain;
+            if (!parse_pipeline(chain, steps))
+            {
+                cout << "Invalid chain!" << endl << endl;
+                break;
+            }
+            bool ok;
+            if (use_stream)
+            {
+                ok = stream_pipeline(filename, outputname, steps);
+            }
+            else
+            {
+                // Get image
+                Image image = load_image(filename);
+                // Run the chain
+                ok = run_pipeline(image, steps) && save_image(outputname, image, chain_palette(steps));
+            }
+            if (!ok)
+            {
+                cout << endl << "Could not apply the chain!" << endl << endl;
+                break;
+            }
+            cout << endl;
+            cout << "Successfully applied the chain!" << endl << endl;
+            break;
+        }
         default:
             cout << "Invalid choice!" << endl;
             break;